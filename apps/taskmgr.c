@@ -0,0 +1,9 @@
+#include "sdk/mljos_api.h"
+#include "sdk/mljos_app.h"
+
+MLJOS_APP_DEFINE("Task Manager", MLJOS_APP_FLAG_TUI | MLJOS_APP_FLAG_GUI);
+
+// The task manager is built into the kernel; this image only makes it show up in the app list.
+MLJOS_APP_ENTRY void _start(mljos_api_t *api) {
+    if (api && api->launch_app) api->launch_app("taskmgr");
+}
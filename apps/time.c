@@ -10,10 +10,16 @@ MLJOS_APP_ENTRY void _start(mljos_api_t *api) {
         int last_ss = -1;
         int last_w = -1;
         int last_h = -1;
+        // With a timer the RTC is read a few times a second instead of on every loop.
+        int timed = api->set_timer && api->set_timer(250);
+        int tick = 1;
+        unsigned char hh = 0, mm = 0, ss = 0;
 
         for (;;) {
-            unsigned char hh, mm, ss;
-            api->get_time(&hh, &mm, &ss);
+            if (tick || !timed) {
+                tick = 0;
+                api->get_time(&hh, &mm, &ss);
+            }
 
             int w = (int)api->ui->screen_w();
             int h = (int)api->ui->screen_h();
@@ -125,6 +131,10 @@ MLJOS_APP_ENTRY void _start(mljos_api_t *api) {
             // Handle events
             mljos_ui_event_t ev;
             while (api->ui->poll_event(&ev)) {
+                if (ev.type == MLJOS_UI_EVENT_TIMER) {
+                    tick = 1;
+                    continue;
+                }
                 if (ev.type == MLJOS_UI_EVENT_EXPOSE) {
                     last_ss = -1;
                     continue;
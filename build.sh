@@ -18,6 +18,9 @@ ISO_IMAGE="$BUILD_DIR/mljOS.iso"
 INCLUDE_FLAGS="-I$ROOT_DIR/include -I$GENERATED_INCLUDE_DIR"
 CFLAGS="-m64 -nostdlib -nostdinc -ffreestanding -fno-builtin -fno-stack-protector -fno-pie -mno-red-zone"
 APP_CFLAGS="$CFLAGS -fno-asynchronous-unwind-tables -fno-unwind-tables"
+# Vector registers belong to the running app and are only switched lazily (see fpu.h), so
+# kernel code must not touch them outside KERNEL_FPU_FN functions.
+KERNEL_CFLAGS="$CFLAGS -mgeneral-regs-only"
 
 DEPS="gcc-x86-64-linux-gnu binutils-x86-64-linux-gnu nasm grub-pc-bin grub-efi-amd64-bin grub-common xorriso mtools ovmf git make gcc clang lld autoconf automake libtool mtools nasm"
 
@@ -219,7 +222,7 @@ echo "Compiling kernel sources..."
 OBJECTS=""
 for src in "$ROOT_DIR"/src/*.c; do
     obj="$OBJ_DIR/$(basename "${src%.c}").o"
-    x86_64-linux-gnu-gcc $CFLAGS $INCLUDE_FLAGS -c "$src" -o "$obj"
+    x86_64-linux-gnu-gcc $KERNEL_CFLAGS $INCLUDE_FLAGS -c "$src" -o "$obj"
     OBJECTS="$OBJECTS $obj"
 done
 
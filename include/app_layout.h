@@ -2,12 +2,20 @@
 #define APP_LAYOUT_H
 
 // Virtual address where .app images are mapped inside each task address space.
-// Must be 2MiB-aligned because tasks map apps via a single 2MiB page.
+// Must be 2MiB-aligned: the window is backed by whole page tables of 4KiB pages.
 //
 // NOTE: Do not place this in low memory (e.g. 0x800000) because kernel heap
 // allocations can grow into that range and would get shadowed by the per-task
 // app mapping.
 #define MLJOS_APP_VADDR 0x40000000ULL
-#define MLJOS_APP_REGION_SIZE (2 * 1024 * 1024ULL)
+// Size of the per-task app window (image + everything the app touches). Pages are mapped on
+// first touch, so only what an app actually uses costs RAM.
+#define MLJOS_APP_MAX_SIZE (32 * 1024 * 1024ULL)
+// Shared-memory window right after the app window. Each 2MiB slot is one page-directory entry
+// that points at a page table owned by a shared-memory object (see shm.h), so an object is
+// mapped into a task by filling in a few PDEs.
+#define MLJOS_SHM_VADDR (MLJOS_APP_VADDR + MLJOS_APP_MAX_SIZE)
+#define MLJOS_SHM_MAX_SIZE (32 * 1024 * 1024ULL)
+#define MLJOS_SHM_SLOTS (MLJOS_SHM_MAX_SIZE / (2 * 1024 * 1024ULL))
 
 #endif
@@ -0,0 +1,53 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include "common.h"
+
+// Sector cache between the FAT32 code and the disk backends (ATA, AHCI, USB), keyed by
+// (device index, LBA) with LRU replacement. Write-through by default: writes reach the device
+// before they are cached. In write-back mode writes only dirty the cache and reach the device
+// on eviction, bcache_flush() or when too much is dirty. Runs under the kernel lock.
+#define BCACHE_SECTOR_SIZE 512
+#define BCACHE_ENTRIES 1024
+
+typedef int (*bcache_read_fn_t)(int dev, uint32_t lba, uint8_t *buf);
+typedef int (*bcache_write_fn_t)(int dev, uint32_t lba, const uint8_t *buf);
+typedef int (*bcache_read_many_fn_t)(int dev, uint32_t lba, uint32_t count, uint8_t *buf);
+typedef int (*bcache_write_many_fn_t)(int dev, uint32_t lba, uint32_t count, const uint8_t *buf);
+
+typedef struct bcache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t writes;
+    uint64_t writebacks;      // dirty sectors written to the device
+    uint64_t evictions;
+    uint64_t range_reads;     // multi-sector transfers that went to the device
+    uint64_t range_writes;
+    uint32_t cached;          // sectors held now
+    uint32_t dirty;
+    int write_back;
+} bcache_stats_t;
+
+// Backend that does the real I/O. Call before anything else. The range callbacks may be NULL,
+// ranges are then split into single sectors.
+void bcache_init(bcache_read_fn_t read, bcache_write_fn_t write,
+                 bcache_read_many_fn_t read_many, bcache_write_many_fn_t write_many);
+int bcache_read(int dev, uint32_t lba, uint8_t *buf);
+int bcache_write(int dev, uint32_t lba, const uint8_t *buf);
+// Multi-sector transfers for bulk file data. They go to the device as one request and are not
+// added to the cache (a large file would flush it), but stay coherent with what it holds.
+int bcache_read_many(int dev, uint32_t lba, uint32_t count, uint8_t *buf);
+int bcache_write_many(int dev, uint32_t lba, uint32_t count, const uint8_t *buf);
+// Writes dirty sectors of `dev` (-1 = every device) back. Returns 0 if a write failed.
+int bcache_flush(int dev);
+// For I/O that bypasses the cache: before reading a range from the device, write back what is
+// dirty in it; before overwriting a range, forget it (dirty sectors included).
+int bcache_flush_range(int dev, uint32_t lba, uint32_t count);
+void bcache_drop_range(int dev, uint32_t lba, uint32_t count);
+// Flushes, then forgets every sector of `dev` (-1 = every device).
+void bcache_invalidate(int dev);
+// Switching back to write-through flushes first.
+void bcache_set_write_back(int on);
+void bcache_get_stats(bcache_stats_t *out);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef CHAN_H
+#define CHAN_H
+
+#include "common.h"
+#include "task.h"
+
+// Message channels between tasks. A channel is a bounded queue of length-prefixed messages in a
+// ring of kernel pages; every task mapping the kernel (apps included) can be copied into and
+// out of it directly, so a message costs one copy in and one copy out. Handles are 1..CHAN_MAX
+// and only usable by tasks holding them (task_t.chan_held); the creator holds its channel and
+// can grant it to another task, e.g. a child it launches. A channel is freed once the last
+// holder closes it or exits. Everything here runs under the kernel lock.
+#define CHAN_MAX 64
+#define CHAN_RING_SIZE (16 * 1024)
+#define CHAN_MSG_MAX 4096
+
+// Returns a new channel held by the current task, or 0.
+int chan_create(void);
+// Gives `t` a reference to channel `ch` held by the current task. Returns 0 on a bad handle.
+int chan_grant(task_t *t, int ch);
+void chan_close(int ch);
+// Drops every channel `t` still holds. Called when the task is reaped.
+void chan_release_all(task_t *t);
+
+// Queues a message of `size` <= CHAN_MSG_MAX bytes. With `block`, waits for ring space. Returns
+// 0 if it does not fit, the handle is bad or no other task holds the channel.
+int chan_send(int ch, const void *data, uint32_t size, int block);
+// Takes the oldest message: copies up to `max` bytes (the rest is dropped) and returns its full
+// size. With `block`, waits for one. Returns -1 if there is none (or no other holder is left).
+int chan_recv(int ch, void *buf, uint32_t max, int block);
+// Waits up to `timeout_ms` (0 = only check) for a message. Returns 1 if one is queued.
+int chan_wait(int ch, uint32_t timeout_ms);
+
+#endif
@@ -39,6 +39,53 @@ typedef struct {
     uint64_t rip, cs, rflags, rsp, ss;
 } interrupt_frame_t;
 
+typedef void (*isr_handler_t)(interrupt_frame_t *frame);
+
+// Legacy PIC IRQs are remapped to vectors CPU_IRQ_BASE..CPU_IRQ_BASE+15.
+#define CPU_IRQ_BASE 32
+// Local APIC vectors (see smp.c).
+#define CPU_LAPIC_TIMER_VECTOR 48
+#define CPU_RESCHED_VECTOR 49
+// MSI vector of the AHCI host adapters (see disk.c).
+#define CPU_AHCI_VECTOR 50
+#define CPU_SPURIOUS_VECTOR 255
+
 void cpu_init(void);
+// Loads the BSP's GDT and IDT on an application processor.
+void cpu_init_ap(void);
+// Routes a vector to a C handler; vectors without one end up in the generic exception handler.
+void cpu_set_isr_handler(int vector, isr_handler_t handler);
+// The handler routed to `vector`, NULL if none.
+isr_handler_t cpu_get_isr_handler(int vector);
+
+// Process-context identifiers. cpu_init() turns on CR4.PCIDE when CPUID reports PCID.
+int cpu_pcid_enabled(void);
+int cpu_has_invpcid(void);
+// INVPCID type 1: drops every non-global translation tagged with `pcid`.
+void cpu_invpcid_single(uint16_t pcid);
+// Drops every TLB entry for every PCID (toggles CR4.PGE).
+void cpu_flush_tlb_all(void);
+uint64_t cpu_rdtsc(void);
+uint64_t cpu_rdmsr(uint32_t msr);
+void cpu_wrmsr(uint32_t msr, uint64_t value);
+
+// 8259 PIC control. IRQ handlers must call cpu_irq_eoi() before they return or switch away.
+void cpu_irq_unmask(int irq);
+void cpu_irq_mask(int irq);
+void cpu_irq_eoi(int irq);
+
+static inline void cpu_sti(void) { __asm__ volatile ("sti" ::: "memory"); }
+static inline void cpu_cli(void) { __asm__ volatile ("cli" ::: "memory"); }
+
+// Disables interrupts and returns the previous RFLAGS for cpu_irq_restore().
+static inline uint64_t cpu_irq_save(void) {
+    uint64_t flags;
+    __asm__ volatile ("pushfq; popq %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void cpu_irq_restore(uint64_t flags) {
+    if (flags & (1ULL << 9)) cpu_sti();
+}
 
 #endif
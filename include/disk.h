@@ -18,6 +18,8 @@ void cmd_disk_mkdir(const char *path);
 void cmd_disk_write(const char *path, const char *text);
 void cmd_disk_cat(const char *path);
 void cmd_disk_rm(const char *path);
+// Moves a fragmented file into one contiguous run of clusters.
+void cmd_disk_defrag(const char *path);
 const char *disk_get_cwd_path(void);
 void disk_prepare_session(void);
 void cmd_disk_install(void);
@@ -32,7 +34,16 @@ int disk_read_file(const char *path, char *out, int maxlen, uint32_t *size_out);
 // Reads up to `maxlen` bytes from a file (binary-safe). Unlike disk_read_file,
 // does not require the file to fit in the buffer.
 int disk_read_file_prefix(const char *path, char *out, int maxlen, uint32_t *bytes_read_out);
+// Size of a regular file, so callers can size their buffer before disk_read_file.
+int disk_file_size(const char *path, uint32_t *size_out);
 int disk_touch_file(const char *path);
 int disk_copy_file(const char *src_path, const char *dst_path);
+// Whether another task is inside a long exclusive disk operation (format, install).
+int disk_is_busy(void);
+// Writes sectors held dirty by the block cache (write-back mode). Returns 0 on a write error
+// or while another task holds the disk (see disk_is_busy()).
+int disk_sync(void);
+// `disk cache [writeback|writethrough|flush]`: switches the block cache mode, prints its stats.
+void cmd_disk_cache(const char *arg);
 
 #endif
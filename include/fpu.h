@@ -0,0 +1,35 @@
+#ifndef FPU_H
+#define FPU_H
+
+#include "common.h"
+
+struct task;
+struct cpu_local;
+
+// x87/SSE/AVX state is switched lazily. Every task starts its run with CR0.TS set; the first
+// vector instruction traps (#NM) and loads the task's state, and only then is the state saved
+// again when the task switches out. Tasks that never touch vector registers pay nothing.
+//
+// The kernel itself is built with -mgeneral-regs-only: interrupt handlers and API calls run on
+// top of an app's live vector state. Hot loops that want SSE are marked KERNEL_FPU_FN and
+// called between kernel_fpu_begin() and kernel_fpu_end(), with no yield or wait in between.
+#define KERNEL_FPU_FN __attribute__((target("sse2"), noinline))
+
+// Largest save area in use: XSAVE with x87, SSE and AVX (832 bytes), or FXSAVE (512 bytes).
+#define FPU_AREA_MAX 1024
+
+// Turns on SSE (and XSAVE/AVX when present) and installs the #NM handler. BSP, from cpu_init().
+void fpu_init(void);
+// Same CR0/CR4/XCR0 setup on an application processor.
+void fpu_init_ap(void);
+
+// Gives a task (new or recycled) a save area in the initial state. Returns 0 without memory.
+int fpu_task_init(struct task *t);
+// Scheduler hooks around the switch into and out of `t` on this CPU.
+void fpu_switch_in(struct cpu_local *cpu, struct task *t);
+void fpu_switch_out(struct cpu_local *cpu, struct task *t);
+
+void kernel_fpu_begin(void);
+void kernel_fpu_end(void);
+
+#endif
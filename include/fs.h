@@ -61,5 +61,7 @@ int fs_read_file(const char *path, char *out, int maxlen, uint32_t *size_out);
 // not require the file to fit in the buffer and does not NUL-terminate.
 int fs_read_file_prefix(const char *path, char *out, int maxlen, uint32_t *bytes_read_out);
 int fs_write_file(const char *path, const char *data, uint32_t size);
+// Size of a readable regular file. fs_read_file needs a buffer of at least size + 1.
+int fs_file_size(const char *path, uint32_t *size_out);
 
 #endif
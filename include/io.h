@@ -33,4 +33,15 @@ static inline uint32_t inl(uint16_t port) {
     return ret;
 }
 
+// `count` 16-bit words to or from a data port in a single REP instruction.
+static inline void insw(uint16_t port, void *buffer, uint32_t count) {
+    uint64_t n = count;
+    __asm__ volatile ("rep insw" : "+D"(buffer), "+c"(n) : "d"(port) : "memory");
+}
+
+static inline void outsw(uint16_t port, const void *buffer, uint32_t count) {
+    uint64_t n = count;
+    __asm__ volatile ("rep outsw" : "+S"(buffer), "+c"(n) : "d"(port) : "memory");
+}
+
 #endif
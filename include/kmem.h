@@ -3,10 +3,28 @@
 
 #include "common.h"
 
+typedef struct kmem_stats {
+    uint64_t heap_bytes;     // arena carved so far (blocks in use, cached or free)
+    uint64_t reserve_bytes;  // untouched space the heap can still grow into
+    uint64_t live_bytes;     // bytes in blocks currently handed out (incl. headers)
+    uint64_t live_blocks;
+    uint64_t free_bytes;     // bytes on free lists (coalesced + small-class caches)
+    uint64_t free_blocks;
+    uint64_t cached_bytes;   // part of free_bytes parked on small size-class lists
+    uint64_t largest_free;   // largest coalesced free block
+    uint64_t alloc_count;
+    uint64_t free_count;
+} kmem_stats_t;
+
 void kmem_init(void);
+// Returns NULL when the heap is exhausted. `align` must be a power of two (minimum 16).
 void *kmem_alloc(uint64_t size, uint64_t align);
+// Releases a block from kmem_alloc/kmem_realloc. NULL and non-heap pointers are ignored.
+void kmem_free(void *ptr);
+// Resizes a block (16-byte alignment is guaranteed for the result, larger alignments are not).
+void *kmem_realloc(void *ptr, uint64_t size);
+void kmem_get_stats(kmem_stats_t *out);
 void kmem_memset(void *dst, uint8_t value, uint64_t size);
 void kmem_memcpy(void *dst, const void *src, uint64_t size);
 
 #endif
-
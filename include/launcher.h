@@ -8,5 +8,8 @@ int launcher_launch_gui(const char *name);
 // Launches a GUI windowed app and provides a path for it to open
 int launcher_launch_gui_args(const char *name, const char *open_path);
 
+// Same, and hands message channel `chan` (held by the caller, see chan.h) to the app.
+int launcher_launch_gui_chan(const char *name, const char *open_path, int chan);
+
 #endif
 
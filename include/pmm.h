@@ -0,0 +1,44 @@
+#ifndef PMM_H
+#define PMM_H
+
+#include "common.h"
+
+// Physical page-frame allocator. Frames are tracked in a bitmap built from the bootloader
+// memory map; only the identity-mapped first 4GiB is managed.
+#define PMM_FRAME_SIZE 4096ULL
+#define PMM_LARGE_FRAME_SIZE (2 * 1024 * 1024ULL)
+
+typedef struct pmm_stats {
+    uint64_t total_bytes;    // usable RAM reported by the memory map (below 4GiB)
+    uint64_t free_bytes;     // frames not handed out or reserved
+    uint64_t free_large;     // fully free, 2MiB-aligned 2MiB frames
+    uint64_t highest_addr;   // end of the highest usable frame
+} pmm_stats_t;
+
+// Marks everything reserved. The boot code then feeds the Multiboot2 memory map through
+// pmm_add_region(): boot.asm is only entered through Multiboot2, with an identity map.
+void pmm_init(void);
+// Feeds one memory-map entry. Usable ranges are shrunk to whole frames, reserved ones grown.
+void pmm_add_region(uint64_t base, uint64_t length, int usable);
+// Re-applies reserved ranges and protects the kernel image, low 1MiB, boot info and the
+// per-task app window. Call once after all pmm_add_region() calls.
+void pmm_finalize(uintptr_t boot_info, uint32_t boot_info_size);
+
+// Contiguous 4KiB frames, taken from the top of memory. Returns 0 when nothing fits.
+uint64_t pmm_alloc_frames(uint64_t count);
+// One 2MiB-aligned 2MiB frame. Returns 0 when no such frame is fully free.
+uint64_t pmm_alloc_large(void);
+void pmm_free_frames(uint64_t phys, uint64_t count);
+void pmm_free_large(uint64_t phys);
+
+// Claims the frames covering [phys, phys + bytes) if all of them are free (used by the heap
+// to grow in place). Returns 1 on success.
+int pmm_claim(uint64_t phys, uint64_t bytes);
+// Bytes of consecutive free frames starting at `phys`, capped at `limit`.
+uint64_t pmm_free_run(uint64_t phys, uint64_t limit);
+// Largest run of free frames inside [lo, hi). Returns its length, 0 if none.
+uint64_t pmm_largest_run(uint64_t lo, uint64_t hi, uint64_t *out_base);
+
+void pmm_get_stats(pmm_stats_t *out);
+
+#endif
@@ -6,6 +6,9 @@
 // Launch flags
 #define MLJOS_LAUNCH_GUI  (1u << 0)
 
+#define MLJOS_CHAN_MSG_MAX 4096
+#define MLJOS_SHM_MAX_OBJECT (8 * 1024 * 1024U)
+
 typedef enum {
     MLJOS_UI_EVENT_NONE = 0,
     MLJOS_UI_EVENT_KEY_DOWN = 1,
@@ -16,6 +19,8 @@ typedef enum {
     MLJOS_UI_EVENT_MOUSE_WHEEL = 5,
     // Request app to repaint (e.g. after window move/show/restore)
     MLJOS_UI_EVENT_EXPOSE = 6,
+    // Periodic timer from mljos_api_t.set_timer: `key` = expirations since the last one.
+    MLJOS_UI_EVENT_TIMER = 7,
 } mljos_ui_event_type_t;
 
 typedef struct {
@@ -78,6 +83,36 @@ typedef struct {
     // GUI mode / graphics (optional)
     uint32_t launch_flags;   // MLJOS_LAUNCH_*
     mljos_ui_api_t *ui;      // NULL if UI is unavailable
+
+    // Time (optional; may be NULL on older runtimes)
+    // Monotonic nanoseconds since boot.
+    uint64_t (*now_ns)(void);
+    // Blocks for at least `ms` milliseconds without using CPU time.
+    void (*sleep_ms)(uint32_t ms);
+    // Delivers MLJOS_UI_EVENT_TIMER through ui->poll_event every `interval_ms`; 0 stops it.
+    int (*set_timer)(uint32_t interval_ms);
+
+    // Message channels between tasks (optional; may be NULL on older runtimes). A channel is a
+    // bounded queue of messages of up to MLJOS_CHAN_MSG_MAX bytes; handles are > 0.
+    int (*chan_create)(void);
+    // Returns 1 once queued; 0 if it does not fit (without `block`) or no other task holds it.
+    int (*chan_send)(int ch, const void *data, uint32_t size, int block);
+    // Copies the oldest message (up to `max` bytes) and returns its size, -1 if there is none.
+    int (*chan_recv)(int ch, void *buf, uint32_t max, int block);
+    // Waits up to `timeout_ms` (0 = only check) for a message; returns 1 if one is queued.
+    int (*chan_wait)(int ch, uint32_t timeout_ms);
+    void (*chan_close)(int ch);
+    // Like launch_app_args, and the child also holds channel `ch` (see launch_chan).
+    int (*launch_app_chan)(const char *name_or_path, const char *open_path, int ch);
+    int launch_chan;         // channel handed over by the parent, 0 if none
+
+    // Named shared memory (optional; may be NULL on older runtimes). Maps object `name` into the
+    // app, creating it zeroed with `size` bytes (up to MLJOS_SHM_MAX_OBJECT) if it does not
+    // exist; size 0 only opens. Other apps opening the same name see the same memory, possibly
+    // at another address. Returns NULL on failure.
+    void *(*shm_open)(const char *name, uint32_t size, uint32_t *size_out);
+    // Unmaps it again; it is freed once no app has it mapped. Exiting unmaps everything.
+    int (*shm_close)(void *addr);
 } mljos_api_t;
 
 #endif
@@ -0,0 +1,26 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include "common.h"
+#include "task.h"
+
+// Named shared-memory objects. An object is a set of zeroed 4KiB frames described by its own
+// page tables (one per 2MiB), and attaching it to a task points a few page-directory entries of
+// the task's shared window (MLJOS_SHM_VADDR) at those tables: no per-task page tables, no
+// copies. Objects are reference counted by attachment and destroyed, frames and all, when the
+// last task detaches or exits. Everything here runs under the kernel lock.
+#define SHM_MAX_OBJECTS 32
+#define SHM_NAME_MAX 32
+#define SHM_MAX_SIZE (8 * 1024 * 1024U)
+
+// Attaches object `name` to the current task, creating it with `size` bytes if it does not
+// exist (size 0 = only open an existing one; opening one smaller than `size` fails). Returns
+// its address in the task's shared window (the same object may sit at different addresses in
+// different tasks) and its size through `size_out`, or NULL.
+void *shm_open(const char *name, uint32_t size, uint32_t *size_out);
+// Detaches the object mapped at `addr` from the current task. Returns 0 if there is none.
+int shm_close(void *addr);
+// Detaches everything `t` still has attached. Called when the task is reaped.
+void shm_release_all(task_t *t);
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include "common.h"
+#include "spinlock.h"
+#include "task.h"
+
+#define SMP_MAX_CPUS 8
+
+// Per-CPU area, reached through IA32_GS_BASE. `self` must stay the first field so that
+// smp_this_cpu() is a single %gs:0 load.
+typedef struct cpu_local {
+    struct cpu_local *self;
+    uint32_t index;               // 0 = bootstrap processor
+    uint32_t apic_id;
+    volatile int online;
+    task_t *current;              // task running on this CPU, NULL in the scheduler loop
+    task_context_t kernel_ctx;    // scheduler loop context tasks switch back to
+    // Runnable tasks waiting for this CPU, linked through task_t.rq_next, oldest first. Idle
+    // CPUs steal from the head of the longest queue.
+    spinlock_t rq_lock;
+    task_t *rq_head;
+    task_t *rq_tail;
+    uint32_t rq_count;
+    // Accounting, in TSC cycles since the CPU came online.
+    uint64_t start_tsc;
+    uint64_t busy_tsc;            // time spent inside tasks
+    uint64_t sched_tsc;           // time spent in task_schedule_once() outside tasks
+    uint64_t idle_tsc;            // time spent halted in smp_idle()
+    volatile int idle;            // set while halted; wakers send a reschedule IPI
+    uint64_t switches;
+    uint64_t steals;
+    // Lazy FPU switching: whose state is in this CPU's vector registers, and a copy of CR0.TS.
+    task_t *fpu_owner;
+    int fpu_ts;
+} cpu_local_t;
+
+static inline cpu_local_t *smp_this_cpu(void) {
+    cpu_local_t *c;
+    __asm__ volatile ("mov %%gs:0, %0" : "=r"(c));
+    return c;
+}
+
+// Sets up the BSP's per-CPU area. Call first thing in kernel_main: even the console asks for
+// the current task.
+void smp_init_bsp(void);
+// Enables the local APIC, calibrates its timer against the PIT and starts the application
+// processors with INIT/SIPI. Needs timer_init() and interrupts enabled on the BSP.
+void smp_start_aps(void);
+
+// Halts this CPU until the next interrupt unless a task became runnable meanwhile.
+void smp_idle(void);
+// Wakes CPU `index` with a reschedule IPI if it is halted in smp_idle().
+void smp_kick(uint32_t index);
+
+// For MSIs: the BSP's local APIC ID, or -1 until smp_start_aps() has enabled the LAPIC.
+// Handlers of MSI vectors end with smp_lapic_eoi().
+int smp_msi_apic_id(void);
+void smp_lapic_eoi(void);
+
+uint32_t smp_cpu_count(void);
+cpu_local_t *smp_cpu(uint32_t index);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include "common.h"
+#include "cpu.h"
+
+// Test-and-test-and-set lock. Not recursive; never hold one across task_yield().
+typedef struct spinlock {
+    volatile uint32_t locked;
+} spinlock_t;
+
+#define SPINLOCK_INIT { 0 }
+
+static inline int spin_trylock(spinlock_t *l) {
+    return __atomic_exchange_n(&l->locked, 1, __ATOMIC_ACQUIRE) == 0;
+}
+
+static inline void spin_lock(spinlock_t *l) {
+    while (!spin_trylock(l)) {
+        while (l->locked) __asm__ volatile ("pause");
+    }
+}
+
+static inline void spin_unlock(spinlock_t *l) {
+    __atomic_store_n(&l->locked, 0, __ATOMIC_RELEASE);
+}
+
+// For locks also taken from interrupt handlers: keeps this CPU's IRQs off while held.
+static inline uint64_t spin_lock_irqsave(spinlock_t *l) {
+    uint64_t flags = cpu_irq_save();
+    spin_lock(l);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *l, uint64_t flags) {
+    spin_unlock(l);
+    cpu_irq_restore(flags);
+}
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef MLJOS_STDINT_H
+#define MLJOS_STDINT_H
+
+// The kernel builds with -nostdinc; third-party headers such as limine.h that include
+// <stdint.h> pick up the fixed-width types from here.
+#include "common.h"
+
+#endif
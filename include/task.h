@@ -1,8 +1,12 @@
 #ifndef TASK_H
 #define TASK_H
 
+#include "app_layout.h"
 #include "common.h"
+#include "cpu.h"
 #include "sdk/mljos_api.h"
+#include "spinlock.h"
+#include "timer.h"
 
 typedef struct console console_t;
 
@@ -11,6 +15,7 @@ typedef enum {
     TASK_RUNNABLE = 1,
     TASK_PAUSED = 2,
     TASK_DEAD = 3,
+    TASK_BLOCKED = 4,   // waiting on a wait queue and/or a timeout
 } task_state_t;
 
 typedef struct task_context {
@@ -31,33 +36,106 @@ typedef struct fs_node fs_node_t;
 
 typedef void (*task_entry_t)(void *arg);
 
+struct task;
+
+// Tasks blocked on an event. An all-zero wait_queue_t is a valid empty queue.
+typedef struct wait_queue {
+    spinlock_t lock;
+    struct task *head;
+} wait_queue_t;
+
+// Shell state of a task. Only the shell running inside the task touches it, so it lives
+// outside the task_t the scheduler walks.
+typedef struct task_shell {
+    int active_storage;
+    int location;
+    uint32_t launch_flags;
+    char open_path[128];
+    void *jmp_env[8];
+    int jmp_ready;
+    char history[16][128];
+    int history_count;
+    int history_pos;
+} task_shell_t;
+
 typedef struct task {
     task_state_t state;
     const char *name;
+    uint32_t id;              // 1..TASK_MAX_IDS-1, doubles as the PCID
+    uint64_t seq;             // allocation number; unlike `id` and the task_t, never reused
     task_context_t ctx;
     task_entry_t entry;
     void *arg;
     struct wm_window *window; // owned UI window (may be NULL)
     console_t *console;       // optional per-task console (Terminal)
     fs_node_t *fs_cwd;        // per-task current directory (RAM FS)
-    int shell_active_storage;
-    int shell_location;
-    uint32_t shell_launch_flags;
-    char shell_open_path[128];
-    void *shell_jmp_env[8];
-    int shell_jmp_ready;
-    char shell_history[16][128];
-    int shell_history_count;
-    int shell_history_pos;
+    task_shell_t *shell;
     mljos_api_t api;
     uint8_t killed;
+    // Memory owned by the task, released once it is reaped.
+    void *stack;              // kernel heap
+    void *page_tables;        // 6 physical frames: PML4, PDPT, PD0..PD3
+    uint32_t app_pages;       // 4KiB data pages mapped in the app window
+    uint32_t slice_ticks;     // timer ticks used in the current time slice
+    uint32_t lock_depth;      // kernel_lock() nesting; > 0 while in kernel code
+    uint32_t tlb_gen;         // address-space generation, see task_tlb_sync()
+    void *api_gate;           // app tasks: gated copy of `api` handed to the app
+    uint32_t cpu;             // CPU the task last ran on / is queued on
+    // Run queue link (see smp.h). A task that is neither running nor runnable is parked: it
+    // sits on no queue until task_wake() or task_set_paused() puts it back on `cpu`'s queue.
+    struct task *rq_next;     // also links free task_t's
+    uint8_t parked;
+    // Blocking (see task_wait_prepare()).
+    wait_queue_t *wait_on;
+    struct task *wait_next;
+    ktimer_t wake_timer;      // armed while a wait has a timeout
+    // App timer (see mljos_api_t.set_timer): expirations not yet reported by poll_event.
+    ktimer_t app_timer;
+    volatile uint32_t app_timer_fired;
+    uint8_t shm_slot[MLJOS_SHM_SLOTS]; // shared-memory object + 1 mapped at each slot (shm.h)
+    uint64_t chan_held;       // message channels the task holds, bit i = handle i + 1 (chan.h)
+    // CPU accounting in TSC cycles, updated around every switch by task_schedule_once().
+    uint64_t run_tsc;         // total time on a CPU
+    uint64_t stretch_tsc;     // start of the current run, 0 while switched out
+    uint64_t max_stretch_tsc; // longest run without switching out
+    uint64_t last_out_tsc;    // when it last switched out
+    uint32_t switches;        // times switched in
+    uint32_t preemptions;     // runs ended by the timer instead of the task
+    struct task *all_next;    // every task_t ever allocated, see task_list()
+    // Vector register state, saved lazily (see fpu.h). The area stays with the task_t.
+    void *fpu_area;
+    uint8_t fpu_valid;        // fpu_area holds the task's state, not just zeroes
+    uint32_t fpu_cpu;         // CPU whose registers were last loaded from fpu_area
 } task_t;
 
+// Snapshot of one task for ps/top and the task manager.
+typedef struct task_info {
+    uint32_t id;
+    char name[24];
+    task_state_t state;
+    uint32_t cpu;
+    int running;
+    uint64_t run_tsc;
+    uint64_t max_stretch_tsc;
+    uint64_t stretch_tsc;     // running: time since it was switched in; else since it left
+    uint32_t switches;
+    uint32_t preemptions;
+} task_info_t;
+
+// Upper bound on live tasks; ids (and PCIDs) are 1..TASK_MAX_IDS-1.
+#define TASK_MAX_IDS 1024
+
 void task_init(void);
 
 task_t *task_current(void);
 mljos_api_t *task_current_api(void);
 
+// Big kernel lock around the WM, console, disk, FS, net and kernel heap. Recursive per task.
+// Kernel tasks hold it whenever they run and app tasks take it for each API call; the
+// scheduler drops it on a task's behalf while the task is switched out.
+void kernel_lock(void);
+void kernel_unlock(void);
+
 // Creates a kernel-mode task with its own stack and address space (separate CR3),
 // but not loaded from an app image.
 task_t *task_create_kernel(const char *name, task_entry_t entry, void *arg);
@@ -73,13 +151,80 @@ int task_is_alive(const task_t *t);
 // Called by tasks to cooperatively yield back to the kernel scheduler.
 void task_yield(void);
 
+// Blocking. Without lost wake-ups, the pattern is:
+//     task_wait_prepare(wq, timeout);
+//     if (!condition) task_yield();
+//     task_wait_finish(wq);
+// and the condition is re-checked in a loop. prepare marks the current task BLOCKED and links
+// it on `wq` (which may be NULL for a plain sleep); the scheduler does not run it again until
+// wait_queue_wake_all(), the timeout (in timer ticks, 0 = none) or task_kill() makes it
+// runnable. finish unlinks it whatever woke it.
+void task_wait_prepare(wait_queue_t *wq, uint32_t timeout_ticks);
+void task_wait_finish(wait_queue_t *wq);
+// Wakes every task blocked on `wq`. Safe from interrupt handlers and other CPUs.
+void wait_queue_wake_all(wait_queue_t *wq);
+// Sleeps for at least `ticks` timer ticks.
+void task_sleep_ticks(uint32_t ticks);
+void task_sleep_ms(uint32_t ms);
+
+// Periodic timer of the current task, every `interval_ms` (0 stops it). Each expiry wakes the
+// task and is counted until task_take_timer_expirations(). Returns 0 without a current task.
+int task_set_timer(uint32_t interval_ms);
+uint32_t task_take_timer_expirations(task_t *t);
+
 // Marks current task dead and yields (never returns).
 __attribute__((noreturn)) void task_exit(void);
 
-// Run one scheduling quantum (switches into one runnable task).
-void task_schedule_once(void);
+// Run one scheduling quantum on this CPU: the first runnable task of its run queue, or one
+// stolen from the longest queue of another CPU. Must be called without the kernel lock.
+// Returns 0 when nothing was runnable (the caller may idle).
+// A task that exited during the quantum is reaped: its console and app pages are freed,
+// its stack and page tables are pooled for the next launch (or freed when the pool is
+// full) and its task_t goes back to a free list (task_t's are never returned to the heap,
+// so stale task pointers still read a valid state).
+int task_schedule_once(void);
+// Whether any run queue is non-empty (lock-free snapshot, used before idling).
+int task_any_runnable(void);
+
+// Zeroes a few free frames ahead of time for demand paging. Called from the kernel loop.
+void task_pool_scrub(void);
+
+// Page-fault hook: maps a zeroed page for a not-present fault inside the current task's
+// app window. Returns 0 if the fault is not a demand fault (or memory is exhausted).
+int task_handle_page_fault(uint64_t addr, uint64_t error_code);
+
+// Points `count` consecutive PD slots of t's shared-memory window, from `slot` on, at the page
+// tables `pts` (physical addresses).
+void task_shm_map(task_t *t, uint32_t slot, const uint64_t *pts, uint32_t count);
+// Clears those slots again. Translations cached for `t` are dropped before it next runs.
+void task_shm_unmap(task_t *t, uint32_t slot, uint32_t count);
+
+// Unmaps the whole app window of the current task so an image can be loaded in place.
+// Returns 0 when there is no current task.
+int task_reset_app_space(void);
+
+// Microbenchmark: `rounds` task->kernel->task switch pairs from the current task, reading
+// `touch_pages` app pages after each (pages the app never touched are mapped for the run only). With `no_flush` (and PCIDs available) CR3 loads keep the
+// TLB. Returns average TSC cycles per round trip, 0 if it cannot run.
+uint64_t task_bench_switch(uint32_t rounds, uint32_t touch_pages, int no_flush);
+
+// Time-slice length for preemption (clamped to at least one timer tick).
+void task_set_quantum_ms(uint32_t ms);
+uint32_t task_get_quantum_ms(void);
+
+// Called from the timer IRQ (PIT on the BSP, LAPIC timer on the APs). Once the running task
+// has used up its quantum it is preempted back to the scheduler loop, but only while it
+// executes app code: kernel code (WM, FS, disk) is never preempted, so it never switches out
+// half-way through updating shared state.
+void task_timer_tick(interrupt_frame_t *frame);
 
 // Ask a task to exit when it next yields.
 void task_kill(task_t *t);
 
+// Copies up to `max` live tasks into `out` and returns how many were written. Call under the
+// kernel lock.
+int task_list(task_info_t *out, int max);
+// Cycles the scheduler loops spent picking, switching and reaping tasks, summed over all CPUs.
+uint64_t task_sched_overhead_tsc(void);
+
 #endif
@@ -0,0 +1,7 @@
+#ifndef TASKMGR_APP_H
+#define TASKMGR_APP_H
+
+// Opens the task manager window, or focuses it if it is already open. Returns 1 on success.
+int taskmgr_spawn(void);
+
+#endif
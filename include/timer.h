@@ -0,0 +1,41 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include "common.h"
+
+// System tick from PIT channel 0 (IRQ0).
+#define TIMER_HZ 1000
+
+void timer_init(void);
+// Ticks since timer_init(); one tick is 1000 / TIMER_HZ milliseconds.
+uint64_t timer_ticks(void);
+// TSC cycles per millisecond, measured against the PIT during the first few hundred ticks.
+// 0 until the measurement is done.
+uint64_t timer_tsc_per_ms(void);
+// Monotonic nanoseconds since timer_init(): TSC-interpolated once the TSC is calibrated, tick
+// granularity before that. Assumes an invariant TSC, synchronised across CPUs.
+uint64_t timer_now_ns(void);
+
+// Kernel timers on a hashed timing wheel driven by the PIT tick: arming and cancelling are
+// O(1) and each tick only looks at one slot. A timer fires at the first tick >= `expires` and,
+// with a non-zero `period`, is re-armed `period` ticks later. Callbacks run in the timer IRQ
+// with IRQs off and the wheel lock held: they must be short and must not arm or cancel timers.
+typedef void (*ktimer_fn_t)(void *arg);
+
+typedef struct ktimer {
+    uint64_t expires;         // timer tick
+    uint32_t period;          // ticks, 0 = one-shot
+    ktimer_fn_t fn;
+    void *arg;
+    struct ktimer *prev;
+    struct ktimer *next;
+    volatile uint8_t armed;
+} ktimer_t;
+
+void ktimer_setup(ktimer_t *tm, ktimer_fn_t fn, void *arg);
+// (Re)arms `tm`. An `expires` tick that already passed fires on the next tick.
+void ktimer_arm(ktimer_t *tm, uint64_t expires, uint32_t period);
+// Disarms `tm`. Once this returns the callback is neither running nor pending.
+void ktimer_cancel(ktimer_t *tm);
+
+#endif
@@ -51,6 +51,9 @@ uint32_t wm_window_client_pitch_bytes(const wm_window_t *w);
 
 // Event queue (per-window)
 int wm_window_poll_event(wm_window_t *w, mljos_ui_event_t *out);
+// Blocks the current task until `w` has an event, is closed or destroyed, the task is killed,
+// or `timeout_ticks` timer ticks pass (0 = no timeout). May return spuriously; re-poll.
+void wm_window_wait_event(wm_window_t *w, uint32_t timeout_ticks);
 void wm_window_post_expose(wm_window_t *w);
 
 // Launcher request from Start menu
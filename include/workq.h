@@ -0,0 +1,40 @@
+#ifndef WORKQ_H
+#define WORKQ_H
+
+#include "common.h"
+#include "console.h"
+#include "task.h"
+
+// Kernel worker tasks for long disk and filesystem operations (install, sync, copies). Work is
+// taken from a FIFO submission queue, so the submitter can keep interacting and either block on
+// the item or get a completion callback. The queue is only touched under the kernel lock.
+#define WORKQ_WORKERS 2
+
+typedef struct work work_t;
+typedef int (*work_fn_t)(void *arg);
+
+struct work {
+    work_fn_t fn;
+    void *arg;
+    // Optional, run by the worker right after `fn` (kernel lock held). May free the item.
+    void (*complete)(work_t *w);
+    // Console the work prints to while it runs; NULL = kernel console. Must outlive the item.
+    console_t *console;
+    volatile int done;
+    int result;               // return value of `fn`, valid once `done`
+    wait_queue_t done_wq;
+    work_t *next;
+};
+
+// Starts the worker tasks. Call after task_init().
+void workq_init(void);
+// Queues `w`; the caller keeps it alive until it is done. Set `complete` and `console` first.
+// Returns 0 if the workers are not running.
+int workq_submit(work_t *w, work_fn_t fn, void *arg);
+// Blocks until `w` is done and returns its result. task_kill() does not cut the wait short:
+// the work may be printing to the caller's console.
+int workq_wait(work_t *w);
+// Items queued or running.
+uint32_t workq_pending(void);
+
+#endif
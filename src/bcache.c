@@ -0,0 +1,296 @@
+#include "bcache.h"
+
+#include "kmem.h"
+
+#define BCACHE_BUCKETS 1024
+// Write-back mode flushes everything once this many sectors are dirty.
+#define BCACHE_DIRTY_LIMIT (BCACHE_ENTRIES / 2)
+
+typedef struct bcache_entry {
+    int dev;                  // -1 = unused
+    uint32_t lba;
+    uint8_t dirty;
+    struct bcache_entry *hash_next;
+    // LRU list, most recently used first.
+    struct bcache_entry *lru_prev;
+    struct bcache_entry *lru_next;
+    uint8_t data[BCACHE_SECTOR_SIZE];
+} bcache_entry_t;
+
+static bcache_read_fn_t g_bcache_read = NULL;
+static bcache_write_fn_t g_bcache_write = NULL;
+static bcache_read_many_fn_t g_bcache_read_many = NULL;
+static bcache_write_many_fn_t g_bcache_write_many = NULL;
+// Allocated on first use; without memory the cache is bypassed.
+static bcache_entry_t *g_bcache_entries = NULL;
+static bcache_entry_t *g_bcache_hash[BCACHE_BUCKETS];
+static bcache_entry_t *g_bcache_lru_head = NULL;
+static bcache_entry_t *g_bcache_lru_tail = NULL;
+static int g_bcache_ready = 0;
+static int g_bcache_write_back = 0;
+static bcache_stats_t g_bcache_stats;
+
+static uint32_t bcache_bucket(int dev, uint32_t lba) {
+    return ((lba * 2654435761U) ^ (uint32_t)dev) & (BCACHE_BUCKETS - 1);
+}
+
+static void lru_unlink(bcache_entry_t *e) {
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+    else g_bcache_lru_head = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+    else g_bcache_lru_tail = e->lru_prev;
+    e->lru_prev = NULL;
+    e->lru_next = NULL;
+}
+
+static void lru_push_front(bcache_entry_t *e) {
+    e->lru_prev = NULL;
+    e->lru_next = g_bcache_lru_head;
+    if (g_bcache_lru_head) g_bcache_lru_head->lru_prev = e;
+    g_bcache_lru_head = e;
+    if (!g_bcache_lru_tail) g_bcache_lru_tail = e;
+}
+
+static void lru_push_back(bcache_entry_t *e) {
+    e->lru_next = NULL;
+    e->lru_prev = g_bcache_lru_tail;
+    if (g_bcache_lru_tail) g_bcache_lru_tail->lru_next = e;
+    g_bcache_lru_tail = e;
+    if (!g_bcache_lru_head) g_bcache_lru_head = e;
+}
+
+static void hash_remove(bcache_entry_t *e) {
+    bcache_entry_t **pp = &g_bcache_hash[bcache_bucket(e->dev, e->lba)];
+    while (*pp && *pp != e) pp = &(*pp)->hash_next;
+    if (*pp) *pp = e->hash_next;
+    e->hash_next = NULL;
+}
+
+static int bcache_setup(void) {
+    if (g_bcache_ready) return g_bcache_entries != NULL;
+    g_bcache_ready = 1;
+    g_bcache_entries = (bcache_entry_t *)kmem_alloc(sizeof(bcache_entry_t) * BCACHE_ENTRIES, 16);
+    if (!g_bcache_entries) return 0;
+    for (int i = 0; i < BCACHE_ENTRIES; ++i) {
+        bcache_entry_t *e = &g_bcache_entries[i];
+        e->dev = -1;
+        e->dirty = 0;
+        e->hash_next = NULL;
+        lru_push_back(e);
+    }
+    return 1;
+}
+
+static bcache_entry_t *bcache_lookup(int dev, uint32_t lba) {
+    bcache_entry_t *e = g_bcache_hash[bcache_bucket(dev, lba)];
+    while (e && (e->dev != dev || e->lba != lba)) e = e->hash_next;
+    return e;
+}
+
+static int bcache_write_out(bcache_entry_t *e) {
+    if (!e->dirty) return 1;
+    if (!g_bcache_write(e->dev, e->lba, e->data)) return 0;
+    e->dirty = 0;
+    g_bcache_stats.dirty--;
+    g_bcache_stats.writebacks++;
+    return 1;
+}
+
+// Drops `e` from the cache and moves it to the LRU tail, to be reused first.
+static void bcache_forget(bcache_entry_t *e) {
+    if (e->dev < 0) return;
+    if (e->dirty) {
+        e->dirty = 0;
+        g_bcache_stats.dirty--;
+    }
+    hash_remove(e);
+    e->dev = -1;
+    g_bcache_stats.cached--;
+    lru_unlink(e);
+    lru_push_back(e);
+}
+
+// Takes the least recently used entry for (dev, lba), writing it back first if dirty. Returns
+// NULL if that write fails.
+static bcache_entry_t *bcache_claim(int dev, uint32_t lba) {
+    bcache_entry_t *e = g_bcache_lru_tail;
+    if (e->dev >= 0) {
+        if (!bcache_write_out(e)) return NULL;
+        bcache_forget(e);
+        g_bcache_stats.evictions++;
+    }
+    e->dev = dev;
+    e->lba = lba;
+    e->dirty = 0;
+    uint32_t b = bcache_bucket(dev, lba);
+    e->hash_next = g_bcache_hash[b];
+    g_bcache_hash[b] = e;
+    g_bcache_stats.cached++;
+    lru_unlink(e);
+    lru_push_front(e);
+    return e;
+}
+
+void bcache_init(bcache_read_fn_t read, bcache_write_fn_t write,
+                 bcache_read_many_fn_t read_many, bcache_write_many_fn_t write_many) {
+    g_bcache_read = read;
+    g_bcache_write = write;
+    g_bcache_read_many = read_many;
+    g_bcache_write_many = write_many;
+}
+
+int bcache_read(int dev, uint32_t lba, uint8_t *buf) {
+    if (!g_bcache_read) return 0;
+    if (dev < 0 || !bcache_setup()) return g_bcache_read(dev, lba, buf);
+
+    bcache_entry_t *e = bcache_lookup(dev, lba);
+    if (e) {
+        g_bcache_stats.hits++;
+        lru_unlink(e);
+        lru_push_front(e);
+        kmem_memcpy(buf, e->data, BCACHE_SECTOR_SIZE);
+        return 1;
+    }
+    g_bcache_stats.misses++;
+    if (!g_bcache_read(dev, lba, buf)) return 0;
+    e = bcache_claim(dev, lba);
+    if (e) kmem_memcpy(e->data, buf, BCACHE_SECTOR_SIZE);
+    return 1;
+}
+
+int bcache_write(int dev, uint32_t lba, const uint8_t *buf) {
+    if (!g_bcache_write) return 0;
+    if (dev < 0 || !bcache_setup()) return g_bcache_write(dev, lba, buf);
+
+    g_bcache_stats.writes++;
+    bcache_entry_t *e = bcache_lookup(dev, lba);
+    if (!g_bcache_write_back) {
+        if (!g_bcache_write(dev, lba, buf)) {
+            // The device may hold either version now; the next read asks it.
+            if (e) bcache_forget(e);
+            return 0;
+        }
+    }
+    if (e) {
+        lru_unlink(e);
+        lru_push_front(e);
+    } else {
+        e = bcache_claim(dev, lba);
+        if (!e) return g_bcache_write_back ? g_bcache_write(dev, lba, buf) : 1;
+    }
+    kmem_memcpy(e->data, buf, BCACHE_SECTOR_SIZE);
+    if (g_bcache_write_back && !e->dirty) {
+        e->dirty = 1;
+        g_bcache_stats.dirty++;
+        if (g_bcache_stats.dirty >= BCACHE_DIRTY_LIMIT) return bcache_flush(-1);
+    }
+    return 1;
+}
+
+int bcache_read_many(int dev, uint32_t lba, uint32_t count, uint8_t *buf) {
+    if (!g_bcache_read_many || count <= 1 || dev < 0 || !bcache_setup()) {
+        for (uint32_t i = 0; i < count; ++i) {
+            if (!bcache_read(dev, lba + i, buf + i * BCACHE_SECTOR_SIZE)) return 0;
+        }
+        return 1;
+    }
+
+    uint32_t hits = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        bcache_entry_t *e = bcache_lookup(dev, lba + i);
+        if (!e) break;
+        kmem_memcpy(buf + i * BCACHE_SECTOR_SIZE, e->data, BCACHE_SECTOR_SIZE);
+        hits++;
+    }
+    if (hits == count) {
+        g_bcache_stats.hits += count;
+        return 1;
+    }
+
+    g_bcache_stats.range_reads++;
+    if (!g_bcache_read_many(dev, lba, count, buf)) return 0;
+    // Clean cached copies match the device; dirty ones are newer and win.
+    if (!g_bcache_stats.dirty) return 1;
+    for (uint32_t i = 0; i < count; ++i) {
+        bcache_entry_t *e = bcache_lookup(dev, lba + i);
+        if (e && e->dirty) kmem_memcpy(buf + i * BCACHE_SECTOR_SIZE, e->data, BCACHE_SECTOR_SIZE);
+    }
+    return 1;
+}
+
+int bcache_write_many(int dev, uint32_t lba, uint32_t count, const uint8_t *buf) {
+    if (!g_bcache_write_many || count <= 1 || dev < 0 || !bcache_setup()) {
+        for (uint32_t i = 0; i < count; ++i) {
+            if (!bcache_write(dev, lba + i, buf + i * BCACHE_SECTOR_SIZE)) return 0;
+        }
+        return 1;
+    }
+
+    g_bcache_stats.range_writes++;
+    int ok = g_bcache_write_many(dev, lba, count, buf);
+    if (!g_bcache_stats.cached) return ok;
+    for (uint32_t i = 0; i < count; ++i) {
+        bcache_entry_t *e = bcache_lookup(dev, lba + i);
+        if (!e) continue;
+        if (!ok) {
+            bcache_forget(e);
+            continue;
+        }
+        kmem_memcpy(e->data, buf + i * BCACHE_SECTOR_SIZE, BCACHE_SECTOR_SIZE);
+        if (e->dirty) {
+            e->dirty = 0;
+            g_bcache_stats.dirty--;
+        }
+    }
+    return ok;
+}
+
+int bcache_flush_range(int dev, uint32_t lba, uint32_t count) {
+    if (!g_bcache_entries || !g_bcache_stats.dirty) return 1;
+    int ok = 1;
+    for (uint32_t i = 0; i < count; ++i) {
+        bcache_entry_t *e = bcache_lookup(dev, lba + i);
+        if (e && !bcache_write_out(e)) ok = 0;
+    }
+    return ok;
+}
+
+void bcache_drop_range(int dev, uint32_t lba, uint32_t count) {
+    if (!g_bcache_entries || !g_bcache_stats.cached) return;
+    for (uint32_t i = 0; i < count; ++i) {
+        bcache_entry_t *e = bcache_lookup(dev, lba + i);
+        if (e) bcache_forget(e);
+    }
+}
+
+int bcache_flush(int dev) {
+    if (!g_bcache_entries || !g_bcache_stats.dirty) return 1;
+    int ok = 1;
+    for (int i = 0; i < BCACHE_ENTRIES; ++i) {
+        bcache_entry_t *e = &g_bcache_entries[i];
+        if (e->dev < 0 || (dev >= 0 && e->dev != dev)) continue;
+        if (!bcache_write_out(e)) ok = 0;
+    }
+    return ok;
+}
+
+void bcache_invalidate(int dev) {
+    if (!g_bcache_entries) return;
+    (void)bcache_flush(dev);
+    for (int i = 0; i < BCACHE_ENTRIES; ++i) {
+        bcache_entry_t *e = &g_bcache_entries[i];
+        if (e->dev < 0 || (dev >= 0 && e->dev != dev)) continue;
+        bcache_forget(e);
+    }
+}
+
+void bcache_set_write_back(int on) {
+    if (!on) (void)bcache_flush(-1);
+    g_bcache_write_back = on ? 1 : 0;
+}
+
+void bcache_get_stats(bcache_stats_t *out) {
+    if (!out) return;
+    *out = g_bcache_stats;
+    out->write_back = g_bcache_write_back;
+}
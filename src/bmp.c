@@ -1,5 +1,6 @@
 #include "bmp.h"
 
+#include "fpu.h"
 #include "kmem.h"
 
 static uint16_t rd_u16(const uint8_t *p) {
@@ -37,13 +38,8 @@ int bmp_scale_nearest_rgb32(const uint32_t *src, int src_w, int src_h, uint32_t
     return 1;
 }
 
-int bmp_scale_bilinear_rgb32(const uint32_t *src, int src_w, int src_h, uint32_t **out_px, int dst_w, int dst_h) {
-    if (!src || !out_px || dst_w <= 0 || dst_h <= 0 || src_w <= 0 || src_h <= 0) return 0;
-
-    uint64_t bytes = (uint64_t)dst_w * (uint64_t)dst_h * 4ULL;
-    uint32_t *dst = (uint32_t *)kmem_alloc(bytes, 16);
-    if (!dst) return 0;
-
+// The only floating-point code in the kernel; see KERNEL_FPU_FN in fpu.h.
+static KERNEL_FPU_FN void scale_bilinear_rows(const uint32_t *src, int src_w, int src_h, uint32_t *dst, int dst_w, int dst_h) {
     for (int y = 0; y < dst_h; ++y) {
         float v = (dst_h == 1) ? 0.0f : (float)y * (float)(src_h - 1) / (float)(dst_h - 1);
         int y0 = (int)v;
@@ -87,6 +83,18 @@ int bmp_scale_bilinear_rgb32(const uint32_t *src, int src_w, int src_h, uint32_t
             dst[y * dst_w + x] = (rr << 16) | (gg << 8) | bb;
         }
     }
+}
+
+int bmp_scale_bilinear_rgb32(const uint32_t *src, int src_w, int src_h, uint32_t **out_px, int dst_w, int dst_h) {
+    if (!src || !out_px || dst_w <= 0 || dst_h <= 0 || src_w <= 0 || src_h <= 0) return 0;
+
+    uint64_t bytes = (uint64_t)dst_w * (uint64_t)dst_h * 4ULL;
+    uint32_t *dst = (uint32_t *)kmem_alloc(bytes, 16);
+    if (!dst) return 0;
+
+    kernel_fpu_begin();
+    scale_bilinear_rows(src, src_w, src_h, dst, dst_w, dst_h);
+    kernel_fpu_end();
 
     *out_px = dst;
     return 1;
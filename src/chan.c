@@ -0,0 +1,151 @@
+#include "chan.h"
+
+#include "kmem.h"
+#include "timer.h"
+
+typedef struct chan {
+    uint32_t refs;            // holders; 0 = free slot
+    uint8_t *ring;
+    uint32_t head;            // free-running byte offsets: head - tail bytes are used
+    uint32_t tail;
+    uint32_t msgs;
+    wait_queue_t readers;     // waiting for a message (or for the peers to go away)
+    wait_queue_t writers;     // waiting for ring space
+} chan_t;
+
+static chan_t g_chans[CHAN_MAX];
+
+// Messages are a 4-byte length followed by the payload, padded to 4 bytes.
+static uint32_t chan_msg_bytes(uint32_t size) {
+    return 4 + ((size + 3) & ~3U);
+}
+
+static void ring_write(chan_t *c, uint32_t off, const void *src, uint32_t n) {
+    uint32_t pos = off & (CHAN_RING_SIZE - 1);
+    uint32_t first = CHAN_RING_SIZE - pos;
+    if (first > n) first = n;
+    kmem_memcpy(c->ring + pos, src, first);
+    if (n > first) kmem_memcpy(c->ring, (const uint8_t *)src + first, n - first);
+}
+
+static void ring_read(const chan_t *c, uint32_t off, void *dst, uint32_t n) {
+    uint32_t pos = off & (CHAN_RING_SIZE - 1);
+    uint32_t first = CHAN_RING_SIZE - pos;
+    if (first > n) first = n;
+    kmem_memcpy(dst, c->ring + pos, first);
+    if (n > first) kmem_memcpy((uint8_t *)dst + first, c->ring, n - first);
+}
+
+// The channel behind `ch` if the current task holds it.
+static chan_t *chan_get(int ch) {
+    task_t *t = task_current();
+    if (!t || ch < 1 || ch > CHAN_MAX) return NULL;
+    if (!(t->chan_held & (1ULL << (ch - 1)))) return NULL;
+    return &g_chans[ch - 1];
+}
+
+static void chan_drop(task_t *t, int index) {
+    chan_t *c = &g_chans[index];
+    t->chan_held &= ~(1ULL << index);
+    if (--c->refs == 0) {
+        kmem_free(c->ring);
+        kmem_memset(c, 0, sizeof(*c));
+        return;
+    }
+    // Whoever is left may be waiting on a peer that just went away.
+    wait_queue_wake_all(&c->readers);
+    wait_queue_wake_all(&c->writers);
+}
+
+int chan_create(void) {
+    task_t *t = task_current();
+    if (!t) return 0;
+    for (int i = 0; i < CHAN_MAX; ++i) {
+        chan_t *c = &g_chans[i];
+        if (c->refs) continue;
+        c->ring = (uint8_t *)kmem_alloc(CHAN_RING_SIZE, 4096);
+        if (!c->ring) return 0;
+        c->refs = 1;
+        c->head = 0;
+        c->tail = 0;
+        c->msgs = 0;
+        t->chan_held |= 1ULL << i;
+        return i + 1;
+    }
+    return 0;
+}
+
+int chan_grant(task_t *t, int ch) {
+    chan_t *c = chan_get(ch);
+    if (!c || !t) return 0;
+    uint64_t bit = 1ULL << (ch - 1);
+    if (t->chan_held & bit) return 1;
+    t->chan_held |= bit;
+    c->refs++;
+    return 1;
+}
+
+void chan_close(int ch) {
+    if (!chan_get(ch)) return;
+    chan_drop(task_current(), ch - 1);
+}
+
+void chan_release_all(task_t *t) {
+    while (t->chan_held) chan_drop(t, __builtin_ctzll(t->chan_held));
+}
+
+int chan_send(int ch, const void *data, uint32_t size, int block) {
+    chan_t *c = chan_get(ch);
+    if (!c || (!data && size) || size > CHAN_MSG_MAX) return 0;
+    task_t *t = task_current();
+    uint32_t need = chan_msg_bytes(size);
+    for (;;) {
+        if (c->refs < 2) return 0;
+        if (CHAN_RING_SIZE - (c->head - c->tail) >= need) break;
+        if (!block || t->killed) return 0;
+        task_wait_prepare(&c->writers, 0);
+        if (c->refs >= 2 && CHAN_RING_SIZE - (c->head - c->tail) < need) task_yield();
+        task_wait_finish(&c->writers);
+    }
+    ring_write(c, c->head, &size, 4);
+    ring_write(c, c->head + 4, data, size);
+    c->head += need;
+    c->msgs++;
+    wait_queue_wake_all(&c->readers);
+    return 1;
+}
+
+int chan_recv(int ch, void *buf, uint32_t max, int block) {
+    chan_t *c = chan_get(ch);
+    if (!c || (!buf && max)) return -1;
+    task_t *t = task_current();
+    // Messages already queued are still delivered after the peers left.
+    while (!c->msgs) {
+        if (!block || c->refs < 2 || t->killed) return -1;
+        task_wait_prepare(&c->readers, 0);
+        if (!c->msgs && c->refs >= 2) task_yield();
+        task_wait_finish(&c->readers);
+    }
+    uint32_t size = 0;
+    ring_read(c, c->tail, &size, 4);
+    ring_read(c, c->tail + 4, buf, size < max ? size : max);
+    c->tail += chan_msg_bytes(size);
+    c->msgs--;
+    wait_queue_wake_all(&c->writers);
+    return (int)size;
+}
+
+int chan_wait(int ch, uint32_t timeout_ms) {
+    chan_t *c = chan_get(ch);
+    if (!c) return 0;
+    task_t *t = task_current();
+    uint64_t end = timer_ticks() + ((uint64_t)timeout_ms * TIMER_HZ + 999) / 1000;
+    while (!c->msgs && c->refs >= 2 && !t->killed) {
+        uint64_t now = timer_ticks();
+        if (now >= end) break;
+        task_wait_prepare(&c->readers, (uint32_t)(end - now));
+        if (!c->msgs && c->refs >= 2) task_yield();
+        task_wait_finish(&c->readers);
+    }
+    return c->msgs != 0;
+}
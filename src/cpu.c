@@ -1,5 +1,7 @@
 #include "cpu.h"
 #include "console.h"
+#include "fpu.h"
+#include "io.h"
 #include "task.h"
 #include "sound.h"
 
@@ -17,16 +19,8 @@ static void gdt_set_entry(int i, uint32_t base, uint32_t limit, uint8_t access,
     g_gdt[i].access = access;
 }
 
-static void gdt_init(void) {
-    gdt_set_entry(0, 0, 0, 0, 0);                // Null
-    gdt_set_entry(1, 0, 0xFFFFFFFF, 0x9A, 0xAF); // Kernel Code (64-bit)
-    gdt_set_entry(2, 0, 0xFFFFFFFF, 0x92, 0xAF); // Kernel Data (64-bit)
-    gdt_set_entry(3, 0, 0xFFFFFFFF, 0xFA, 0xAF); // User Code (64-bit)
-    gdt_set_entry(4, 0, 0xFFFFFFFF, 0xF2, 0xAF); // User Data (64-bit)
-
-    g_gdt_ptr.limit = sizeof(g_gdt) - 1;
-    g_gdt_ptr.base = (uint64_t)&g_gdt;
-
+// GS is not reloaded: that would clear GS.base, which holds the per-CPU area (smp.c).
+static void gdt_load(void) {
     __asm__ volatile (
         "lgdt %0\n"
         "push $0x08\n"
@@ -38,12 +32,23 @@ static void gdt_init(void) {
         "mov %%ax, %%ds\n"
         "mov %%ax, %%es\n"
         "mov %%ax, %%fs\n"
-        "mov %%ax, %%gs\n"
         "mov %%ax, %%ss\n"
         : : "m"(g_gdt_ptr) : "rax", "memory"
     );
 }
 
+static void gdt_init(void) {
+    gdt_set_entry(0, 0, 0, 0, 0);                // Null
+    gdt_set_entry(1, 0, 0xFFFFFFFF, 0x9A, 0xAF); // Kernel Code (64-bit)
+    gdt_set_entry(2, 0, 0xFFFFFFFF, 0x92, 0xAF); // Kernel Data (64-bit)
+    gdt_set_entry(3, 0, 0xFFFFFFFF, 0xFA, 0xAF); // User Code (64-bit)
+    gdt_set_entry(4, 0, 0xFFFFFFFF, 0xF2, 0xAF); // User Data (64-bit)
+
+    g_gdt_ptr.limit = sizeof(g_gdt) - 1;
+    g_gdt_ptr.base = (uint64_t)&g_gdt;
+    gdt_load();
+}
+
 // IDT
 static idt_entry_t g_idt[256];
 static idt_ptr_t g_idt_ptr;
@@ -70,6 +75,26 @@ extern void isr18();
 extern void isr19();
 extern void isr20();
 extern void isr30();
+extern void isr32();
+extern void isr33();
+extern void isr34();
+extern void isr35();
+extern void isr36();
+extern void isr37();
+extern void isr38();
+extern void isr39();
+extern void isr40();
+extern void isr41();
+extern void isr42();
+extern void isr43();
+extern void isr44();
+extern void isr45();
+extern void isr46();
+extern void isr47();
+extern void isr48();
+extern void isr49();
+extern void isr50();
+extern void isr255();
 
 static void idt_set_gate(int i, void (*handler)(void), uint8_t ist, uint8_t type_attr) {
     uint64_t addr = (uint64_t)handler;
@@ -82,6 +107,88 @@ static void idt_set_gate(int i, void (*handler)(void), uint8_t ist, uint8_t type
     g_idt[i].reserved = 0;
 }
 
+static isr_handler_t g_isr_handlers[256];
+static int g_cpu_pcid = 0;
+static int g_cpu_invpcid = 0;
+
+#define CR4_PGE   (1ULL << 7)
+#define CR4_PCIDE (1ULL << 17)
+
+static void cpuid(uint32_t leaf, uint32_t sub, uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d) {
+    __asm__ volatile ("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(sub));
+}
+
+static inline uint64_t read_cr4(void) {
+    uint64_t v;
+    __asm__ volatile ("mov %%cr4, %0" : "=r"(v));
+    return v;
+}
+
+static inline void write_cr4(uint64_t v) {
+    __asm__ volatile ("mov %0, %%cr4" : : "r"(v) : "memory");
+}
+
+static void pcid_init(void) {
+    uint32_t a, b, c, d;
+    cpuid(0, 0, &a, &b, &c, &d);
+    uint32_t max_leaf = a;
+    cpuid(1, 0, &a, &b, &c, &d);
+    if (!(c & (1U << 17))) return;
+    if (max_leaf >= 7) {
+        cpuid(7, 0, &a, &b, &c, &d);
+        g_cpu_invpcid = (b & (1U << 10)) != 0;
+    }
+    // Setting PCIDE requires CR3[11:0] == 0, which holds for the boot page tables.
+    write_cr4(read_cr4() | CR4_PCIDE);
+    g_cpu_pcid = 1;
+}
+
+int cpu_pcid_enabled(void) {
+    return g_cpu_pcid;
+}
+
+int cpu_has_invpcid(void) {
+    return g_cpu_invpcid;
+}
+
+void cpu_invpcid_single(uint16_t pcid) {
+    struct { uint64_t pcid; uint64_t addr; } desc = { pcid, 0 };
+    uint64_t type = 1;
+    __asm__ volatile ("invpcid %0, %1" : : "m"(desc), "r"(type) : "memory");
+}
+
+void cpu_flush_tlb_all(void) {
+    uint64_t cr4 = read_cr4();
+    write_cr4(cr4 ^ CR4_PGE);
+    write_cr4(cr4);
+}
+
+uint64_t cpu_rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    __asm__ volatile ("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+void cpu_wrmsr(uint32_t msr, uint64_t value) {
+    __asm__ volatile ("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+uint64_t cpu_rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+void cpu_set_isr_handler(int vector, isr_handler_t handler) {
+    if (vector < 0 || vector >= 256) return;
+    g_isr_handlers[vector] = handler;
+}
+
+isr_handler_t cpu_get_isr_handler(int vector) {
+    if (vector < 0 || vector >= 256) return NULL;
+    return g_isr_handlers[vector];
+}
+
 void exception_handler(interrupt_frame_t *frame) {
     const char *exception_names[] = {
         "Division By Zero", "Debug", "Non Maskable Interrupt", "Breakpoint",
@@ -94,11 +201,14 @@ void exception_handler(interrupt_frame_t *frame) {
 
     const char *name = (frame->int_no < 22) ? exception_names[frame->int_no] : "Unknown Exception";
 
+    task_t *t = task_current();
+    // App code runs without the kernel lock; the console and WM need it.
+    if (t) kernel_lock();
+
     puts("\n[KERNEL PANIC] CPU Exception: ");
     puts(name);
     puts("\n");
 
-    task_t *t = task_current();
     if (t) {
         puts("Faulting Task: ");
         puts(t->name);
@@ -114,6 +224,59 @@ void exception_handler(interrupt_frame_t *frame) {
     }
 }
 
+static void page_fault_handler(interrupt_frame_t *frame) {
+    uint64_t addr;
+    __asm__ volatile ("mov %%cr2, %0" : "=r"(addr));
+    if (task_handle_page_fault(addr, frame->error_code)) return;
+    exception_handler(frame);
+}
+
+// 8259 PICs, remapped so IRQ0..15 arrive on CPU_IRQ_BASE..CPU_IRQ_BASE+15.
+#define PIC1_CMD  0x20
+#define PIC1_DATA 0x21
+#define PIC2_CMD  0xA0
+#define PIC2_DATA 0xA1
+#define PIC_EOI   0x20
+
+static void pic_init(void) {
+    outb(PIC1_CMD, 0x11);            // ICW1: init, ICW4 follows
+    outb(PIC2_CMD, 0x11);
+    outb(PIC1_DATA, CPU_IRQ_BASE);   // ICW2: vector offsets
+    outb(PIC2_DATA, CPU_IRQ_BASE + 8);
+    outb(PIC1_DATA, 0x04);           // ICW3: slave on IRQ2
+    outb(PIC2_DATA, 0x02);
+    outb(PIC1_DATA, 0x01);           // ICW4: 8086 mode
+    outb(PIC2_DATA, 0x01);
+    // Everything masked except the cascade line; drivers unmask what they handle.
+    outb(PIC1_DATA, 0xFB);
+    outb(PIC2_DATA, 0xFF);
+}
+
+void cpu_irq_unmask(int irq) {
+    if (irq < 0 || irq > 15) return;
+    uint16_t port = irq < 8 ? PIC1_DATA : PIC2_DATA;
+    outb(port, (uint8_t)(inb(port) & ~(1U << (irq & 7))));
+}
+
+void cpu_irq_mask(int irq) {
+    if (irq < 0 || irq > 15) return;
+    uint16_t port = irq < 8 ? PIC1_DATA : PIC2_DATA;
+    outb(port, (uint8_t)(inb(port) | (1U << (irq & 7))));
+}
+
+void cpu_irq_eoi(int irq) {
+    if (irq >= 8) outb(PIC2_CMD, PIC_EOI);
+    outb(PIC1_CMD, PIC_EOI);
+}
+
+void isr_dispatch(interrupt_frame_t *frame) {
+    uint64_t vec = frame->int_no & 0xFF;
+    isr_handler_t h = g_isr_handlers[vec];
+    if (h) h(frame);
+    else if (vec >= CPU_IRQ_BASE && vec < CPU_IRQ_BASE + 16) cpu_irq_eoi((int)(vec - CPU_IRQ_BASE));  // spurious or unclaimed IRQ
+    else exception_handler(frame);
+}
+
 // Assembly stubs
 __asm__ (
     ".macro ISR_NOERR i\n"
@@ -153,6 +316,26 @@ __asm__ (
     "ISR_NOERR 19\n"
     "ISR_NOERR 20\n"
     "ISR_ERR   30\n"
+    "ISR_NOERR 32\n"
+    "ISR_NOERR 33\n"
+    "ISR_NOERR 34\n"
+    "ISR_NOERR 35\n"
+    "ISR_NOERR 36\n"
+    "ISR_NOERR 37\n"
+    "ISR_NOERR 38\n"
+    "ISR_NOERR 39\n"
+    "ISR_NOERR 40\n"
+    "ISR_NOERR 41\n"
+    "ISR_NOERR 42\n"
+    "ISR_NOERR 43\n"
+    "ISR_NOERR 44\n"
+    "ISR_NOERR 45\n"
+    "ISR_NOERR 46\n"
+    "ISR_NOERR 47\n"
+    "ISR_NOERR 48\n"
+    "ISR_NOERR 49\n"
+    "ISR_NOERR 50\n"
+    "ISR_NOERR 255\n"
 
     "isr_common:\n"
     "pushq %rax\n"
@@ -172,7 +355,7 @@ __asm__ (
     "pushq %r15\n"
     "movq %rsp, %rdi\n"
     "cld\n"
-    "call exception_handler\n"
+    "call isr_dispatch\n"
     "popq %r15\n"
     "popq %r14\n"
     "popq %r13\n"
@@ -221,9 +404,42 @@ void cpu_init(void) {
     idt_set_gate(19, isr19, 0, 0x8E);
     idt_set_gate(20, isr20, 0, 0x8E);
     idt_set_gate(30, isr30, 0, 0x8E);
+    idt_set_gate(32, isr32, 0, 0x8E);
+    idt_set_gate(33, isr33, 0, 0x8E);
+    idt_set_gate(34, isr34, 0, 0x8E);
+    idt_set_gate(35, isr35, 0, 0x8E);
+    idt_set_gate(36, isr36, 0, 0x8E);
+    idt_set_gate(37, isr37, 0, 0x8E);
+    idt_set_gate(38, isr38, 0, 0x8E);
+    idt_set_gate(39, isr39, 0, 0x8E);
+    idt_set_gate(40, isr40, 0, 0x8E);
+    idt_set_gate(41, isr41, 0, 0x8E);
+    idt_set_gate(42, isr42, 0, 0x8E);
+    idt_set_gate(43, isr43, 0, 0x8E);
+    idt_set_gate(44, isr44, 0, 0x8E);
+    idt_set_gate(45, isr45, 0, 0x8E);
+    idt_set_gate(46, isr46, 0, 0x8E);
+    idt_set_gate(47, isr47, 0, 0x8E);
+    idt_set_gate(CPU_LAPIC_TIMER_VECTOR, isr48, 0, 0x8E);
+    idt_set_gate(CPU_RESCHED_VECTOR, isr49, 0, 0x8E);
+    idt_set_gate(CPU_AHCI_VECTOR, isr50, 0, 0x8E);
+    idt_set_gate(CPU_SPURIOUS_VECTOR, isr255, 0, 0x8E);
+
+    cpu_set_isr_handler(14, page_fault_handler);
+    pic_init();
+
+    pcid_init();
 
     g_idt_ptr.limit = sizeof(g_idt) - 1;
     g_idt_ptr.base = (uint64_t)&g_idt;
 
     __asm__ volatile ("lidt %0" : : "m"(g_idt_ptr));
+
+    fpu_init();
+}
+
+void cpu_init_ap(void) {
+    gdt_load();
+    __asm__ volatile ("lidt %0" : : "m"(g_idt_ptr));
+    fpu_init_ap();
 }
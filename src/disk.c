@@ -1,13 +1,17 @@
 #include "disk.h"
 #include "app_layout.h"
+#include "bcache.h"
 #include "console.h"
+#include "cpu.h"
 #include "io.h"
 #include "kmem.h"
 #include "kstring.h"
 #include "shell.h"
+#include "smp.h"
 #include "sdk/mljos_app.h"
 #include "sdk/mljos_api.h"
 #include "task.h"
+#include "timer.h"
 #include "usb.h"
 #include "boot/legacy_bootsector_bin.h"
 
@@ -21,8 +25,49 @@ extern uint8_t _kernel_end[];
 #define FAT32_EOC            0x0FFFFFFF
 #define FAT32_MIN_CLUSTERS   65525U
 #define FAT32_MAX_CLUSTERS   0x0FFFFFEFU
+#define FAT32_FSINFO_UNKNOWN 0xFFFFFFFFU
+#define FAT32_FAT_WINDOW_SECTORS 16
+#define FAT32_RA_STREAMS     4
+#define FAT32_RA_MIN_BYTES   (16U * 1024U)
+#define FAT32_RA_MAX_BYTES   (64U * 1024U)
+#define DISK_DEFRAG_CHUNK_SECTORS 128U
+#define AHCI_PRDT_ENTRIES    8
+#define AHCI_PRDT_MAX_BYTES  (4U * 1024U * 1024U)
+#define AHCI_MAX_SECTORS     65535U
+#define AHCI_MAX_SLOTS       32
+// Large queued transfers are split so an NCQ disk gets several commands to overlap, but not
+// into pieces smaller than this.
+#define AHCI_NCQ_MIN_CHUNK   128U
+#define DISK_BOUNCE_SECTORS  128U
 #define ATA_POLL_TIMEOUT     1000000U
 #define ATA_MAX_DEVICES      4
+#define ATA_CMD_READ_PIO         0x20
+#define ATA_CMD_READ_PIO_EXT     0x24
+#define ATA_CMD_READ_DMA_EXT     0x25
+#define ATA_CMD_READ_MULTIPLE_EXT 0x29
+#define ATA_CMD_WRITE_PIO        0x30
+#define ATA_CMD_WRITE_PIO_EXT    0x34
+#define ATA_CMD_WRITE_DMA_EXT    0x35
+#define ATA_CMD_WRITE_MULTIPLE_EXT 0x39
+#define ATA_CMD_READ_MULTIPLE    0xC4
+#define ATA_CMD_WRITE_MULTIPLE   0xC5
+#define ATA_CMD_SET_MULTIPLE     0xC6
+#define ATA_CMD_READ_DMA         0xC8
+#define ATA_CMD_WRITE_DMA        0xCA
+// PIO commands are capped at 256 sectors so their count also fits LBA28; DMA commands at
+// 128 KiB, which a PRD table covers in at most three entries (none may cross 64 KiB).
+#define ATA_PIO_MAX_SECTORS  256U
+#define ATA_DMA_MAX_SECTORS  256U
+#define ATA_PRD_ENTRIES      8
+#define ATA_BM_CMD           0
+#define ATA_BM_STATUS        2
+#define ATA_BM_PRDT          4
+#define ATA_BM_CMD_START     0x01U
+#define ATA_BM_CMD_READ      0x08U   // device to memory
+#define ATA_BM_STATUS_ACTIVE 0x01U
+#define ATA_BM_STATUS_ERROR  0x02U
+#define ATA_BM_STATUS_IRQ    0x04U
+#define IDE_SUBCLASS         0x01
 #define AHCI_MAX_DEVICES     16
 #define DISK_MAX_DEVICES     (ATA_MAX_DEVICES + AHCI_MAX_DEVICES + USB_MAX_STORAGE_DEVICES)
 #define DISK_LEGACY_BOOT_START_LBA 1U
@@ -38,6 +83,7 @@ extern uint8_t _kernel_end[];
 #define AHCI_PORT_DET_PRESENT 0x3U
 #define AHCI_PORT_IPM_ACTIVE  0x1U
 #define AHCI_GHC_AE          0x80000000U
+#define AHCI_GHC_IE          0x00000002U
 #define AHCI_PXCMD_ST        0x0001U
 #define AHCI_PXCMD_FRE       0x0010U
 #define AHCI_PXCMD_FR        0x4000U
@@ -45,9 +91,20 @@ extern uint8_t _kernel_end[];
 #define AHCI_PXTFD_BSY       0x80U
 #define AHCI_PXTFD_DRQ       0x08U
 #define AHCI_PXIS_TFES       (1U << 30)
+// Interrupt on: D2H register FIS, PIO setup FIS, set device bits FIS (NCQ completions),
+// descriptor processed, and the fatal error bits.
+#define AHCI_PXIE_MASK       (0x0000002BU | (0xFU << 27))
+// Sleeping waits give up after this many timer ticks per 2048 sectors of the command.
+#define AHCI_IRQ_TIMEOUT_TICKS (5U * TIMER_HZ)
+#define PCI_CAP_ID_MSI       0x05
+#define AHCI_CAP_SNCQ        (1U << 30)
 #define AHCI_ATA_CMD_IDENTIFY_DEVICE 0xEC
 #define AHCI_ATA_CMD_READ_DMA_EXT    0x25
 #define AHCI_ATA_CMD_WRITE_DMA_EXT   0x35
+#define AHCI_ATA_CMD_READ_FPDMA      0x60
+#define AHCI_ATA_CMD_WRITE_FPDMA     0x61
+#define AHCI_ATA_CMD_READ_LOG_EXT    0x2F
+#define AHCI_NCQ_ERROR_LOG           0x10
 #define AHCI_FIS_TYPE_REG_H2D        0x27
 
 typedef struct __attribute__((packed)) {
@@ -119,7 +176,7 @@ typedef struct __attribute__((packed)) {
     uint8_t cfis[64];
     uint8_t acmd[16];
     uint8_t reserved[48];
-    ahci_prdt_entry_t prdt_entry[1];
+    ahci_prdt_entry_t prdt_entry[AHCI_PRDT_ENTRIES];
 } ahci_cmd_table_t;
 
 typedef struct __attribute__((packed)) {
@@ -183,9 +240,46 @@ typedef struct {
     uint8_t num_fats;
     uint8_t sectors_per_cluster;
     uint32_t alloc_search_hint;
+    uint32_t mount_gen;           // g_disk_media_gen[] value the geometry above was read under
+    // Free clusters: from FSInfo at mount (FAT32_FSINFO_UNKNOWN if it had none), exact once
+    // free_map is built. free_map has one bit per cluster, set = free, indexed by cluster - 2.
+    uint32_t fsinfo_lba;          // 0 = volume has no FSInfo sector
+    uint32_t free_count;
+    int fsinfo_dirty;
+    uint64_t *free_map;
     char current_path[128];
 } fat32_volume_t;
 
+// FAT sectors of the active volume are read and modified through this window, so walking a
+// chain or allocating a run touches each FAT sector once instead of once per entry. Dirty
+// sectors are mirrored to every FAT copy by fat32_fat_flush().
+typedef struct {
+    int dev;                      // -1 = empty
+    uint32_t gen;
+    uint32_t first;               // index within the FAT of data[0]'s sector
+    uint32_t count;
+    uint32_t dirty;               // bit i = sector i modified
+    uint8_t data[FAT32_FAT_WINDOW_SECTORS * 512];
+} fat32_fat_window_t;
+
+// Readahead for files read more than once from the start, a short piece first: the WM reads
+// an icon's header and then the whole icon, the app registry an app's header before the app
+// is loaded. A short read fills the file's stream buffer with a window from offset 0; later
+// reads are served from it and continue the chain where it ends. Every write on the device
+// drops its streams.
+typedef struct {
+    int used;
+    int dev;
+    uint32_t gen;
+    uint32_t first_cluster;
+    uint32_t file_size;
+    uint32_t len;                 // bytes buffered; cluster-aligned unless it is file_size
+    uint32_t next_cluster;        // cluster holding offset `len`
+    uint32_t window;
+    uint32_t last_use;
+    uint8_t *data;                // FAT32_RA_MAX_BYTES, allocated with the stream
+} fat32_ra_stream_t;
+
 typedef struct {
     uint32_t sector_lba;
     uint16_t offset;
@@ -207,6 +301,12 @@ typedef struct {
     uint32_t total_sectors;
     int present;
     const char *name;
+    uint8_t lba48;
+    uint8_t multiple;             // sectors per DRQ block after SET MULTIPLE, 0 = one
+    uint8_t dma;                  // the drive does DMA and bmide is known
+    uint8_t dma_capable;          // IDENTIFY word 49 bit 8
+    uint16_t bmide;               // bus-master IDE registers of the channel, 0 = none
+    uint32_t *prd;                // PRD table, allocated on the first DMA
 } ata_device_t;
 
 typedef struct {
@@ -214,9 +314,29 @@ typedef struct {
     volatile ahci_port_regs_t *port;
     ahci_cmd_header_t *cmd_list;
     uint8_t *fis;
-    ahci_cmd_table_t *cmd_table;
+    ahci_cmd_table_t *cmd_table;  // one per command slot
+    uint8_t *ncq_log;             // NCQ command error log page, allocated on the first NCQ error
     uint32_t total_sectors;
     uint8_t port_index;
+    uint8_t slot_count;           // command slots the HBA implements
+    uint8_t queue_depth;          // commands kept in flight: 1 without NCQ
+    uint8_t ncq;
+    // Slot state. claimed: handed out by ahci_submit() and not yet collected by
+    // ahci_complete(). busy: issued and not yet seen finished. untagged: busy with a non-NCQ
+    // command, which must run alone. failed: finished with an error, not yet collected.
+    uint32_t claimed;
+    uint32_t busy;
+    uint32_t untagged;
+    uint32_t failed;
+    // Interrupts: PCI address of the HBA, the vector its ports raise (0 = polled) and PxIS
+    // bits the handler took off the port for ahci_reap().
+    uint8_t pci_bus;
+    uint8_t pci_slot;
+    uint8_t pci_function;
+    uint8_t irq_tried;
+    int irq_vector;
+    volatile uint32_t irq_status;
+    wait_queue_t irq_wq;
     int present;
     const char *name;
 } ahci_device_t;
@@ -237,11 +357,20 @@ typedef struct {
 } disk_device_t;
 
 static fat32_volume_t g_fat32_volumes[DISK_MAX_DEVICES] = {0};
+// Bumped whenever what sits behind a device index may have changed (device switch, format,
+// re-probe). A mounted volume stays valid while its mount_gen matches, so fat32_mount() only
+// touches the boot sector once per generation.
+static uint32_t g_disk_media_gen[DISK_MAX_DEVICES] = {0};
+static fat32_fat_window_t g_fat32_window = { .dev = -1 };
+static fat32_ra_stream_t g_fat32_ra[FAT32_RA_STREAMS] = {0};
+static uint32_t g_fat32_ra_clock = 0;
+static uint64_t g_fat32_ra_hits = 0;
+static uint64_t g_fat32_ra_fills = 0;
 static ata_device_t g_ata_devices[ATA_MAX_DEVICES] = {
-    {0x1F0, 0xE0, 0xA0, 0, 0, "ata0"},
-    {0x1F0, 0xF0, 0xB0, 0, 0, "ata1"},
-    {0x170, 0xE0, 0xA0, 0, 0, "ata2"},
-    {0x170, 0xF0, 0xB0, 0, 0, "ata3"}
+    {0x1F0, 0xE0, 0xA0, 0, 0, "ata0", 0, 0, 0, 0, 0, NULL},
+    {0x1F0, 0xF0, 0xB0, 0, 0, "ata1", 0, 0, 0, 0, 0, NULL},
+    {0x170, 0xE0, 0xA0, 0, 0, "ata2", 0, 0, 0, 0, 0, NULL},
+    {0x170, 0xF0, 0xB0, 0, 0, "ata3", 0, 0, 0, 0, 0, NULL}
 };
 static ahci_device_t g_ahci_devices[AHCI_MAX_DEVICES] = {0};
 static disk_device_t g_disk_devices[DISK_MAX_DEVICES] = {0};
@@ -276,6 +405,10 @@ static int disk_require_not_busy_quiet(void) {
     return !disk_exclusive_held_by_other();
 }
 
+int disk_is_busy(void) {
+    return disk_exclusive_held_by_other();
+}
+
 static int disk_require_not_busy(const char *context) {
     if (disk_require_not_busy_quiet()) return 1;
     puts(context);
@@ -311,8 +444,10 @@ static int fat32_build_short_name(const char *name, uint8_t out[11]);
 static void disk_probe_devices(void);
 static fat32_volume_t *disk_current_volume(void);
 static disk_device_t *disk_current_device(void);
-static ata_device_t *disk_current_ata_device(void);
-static ahci_device_t *disk_current_ahci_device(void);
+static int disk_raw_read_sector(int dev, uint32_t lba, uint8_t *buffer);
+static int disk_raw_write_sector(int dev, uint32_t lba, const uint8_t *buffer);
+static int disk_raw_read_sectors(int dev, uint32_t lba, uint32_t count, uint8_t *buffer);
+static int disk_raw_write_sectors(int dev, uint32_t lba, uint32_t count, const uint8_t *buffer);
 static int ata_read_sector(uint32_t lba, uint8_t *buffer);
 static int ata_write_sector(uint32_t lba, const uint8_t *buffer);
 
@@ -576,6 +711,18 @@ static fat32_volume_t *disk_current_volume(void) {
     return &g_fat32_volumes[g_disk_active_index];
 }
 
+static void disk_invalidate_volume(int dev) {
+    for (int i = 0; i < DISK_MAX_DEVICES; i++) {
+        if (dev < 0 || dev == i) g_disk_media_gen[i]++;
+    }
+}
+
+static void fat32_ra_drop(int dev) {
+    for (int i = 0; i < FAT32_RA_STREAMS; i++) {
+        if (dev < 0 || g_fat32_ra[i].dev == dev) g_fat32_ra[i].used = 0;
+    }
+}
+
 static int disk_pick_default_device(void) {
     for (int i = 0; i < g_disk_device_count; i++) {
         if (g_disk_devices[i].type != DISK_BACKEND_NONE) {
@@ -598,24 +745,6 @@ static disk_device_t *disk_current_device(void) {
     return &g_disk_devices[g_disk_active_index];
 }
 
-static ata_device_t *disk_current_ata_device(void) {
-    disk_device_t *device = disk_current_device();
-
-    if (!device || device->type != DISK_BACKEND_ATA) return 0;
-    if (device->backend_index < 0 || device->backend_index >= ATA_MAX_DEVICES) return 0;
-    if (!g_ata_devices[device->backend_index].present) return 0;
-    return &g_ata_devices[device->backend_index];
-}
-
-static ahci_device_t *disk_current_ahci_device(void) {
-    disk_device_t *device = disk_current_device();
-
-    if (!device || device->type != DISK_BACKEND_AHCI) return 0;
-    if (device->backend_index < 0 || device->backend_index >= AHCI_MAX_DEVICES) return 0;
-    if (!g_ahci_devices[device->backend_index].present) return 0;
-    return &g_ahci_devices[device->backend_index];
-}
-
 static uint32_t pci_config_read32(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset) {
     uint32_t address = 0x80000000U
         | ((uint32_t)bus << 16)
@@ -691,12 +820,12 @@ static int ahci_prepare_port(ahci_device_t *device) {
 
     cmd_list = (ahci_cmd_header_t *)kmem_alloc(1024, 1024);
     fis = (uint8_t *)kmem_alloc(256, 256);
-    cmd_table = (ahci_cmd_table_t *)kmem_alloc(sizeof(ahci_cmd_table_t), 128);
+    cmd_table = (ahci_cmd_table_t *)kmem_alloc(sizeof(ahci_cmd_table_t) * AHCI_MAX_SLOTS, 128);
     if (!cmd_list || !fis || !cmd_table) return 0;
 
     kmemset(cmd_list, 0, 1024);
     kmemset(fis, 0, 256);
-    kmemset(cmd_table, 0, sizeof(ahci_cmd_table_t));
+    kmemset(cmd_table, 0, sizeof(ahci_cmd_table_t) * AHCI_MAX_SLOTS);
 
     port->clb = (uint32_t)(uintptr_t)cmd_list;
     port->clbu = 0;
@@ -705,58 +834,341 @@ static int ahci_prepare_port(ahci_device_t *device) {
     port->is = 0xFFFFFFFFU;
     port->serr = 0xFFFFFFFFU;
 
-    cmd_list[0].prdtl = 1;
-    cmd_list[0].ctba = (uint32_t)(uintptr_t)cmd_table;
-    cmd_list[0].ctbau = 0;
+    for (int slot = 0; slot < AHCI_MAX_SLOTS; slot++) {
+        cmd_list[slot].prdtl = 1;
+        cmd_list[slot].ctba = (uint32_t)(uintptr_t)&cmd_table[slot];
+        cmd_list[slot].ctbau = 0;
+    }
 
     device->cmd_list = cmd_list;
     device->fis = fis;
     device->cmd_table = cmd_table;
+    device->slot_count = (uint8_t)(((device->hba->cap >> 8) & 0x1FU) + 1U);
+    device->queue_depth = 1;
+    device->ncq = 0;
+    device->claimed = 0;
+    device->busy = 0;
+    device->untagged = 0;
+    device->failed = 0;
 
     ahci_start_port(port);
     return 1;
 }
 
-static int ahci_issue_ata(ahci_device_t *device, uint8_t command, uint64_t lba, uint16_t sector_count, uint8_t *buffer, int write) {
+// COMRESET: the drive drops every queued command and leaves any error state.
+static void ahci_port_reset(volatile ahci_port_regs_t *port) {
+    ahci_stop_port(port);
+    port->sctl = (port->sctl & ~0x0FU) | 0x01U;
+    // DET = 1 must be held for at least 1 ms.
+    for (uint32_t i = 0; i < ATA_POLL_TIMEOUT; i++) (void)port->ssts;
+    port->sctl &= ~0x0FU;
+    for (uint32_t i = 0; i < ATA_POLL_TIMEOUT; i++) {
+        if ((port->ssts & 0x0FU) == AHCI_PORT_DET_PRESENT) break;
+    }
+    port->serr = 0xFFFFFFFFU;
+    port->is = 0xFFFFFFFFU;
+    ahci_start_port(port);
+}
+
+// Every command in flight is lost after a task-file error or a timeout: the port is restarted
+// and all of them are reported failed. A drive that still holds NCQ commands is reset too, so
+// it does not complete them into slots that get reused.
+static void ahci_abort_all(ahci_device_t *device) {
+    volatile ahci_port_regs_t *port = device->port;
+    int queued = (device->busy & ~device->untagged) != 0;
+    device->failed |= device->busy;
+    device->busy = 0;
+    device->untagged = 0;
+    if (queued) {
+        ahci_port_reset(port);
+        return;
+    }
+    ahci_stop_port(port);
+    port->serr = 0xFFFFFFFFU;
+    port->is = 0xFFFFFFFFU;
+    ahci_start_port(port);
+}
+
+// Reads the NCQ command error log through `slot`, polled, on a port with nothing else
+// running. Returns the tag of the command that failed, or -1.
+static int ahci_read_ncq_log(ahci_device_t *device, int slot) {
+    volatile ahci_port_regs_t *port = device->port;
+    ahci_cmd_header_t *header = &device->cmd_list[slot];
+    ahci_cmd_table_t *table = &device->cmd_table[slot];
+    ahci_fis_reg_h2d_t *fis = (ahci_fis_reg_h2d_t *)table->cfis;
+    uint32_t bit = 1U << slot;
+
+    if (!device->ncq_log) device->ncq_log = (uint8_t *)kmem_alloc(512, 512);
+    if (!device->ncq_log) return -1;
+    if (!ahci_port_wait_ready(port)) return -1;
+
+    kmemset(header, 0, sizeof(*header));
+    kmemset(table, 0, sizeof(*table));
+    table->prdt_entry[0].dba = (uint32_t)(uintptr_t)device->ncq_log;
+    table->prdt_entry[0].dbc = 511U;
+    table->prdt_entry[0].i = 1;
+    header->cfl = sizeof(ahci_fis_reg_h2d_t) / sizeof(uint32_t);
+    header->prdtl = 1;
+    header->ctba = (uint32_t)(uintptr_t)table;
+    fis->fis_type = AHCI_FIS_TYPE_REG_H2D;
+    fis->c = 1;
+    fis->command = AHCI_ATA_CMD_READ_LOG_EXT;
+    fis->lba0 = AHCI_NCQ_ERROR_LOG;
+    fis->countl = 1;
+
+    port->ci = bit;
+    for (uint32_t i = 0; i < ATA_POLL_TIMEOUT && (port->ci & bit); i++) {
+        if (port->is & AHCI_PXIS_TFES) return -1;
+    }
+    if (port->ci & bit) return -1;
+    // Byte 0: bit 7 (NQ) = the error was not on a queued command, bits 4:0 = its tag.
+    if (device->ncq_log[0] & 0x80U) return -1;
+    return device->ncq_log[0] & 0x1F;
+}
+
+// A task-file error while NCQ commands are queued: the drive refuses new commands until its
+// error log is read, and reading it aborts everything it still had queued. Only the tag the
+// log names fails; the other outstanding commands are issued again from their unchanged
+// command tables. Without a spare slot or a usable log the port gets a COMRESET instead.
+static void ahci_ncq_error(ahci_device_t *device) {
+    volatile ahci_port_regs_t *port = device->port;
+    uint32_t slot_mask = device->slot_count >= 32 ? 0xFFFFFFFFU : ((1U << device->slot_count) - 1U);
+    uint32_t spare = ~device->claimed & slot_mask;
+    int tag = -1;
+
+    // Slots the device already reported done finished fine.
+    device->busy &= port->ci | port->sact;
+    ahci_stop_port(port);
+    port->serr = 0xFFFFFFFFU;
+    port->is = 0xFFFFFFFFU;
+    ahci_start_port(port);
+
+    if (spare) tag = ahci_read_ncq_log(device, __builtin_ctz(spare));
+    if (tag < 0 || !(device->busy & (1U << tag))) {
+        ahci_abort_all(device);
+        return;
+    }
+    device->failed |= 1U << tag;
+    device->busy &= ~(1U << tag);
+    port->is = 0xFFFFFFFFU;
+    if (!device->busy) return;
+    for (uint32_t retry = device->busy; retry; retry &= retry - 1U) {
+        device->cmd_list[__builtin_ctz(retry)].prdbc = 0;
+    }
+    port->sact = device->busy;
+    port->ci = device->busy;
+}
+
+static uint32_t ahci_slot_count(uint32_t mask) {
+    uint32_t n = 0;
+    for (; mask; mask &= mask - 1U) n++;
+    return n;
+}
+
+// Retires finished commands: a slot is done once the HBA has cleared it in PxCI and, for
+// NCQ, the device has cleared it in PxSACT.
+static void ahci_reap(ahci_device_t *device) {
+    volatile ahci_port_regs_t *port = device->port;
+    // Taken before PxCI is read: an interrupt arriving after this stays pending for
+    // ahci_sleep(), so no completion is missed.
+    uint32_t status = __atomic_exchange_n(&device->irq_status, 0, __ATOMIC_SEQ_CST);
+    if (!device->busy) return;
+    if ((port->is | status) & AHCI_PXIS_TFES) {
+        if (device->untagged) ahci_abort_all(device);
+        else ahci_ncq_error(device);
+        return;
+    }
+    device->busy &= port->ci | port->sact;
+    device->untagged &= device->busy;
+}
+
+// Shared by every HBA: the MSI vector, and the PIC lines of HBAs left on INTx. Port status is
+// acknowledged here and handed to the waiting task; the slot masks are only touched by tasks.
+static void ahci_irq(interrupt_frame_t *frame) {
+    int vector = (int)(frame->int_no & 0xFF);
+    for (int i = 0; i < AHCI_MAX_DEVICES; i++) {
+        ahci_device_t *device = &g_ahci_devices[i];
+        uint32_t bit = 1U << device->port_index;
+        uint32_t status;
+        if (!device->present || device->irq_vector != vector) continue;
+        if (!(device->hba->is & bit)) continue;
+        status = device->port->is;
+        device->port->is = status;
+        device->hba->is = bit;
+        __atomic_or_fetch(&device->irq_status, status, __ATOMIC_SEQ_CST);
+        wait_queue_wake_all(&device->irq_wq);
+    }
+    if (vector == CPU_AHCI_VECTOR) smp_lapic_eoi();
+    else cpu_irq_eoi(vector - CPU_IRQ_BASE);
+}
+
+// Points the MSI capability at the BSP. Returns 0 if the HBA has none or the LAPIC is off.
+static int ahci_enable_msi(const ahci_device_t *device) {
+    uint8_t bus = device->pci_bus;
+    uint8_t slot = device->pci_slot;
+    uint8_t function = device->pci_function;
+    int apic_id = smp_msi_apic_id();
+    uint8_t cap;
+
+    if (apic_id < 0) return 0;
+    if (!(pci_config_read32(bus, slot, function, 0x04) & (1U << 20))) return 0;
+    cap = (uint8_t)(pci_config_read32(bus, slot, function, 0x34) & 0xFCU);
+    for (int guard = 0; cap && guard < 48; guard++) {
+        uint32_t header = pci_config_read32(bus, slot, function, cap);
+        if ((header & 0xFFU) == PCI_CAP_ID_MSI) {
+            uint32_t control = header >> 16;
+            uint8_t data_offset = (control & (1U << 7)) ? 0x0C : 0x08;
+            pci_config_write32(bus, slot, function, cap + 4, 0xFEE00000U | ((uint32_t)apic_id << 12));
+            if (data_offset == 0x0C) pci_config_write32(bus, slot, function, cap + 8, 0);
+            // Fixed delivery, edge triggered, a single vector.
+            pci_config_write32(bus, slot, function, cap + data_offset, CPU_AHCI_VECTOR);
+            control = (control & ~0x70U) | 1U;
+            pci_config_write32(bus, slot, function, cap, (header & 0xFFFFU) | (control << 16));
+            return 1;
+        }
+        cap = (uint8_t)((header >> 8) & 0xFCU);
+    }
+    return 0;
+}
+
+// Interrupts are set up on the first wait that could sleep rather than at probe time: the
+// disks are probed before smp_start_aps() enables the local APIC that MSIs are sent to. Every
+// port of the HBA is switched over together.
+static void ahci_irq_setup(ahci_device_t *device) {
+    uint8_t bus = device->pci_bus;
+    uint8_t slot = device->pci_slot;
+    uint8_t function = device->pci_function;
+    uint32_t command = pci_config_read32(bus, slot, function, 0x04);
+    int vector = 0;
+
+    if (ahci_enable_msi(device)) {
+        vector = CPU_AHCI_VECTOR;
+        command |= 1U << 10;  // INTx disable
+    } else {
+        uint8_t line = (uint8_t)(pci_config_read32(bus, slot, function, 0x3C) & 0xFFU);
+        // INTx lines are not shared: one some other driver owns (timer, keyboard, mouse) or the
+        // PIC cascade leaves the HBA polled.
+        if (line != 2 && line < 16) {
+            isr_handler_t owner = cpu_get_isr_handler(CPU_IRQ_BASE + line);
+            if (!owner || owner == ahci_irq) vector = CPU_IRQ_BASE + line;
+        }
+        command &= ~(1U << 10);
+    }
+    pci_config_write32(bus, slot, function, 0x04, command & 0xFFFFU);
+
+    for (int i = 0; i < AHCI_MAX_DEVICES; i++) {
+        ahci_device_t *other = &g_ahci_devices[i];
+        if (!other->present || other->hba != device->hba) continue;
+        other->irq_tried = 1;
+        other->irq_vector = vector;
+        if (vector) other->port->ie = AHCI_PXIE_MASK;
+    }
+    if (!vector) return;
+    cpu_set_isr_handler(vector, ahci_irq);
+    if (vector != CPU_AHCI_VECTOR) cpu_irq_unmask(vector - CPU_IRQ_BASE);
+    device->hba->is = 0xFFFFFFFFU;
+    device->hba->ghc |= AHCI_GHC_IE;
+}
+
+// Only tasks inside a disk-exclusive section sleep on the port: other tasks are kept out of
+// the disk layer while they are switched away. Everyone else polls, as during boot.
+static int ahci_can_sleep(ahci_device_t *device) {
+    task_t *me = task_current();
+    if (!me || g_disk_exclusive_owner != me) return 0;
+    if (!device->irq_tried) ahci_irq_setup(device);
+    return device->irq_vector != 0;
+}
+
+// Blocks until the port's next interrupt. Returns 0 once `deadline` (timer ticks) has passed.
+static int ahci_sleep(ahci_device_t *device, uint64_t deadline) {
+    uint64_t now = timer_ticks();
+    if (now >= deadline) return 0;
+    task_wait_prepare(&device->irq_wq, (uint32_t)(deadline - now));
+    if (!device->irq_status) task_yield();
+    task_wait_finish(&device->irq_wq);
+    return 1;
+}
+
+// Starts a command in a free slot without waiting for it. READ/WRITE DMA EXT become their
+// FPDMA QUEUED forms on NCQ disks and share the port up to the queue depth; anything else
+// waits for the port to go idle and runs alone. Returns the slot, or -1.
+static int ahci_submit(ahci_device_t *device, uint8_t command, uint64_t lba, uint16_t sector_count, uint8_t *buffer, int write) {
     volatile ahci_port_regs_t *port;
     ahci_cmd_header_t *header;
     ahci_cmd_table_t *table;
     ahci_fis_reg_h2d_t *fis;
+    uint32_t bytes = (uint32_t)sector_count * 512U;
+    uint32_t entries = 0;
+    uint32_t slot_mask;
+    int queued;
+    int sleep;
+    uint64_t deadline = 0;
+    int slot = -1;
 
-    if (!device || !device->present || !buffer || sector_count == 0) return 0;
-    if (!ahci_prepare_port(device)) return 0;
+    if (!device || !device->present || !buffer || sector_count == 0) return -1;
+    if (!ahci_prepare_port(device)) return -1;
 
     port = device->port;
-    header = &device->cmd_list[0];
-    table = device->cmd_table;
-
-    if (!ahci_port_wait_ready(port)) return 0;
+    queued = device->ncq && (command == AHCI_ATA_CMD_READ_DMA_EXT || command == AHCI_ATA_CMD_WRITE_DMA_EXT);
+    slot_mask = device->slot_count >= 32 ? 0xFFFFFFFFU : ((1U << device->slot_count) - 1U);
+    sleep = ahci_can_sleep(device);
+    if (sleep) deadline = timer_ticks() + AHCI_IRQ_TIMEOUT_TICKS;
+
+    for (uint32_t i = 0;; i++) {
+        uint32_t free_slots;
+        ahci_reap(device);
+        free_slots = ~device->claimed & slot_mask;
+        if (queued) {
+            if (free_slots && !device->untagged
+                && ahci_slot_count(device->busy) < device->queue_depth) {
+                slot = __builtin_ctz(free_slots);
+                break;
+            }
+        } else if (!device->busy && free_slots) {
+            slot = __builtin_ctz(free_slots);
+            break;
+        }
+        // Nothing to sleep on while the port is idle: the slots are held by other callers.
+        if (sleep && device->busy) {
+            if (!ahci_sleep(device, deadline)) return -1;
+        } else if (i >= ATA_POLL_TIMEOUT) {
+            return -1;
+        }
+    }
 
-    port->is = 0xFFFFFFFFU;
-    port->serr = 0xFFFFFFFFU;
-    for (uint32_t i = 0; i < ATA_POLL_TIMEOUT; i++) {
-        if (!(port->ci & 1U)) break;
+    if (!device->busy) {
+        if (!ahci_port_wait_ready(port)) return -1;
+        port->is = 0xFFFFFFFFU;
+        port->serr = 0xFFFFFFFFU;
     }
-    if (port->ci & 1U) return 0;
 
+    header = &device->cmd_list[slot];
+    table = &device->cmd_table[slot];
     kmemset(header, 0, sizeof(*header));
     kmemset(table, 0, sizeof(*table));
 
+    // The buffer is physically contiguous (see disk_dma_buffer_ok); it is only split at the
+    // 4 MiB limit of a PRDT entry.
+    while (bytes > 0) {
+        uint32_t chunk = bytes > AHCI_PRDT_MAX_BYTES ? AHCI_PRDT_MAX_BYTES : bytes;
+        table->prdt_entry[entries].dba = (uint32_t)(uintptr_t)buffer;
+        table->prdt_entry[entries].dbau = 0;
+        table->prdt_entry[entries].dbc = chunk - 1U;
+        buffer += chunk;
+        bytes -= chunk;
+        entries++;
+    }
+    table->prdt_entry[entries - 1].i = 1;
+
     header->cfl = sizeof(ahci_fis_reg_h2d_t) / sizeof(uint32_t);
     header->w = write ? 1 : 0;
-    header->prdtl = 1;
+    header->prdtl = (uint16_t)entries;
     header->ctba = (uint32_t)(uintptr_t)table;
     header->ctbau = 0;
 
-    table->prdt_entry[0].dba = (uint32_t)(uintptr_t)buffer;
-    table->prdt_entry[0].dbau = 0;
-    table->prdt_entry[0].dbc = ((uint32_t)sector_count * 512U) - 1U;
-    table->prdt_entry[0].i = 1;
-
     fis = (ahci_fis_reg_h2d_t *)table->cfis;
     fis->fis_type = AHCI_FIS_TYPE_REG_H2D;
     fis->c = 1;
-    fis->command = command;
     fis->device = 1U << 6;
     fis->lba0 = (uint8_t)(lba & 0xFFU);
     fis->lba1 = (uint8_t)((lba >> 8) & 0xFFU);
@@ -764,21 +1176,54 @@ static int ahci_issue_ata(ahci_device_t *device, uint8_t command, uint64_t lba,
     fis->lba3 = (uint8_t)((lba >> 24) & 0xFFU);
     fis->lba4 = (uint8_t)((lba >> 32) & 0xFFU);
     fis->lba5 = (uint8_t)((lba >> 40) & 0xFFU);
-    fis->countl = (uint8_t)(sector_count & 0xFFU);
-    fis->counth = (uint8_t)((sector_count >> 8) & 0xFFU);
+    if (queued) {
+        // FPDMA QUEUED: sector count in the feature fields, tag in count bits 7:3.
+        fis->command = write ? AHCI_ATA_CMD_WRITE_FPDMA : AHCI_ATA_CMD_READ_FPDMA;
+        fis->featurel = (uint8_t)(sector_count & 0xFFU);
+        fis->featureh = (uint8_t)((sector_count >> 8) & 0xFFU);
+        fis->countl = (uint8_t)(slot << 3);
+    } else {
+        fis->command = command;
+        fis->countl = (uint8_t)(sector_count & 0xFFU);
+        fis->counth = (uint8_t)((sector_count >> 8) & 0xFFU);
+    }
 
-    port->ci = 1U;
-    for (uint32_t i = 0; i < ATA_POLL_TIMEOUT; i++) {
-        if (!(port->ci & 1U)) break;
-        if (port->is & AHCI_PXIS_TFES) return 0;
+    device->claimed |= 1U << slot;
+    device->busy |= 1U << slot;
+    if (queued) port->sact = 1U << slot;
+    else device->untagged |= 1U << slot;
+    port->ci = 1U << slot;
+    return slot;
+}
+
+// Waits for `slot` from ahci_submit() and releases it. Returns 0 if its command failed.
+static int ahci_complete(ahci_device_t *device, int slot, uint16_t sector_count) {
+    uint32_t bit = 1U << slot;
+    uint32_t timeout = ATA_POLL_TIMEOUT * (1U + sector_count / 2048U);
+    int ok;
+
+    if (ahci_can_sleep(device)) {
+        uint64_t deadline = timer_ticks() + (uint64_t)AHCI_IRQ_TIMEOUT_TICKS * (1U + sector_count / 2048U);
+        ahci_reap(device);
+        while ((device->busy & bit) && ahci_sleep(device, deadline)) ahci_reap(device);
+    } else {
+        for (uint32_t i = 0; i < timeout && (device->busy & bit); i++) ahci_reap(device);
     }
+    if (device->busy & bit) ahci_abort_all(device);
 
-    if (port->ci & 1U) return 0;
-    if (port->is & AHCI_PXIS_TFES) return 0;
-    return 1;
+    ok = !(device->failed & bit);
+    device->failed &= ~bit;
+    device->claimed &= ~bit;
+    return ok;
 }
 
-static uint32_t ahci_identify_total_sectors(ahci_device_t *device) {
+static int ahci_issue_ata(ahci_device_t *device, uint8_t command, uint64_t lba, uint16_t sector_count, uint8_t *buffer, int write) {
+    int slot = ahci_submit(device, command, lba, sector_count, buffer, write);
+    if (slot < 0) return 0;
+    return ahci_complete(device, slot, sector_count);
+}
+
+static uint32_t ahci_identify_device(ahci_device_t *device) {
     uint8_t identify[512];
     uint16_t feat;
 
@@ -786,6 +1231,15 @@ static uint32_t ahci_identify_total_sectors(ahci_device_t *device) {
     kmemset(identify, 0, sizeof(identify));
     if (!ahci_issue_ata(device, AHCI_ATA_CMD_IDENTIFY_DEVICE, 0, 1, identify, 0)) return 0;
 
+    // Word 76 bit 8: NCQ supported; word 75: queue depth - 1.
+    if ((device->hba->cap & AHCI_CAP_SNCQ) && (read_le16(&identify[152]) & (1U << 8))) {
+        uint32_t depth = (read_le16(&identify[150]) & 0x1FU) + 1U;
+        // One slot stays free for the READ LOG EXT of ahci_ncq_error().
+        if (depth > device->slot_count - 1U) depth = device->slot_count - 1U;
+        device->queue_depth = (uint8_t)depth;
+        device->ncq = depth > 1;
+    }
+
     feat = read_le16(&identify[166]);
     if (feat & (1 << 10)) return read_le32(&identify[200]);
     return read_le32(&identify[120]);
@@ -801,6 +1255,73 @@ static int ahci_device_write_sector(const ahci_device_t *device, uint32_t lba, c
     return ahci_issue_ata((ahci_device_t *)device, AHCI_ATA_CMD_WRITE_DMA_EXT, lba, 1, (uint8_t *)buffer, 1);
 }
 
+static uint8_t *g_disk_bounce = NULL;
+
+// Bus-master DMA sees physical addresses. Kernel memory is identity-mapped below 4 GiB, but the
+// per-task app and shared-memory windows are not, and PRDT/PRD addresses must be even.
+static int disk_dma_buffer_ok(const void *buffer, uint32_t bytes) {
+    uint64_t addr = (uint64_t)(uintptr_t)buffer;
+    if (addr & 1U) return 0;
+    if (addr + bytes > 0x100000000ULL) return 0;
+    return addr + bytes <= MLJOS_APP_VADDR || addr >= MLJOS_SHM_VADDR + MLJOS_SHM_MAX_SIZE;
+}
+
+static uint8_t *disk_bounce_buffer(void) {
+    if (!g_disk_bounce) g_disk_bounce = (uint8_t *)kmem_alloc(DISK_BOUNCE_SECTORS * 512U, 4096);
+    return g_disk_bounce;
+}
+
+// Up to AHCI_MAX_SECTORS per command. On NCQ disks a direct transfer is split over the queue
+// so its pieces are in flight together; buffers DMA cannot reach go through the bounce buffer
+// one command at a time.
+static int ahci_device_transfer(const ahci_device_t *device, uint32_t lba, uint32_t count, uint8_t *buffer, int write) {
+    ahci_device_t *dev = (ahci_device_t *)device;
+    uint8_t command = write ? AHCI_ATA_CMD_WRITE_DMA_EXT : AHCI_ATA_CMD_READ_DMA_EXT;
+    int direct = disk_dma_buffer_ok(buffer, count * 512U);
+    uint8_t *bounce = direct ? NULL : disk_bounce_buffer();
+    uint32_t chunk = AHCI_MAX_SECTORS;
+    int slots[AHCI_MAX_SLOTS];
+    uint16_t sizes[AHCI_MAX_SLOTS];
+    int pending = 0;
+    int ok = 1;
+
+    if (!dev || !dev->present) return 0;
+    if (!direct && !bounce) return 0;
+    if (direct && dev->ncq) {
+        chunk = (count + dev->queue_depth - 1U) / dev->queue_depth;
+        if (chunk < AHCI_NCQ_MIN_CHUNK) chunk = AHCI_NCQ_MIN_CHUNK;
+        if (chunk > AHCI_MAX_SECTORS) chunk = AHCI_MAX_SECTORS;
+    }
+
+    while (count > 0 && ok) {
+        uint32_t n = count > chunk ? chunk : count;
+        if (!direct) {
+            if (n > DISK_BOUNCE_SECTORS) n = DISK_BOUNCE_SECTORS;
+            if (write) kmemcpy(bounce, buffer, n * 512U);
+            ok = ahci_issue_ata(dev, command, lba, (uint16_t)n, bounce, write);
+            if (ok && !write) kmemcpy(buffer, bounce, n * 512U);
+        } else {
+            if (pending == dev->queue_depth) {
+                for (int i = 0; i < pending; i++) {
+                    if (!ahci_complete(dev, slots[i], sizes[i])) ok = 0;
+                }
+                pending = 0;
+            }
+            slots[pending] = ahci_submit(dev, command, lba, (uint16_t)n, buffer, write);
+            sizes[pending] = (uint16_t)n;
+            if (slots[pending] < 0) ok = 0;
+            else pending++;
+        }
+        lba += n;
+        buffer += n * 512U;
+        count -= n;
+    }
+    for (int i = 0; i < pending; i++) {
+        if (!ahci_complete(dev, slots[i], sizes[i])) ok = 0;
+    }
+    return ok;
+}
+
 static int ata_wait_bsy(uint16_t io_base) {
     for (uint32_t i = 0; i < ATA_POLL_TIMEOUT; i++) {
         if (!(inb(io_base + 7) & 0x80)) return 1;
@@ -817,58 +1338,172 @@ static int ata_wait_drq_or_err(uint16_t io_base) {
     return 0;
 }
 
-static int ata_device_read_sector(const ata_device_t *device, uint32_t lba, uint8_t *buffer) {
-    uint16_t io_base;
-
-    if (!device || !device->present) return 0;
-    io_base = device->io_base;
+// Loads the task file for `count` sectors (at most 256 on an LBA28 drive) and issues
+// `command`. LBA48 registers are written twice, high-order bytes first.
+static int ata_issue(const ata_device_t *device, uint8_t command, uint32_t lba, uint32_t count) {
+    uint16_t io_base = device->io_base;
 
     if (!ata_wait_bsy(io_base)) return 0;
-    outb(io_base + 6, device->drive_select | ((lba >> 24) & 0x0F));
-    outb(io_base + 2, 1);
+    if (device->lba48) {
+        outb(io_base + 6, (uint8_t)(device->drive_select & 0xF0U));
+        outb(io_base + 2, (uint8_t)(count >> 8));
+        outb(io_base + 3, (uint8_t)(lba >> 24));
+        outb(io_base + 4, 0);
+        outb(io_base + 5, 0);
+    } else {
+        if (lba + count > 0x10000000U) return 0;
+        outb(io_base + 6, device->drive_select | ((lba >> 24) & 0x0F));
+    }
+    outb(io_base + 2, (uint8_t)count);
     outb(io_base + 3, (uint8_t)lba);
     outb(io_base + 4, (uint8_t)(lba >> 8));
     outb(io_base + 5, (uint8_t)(lba >> 16));
-    outb(io_base + 7, 0x20);
-    if (!ata_wait_bsy(io_base)) return 0;
-    if (!ata_wait_drq_or_err(io_base)) return 0;
-
-    for (int i = 0; i < 256; i++) {
-        uint16_t data = inw(io_base);
-        buffer[i * 2] = (uint8_t)(data & 0xFF);
-        buffer[i * 2 + 1] = (uint8_t)(data >> 8);
-    }
+    outb(io_base + 7, command);
     return 1;
 }
 
-static int ata_device_write_sector(const ata_device_t *device, uint32_t lba, const uint8_t *buffer) {
-    uint8_t status;
-    uint16_t io_base;
+// PIO data phase, one DRQ block at a time: a single sector, or `multiple` sectors once
+// SET MULTIPLE was accepted, so the drive only raises DRQ once per block.
+static int ata_pio_transfer(const ata_device_t *device, uint32_t lba, uint32_t count, uint8_t *buffer, int write) {
+    uint16_t io_base = device->io_base;
+    uint32_t block = device->multiple ? device->multiple : 1U;
+    uint8_t command;
 
-    if (!device || !device->present) return 0;
-    io_base = device->io_base;
+    if (device->multiple) {
+        if (write) command = device->lba48 ? ATA_CMD_WRITE_MULTIPLE_EXT : ATA_CMD_WRITE_MULTIPLE;
+        else command = device->lba48 ? ATA_CMD_READ_MULTIPLE_EXT : ATA_CMD_READ_MULTIPLE;
+    } else {
+        if (write) command = device->lba48 ? ATA_CMD_WRITE_PIO_EXT : ATA_CMD_WRITE_PIO;
+        else command = device->lba48 ? ATA_CMD_READ_PIO_EXT : ATA_CMD_READ_PIO;
+    }
+    if (!ata_issue(device, command, lba, count)) return 0;
 
-    if (!ata_wait_bsy(io_base)) return 0;
-    outb(io_base + 6, device->drive_select | ((lba >> 24) & 0x0F));
-    outb(io_base + 2, 1);
-    outb(io_base + 3, (uint8_t)lba);
-    outb(io_base + 4, (uint8_t)(lba >> 8));
-    outb(io_base + 5, (uint8_t)(lba >> 16));
-    outb(io_base + 7, 0x30);
-    if (!ata_wait_bsy(io_base)) return 0;
-    if (!ata_wait_drq_or_err(io_base)) return 0;
+    while (count > 0) {
+        uint32_t n = count > block ? block : count;
+        if (!ata_wait_bsy(io_base)) return 0;
+        if (!ata_wait_drq_or_err(io_base)) return 0;
+        if (write) outsw(io_base, buffer, n * 256U);
+        else insw(io_base, buffer, n * 256U);
+        buffer += n * 512U;
+        count -= n;
+    }
 
-    for (int i = 0; i < 256; i++) {
-        uint16_t data = buffer[i * 2] | ((uint16_t)buffer[i * 2 + 1] << 8);
-        outw(io_base, data);
+    if (write) {
+        if (!ata_wait_bsy(io_base)) return 0;
+        if (inb(io_base + 7) & 0x01) return 0;
     }
+    return 1;
+}
 
-    if (!ata_wait_bsy(io_base)) return 0;
-    status = inb(io_base + 7);
-    if (status & 0x01) return 0;
+// One bus-master DMA command. `buffer` must pass disk_dma_buffer_ok(); PRD regions may not
+// cross a 64 KiB boundary, and a byte count of 0 stands for 64 KiB.
+static int ata_dma_transfer(ata_device_t *device, uint32_t lba, uint32_t count, uint8_t *buffer, int write) {
+    uint16_t bm = device->bmide;
+    uint32_t addr = (uint32_t)(uintptr_t)buffer;
+    uint32_t bytes = count * 512U;
+    uint32_t timeout = ATA_POLL_TIMEOUT * (1U + count / 64U);
+    uint8_t direction = write ? 0 : ATA_BM_CMD_READ;
+    uint8_t command;
+    uint8_t status = 0;
+    int entries = 0;
+
+    if (!device->prd) device->prd = (uint32_t *)kmem_alloc(ATA_PRD_ENTRIES * 8U, 64);
+    if (!device->prd) return 0;
+    while (bytes > 0 && entries < ATA_PRD_ENTRIES) {
+        uint32_t chunk = 0x10000U - (addr & 0xFFFFU);
+        if (chunk > bytes) chunk = bytes;
+        device->prd[entries * 2] = addr;
+        device->prd[entries * 2 + 1] = chunk & 0xFFFFU;
+        addr += chunk;
+        bytes -= chunk;
+        entries++;
+    }
+    if (bytes > 0) return 0;
+    device->prd[entries * 2 - 1] |= 0x80000000U;
+
+    if (write) command = device->lba48 ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_WRITE_DMA;
+    else command = device->lba48 ? ATA_CMD_READ_DMA_EXT : ATA_CMD_READ_DMA;
+
+    outb(bm + ATA_BM_CMD, 0);
+    outb(bm + ATA_BM_STATUS, inb(bm + ATA_BM_STATUS) | ATA_BM_STATUS_ERROR | ATA_BM_STATUS_IRQ);
+    outl(bm + ATA_BM_PRDT, (uint32_t)(uintptr_t)device->prd);
+    outb(bm + ATA_BM_CMD, direction);
+    if (!ata_issue(device, command, lba, count)) return 0;
+    outb(bm + ATA_BM_CMD, direction | ATA_BM_CMD_START);
+
+    // The engine goes idle once the PRD table is used up, which can be well before the drive
+    // has committed the data and raised INTRQ: wait for the interrupt (or an error), then check
+    // that the engine has stopped.
+    for (uint32_t i = 0; i < timeout; i++) {
+        status = inb(bm + ATA_BM_STATUS);
+        if (status & (ATA_BM_STATUS_ERROR | ATA_BM_STATUS_IRQ)) break;
+    }
+    outb(bm + ATA_BM_CMD, direction);
+    outb(bm + ATA_BM_STATUS, status | ATA_BM_STATUS_ERROR | ATA_BM_STATUS_IRQ);
+
+    if ((status & (ATA_BM_STATUS_ERROR | ATA_BM_STATUS_ACTIVE)) || !(status & ATA_BM_STATUS_IRQ)) return 0;
+    if (!ata_wait_bsy(device->io_base)) return 0;
+    return !(inb(device->io_base + 7) & 0x21);
+}
+
+// DMA commands of up to ATA_DMA_MAX_SECTORS, through the bounce buffer when DMA cannot reach
+// `buffer`; PIO otherwise. A failed DMA command turns DMA off for the drive and is redone
+// with PIO.
+static int ata_device_transfer(const ata_device_t *device, uint32_t lba, uint32_t count, uint8_t *buffer, int write) {
+    ata_device_t *dev = (ata_device_t *)device;
+
+    if (!dev || !dev->present) return 0;
+    while (count > 0) {
+        uint32_t n = count > ATA_DMA_MAX_SECTORS ? ATA_DMA_MAX_SECTORS : count;
+        int ok = 0;
+
+        if (dev->dma) {
+            uint8_t *bounce;
+            if (disk_dma_buffer_ok(buffer, n * 512U)) {
+                ok = ata_dma_transfer(dev, lba, n, buffer, write);
+            } else if ((bounce = disk_bounce_buffer()) != NULL) {
+                if (n > DISK_BOUNCE_SECTORS) n = DISK_BOUNCE_SECTORS;
+                if (write) kmemcpy(bounce, buffer, n * 512U);
+                ok = ata_dma_transfer(dev, lba, n, bounce, write);
+                if (ok && !write) kmemcpy(buffer, bounce, n * 512U);
+            }
+            if (!ok) dev->dma = 0;
+        }
+        if (!ok) {
+            if (n > ATA_PIO_MAX_SECTORS) n = ATA_PIO_MAX_SECTORS;
+            if (!ata_pio_transfer(dev, lba, n, buffer, write)) return 0;
+        }
+        lba += n;
+        buffer += n * 512U;
+        count -= n;
+    }
     return 1;
 }
 
+static int ata_device_read_sector(const ata_device_t *device, uint32_t lba, uint8_t *buffer) {
+    return ata_device_transfer(device, lba, 1, buffer, 0);
+}
+
+static int ata_device_write_sector(const ata_device_t *device, uint32_t lba, const uint8_t *buffer) {
+    return ata_device_transfer(device, lba, 1, (uint8_t *)buffer, 1);
+}
+
+// Asks for `sectors` per DRQ block in READ/WRITE MULTIPLE; the drive refuses sizes it does not
+// support, and transfers then stay one sector per block.
+static void ata_set_multiple(ata_device_t *device, uint8_t sectors) {
+    uint16_t io_base = device->io_base;
+
+    device->multiple = 0;
+    if (sectors < 2 || !ata_wait_bsy(io_base)) return;
+    outb(io_base + 6, device->drive_select);
+    outb(io_base + 2, sectors);
+    outb(io_base + 7, ATA_CMD_SET_MULTIPLE);
+    if (!ata_wait_bsy(io_base)) return;
+    if (inb(io_base + 7) & 0x01) return;
+    device->multiple = sectors;
+}
+
+// Also records what the drive can do: LBA48, DMA, and the READ/WRITE MULTIPLE block size.
 static uint32_t ata_identify_total_sectors(ata_device_t *device) {
     uint8_t identify[512];
     uint16_t io_base;
@@ -887,15 +1522,16 @@ static uint32_t ata_identify_total_sectors(ata_device_t *device) {
     if (inb(io_base + 4) != 0 || inb(io_base + 5) != 0) return 0;
     if (!ata_wait_drq_or_err(io_base)) return 0;
 
-    for (int i = 0; i < 256; i++) {
-        uint16_t word = inw(io_base);
-        identify[i * 2] = (uint8_t)(word & 0xFF);
-        identify[i * 2 + 1] = (uint8_t)(word >> 8);
-    }
+    insw(io_base, identify, 256);
+
+    // Word 47: largest DRQ block in sectors; word 49 bit 8: DMA supported.
+    device->dma_capable = (read_le16(&identify[98]) & (1U << 8)) != 0;
+    ata_set_multiple(device, (uint8_t)(read_le16(&identify[94]) & 0xFFU));
 
     // Check for LBA48 support (word 83, bit 10)
     uint16_t feat = (uint16_t)identify[166] | ((uint16_t)identify[167] << 8);
     if (feat & (1 << 10)) {
+        device->lba48 = 1;
         // Return 32-bit field from LBA48 capacity (words 100-103)
         // Since our OS uses 32-bit LBA internally, we cap it at 4 billion sectors (2TB)
         return read_le32(&identify[200]);
@@ -904,10 +1540,37 @@ static uint32_t ata_identify_total_sectors(ata_device_t *device) {
     return read_le32(&identify[120]);
 }
 
+// A PCI IDE controller in compatibility mode owns the legacy channels at 0x1F0 and 0x170. Its
+// BAR4 holds the bus-master registers, eight ports per channel.
+static void ata_attach_bus_master(uint8_t bus, uint8_t slot, uint8_t function, uint8_t prog_if) {
+    uint32_t bar4;
+
+    if (!(prog_if & 0x80U)) return;
+    bar4 = pci_config_read32(bus, slot, function, 0x20);
+    if (!(bar4 & 1U) || !(bar4 & 0xFFFCU)) return;
+    pci_config_write32(bus, slot, function, 0x04, pci_config_read32(bus, slot, function, 0x04) | 0x00000005U);
+
+    for (int i = 0; i < ATA_MAX_DEVICES; i++) {
+        ata_device_t *ata = &g_ata_devices[i];
+        int secondary = ata->io_base == 0x170;
+        if (!ata->present || !ata->dma_capable) continue;
+        // Prog-if bits 0 and 2: the channel runs in native mode, away from the legacy ports.
+        if (prog_if & (secondary ? 0x04U : 0x01U)) continue;
+        ata->bmide = (uint16_t)((bar4 & 0xFFFCU) + (secondary ? 8U : 0U));
+        ata->dma = 1;
+    }
+}
+
 static void disk_probe_devices(void) {
     if (g_disk_devices_probed) return;
 
     int first_run = !g_disk_ever_probed;
+    // Device indices are about to be reassigned; cached sectors are keyed by them.
+    bcache_init(disk_raw_read_sector, disk_raw_write_sector, disk_raw_read_sectors, disk_raw_write_sectors);
+    if (!first_run) {
+        bcache_invalidate(-1);
+        disk_invalidate_volume(-1);
+    }
     int ahci_count = 0;
     g_disk_device_count = 0;
     kmemset(g_disk_devices, 0, sizeof(g_disk_devices));
@@ -922,6 +1585,11 @@ static void disk_probe_devices(void) {
         usb_delay(); // reuse usb_delay for a tiny wait
         if (inb(io_base + 4) == 0x14 && inb(io_base + 5) == 0xEB) is_atapi = 1;
 
+        g_ata_devices[i].lba48 = 0;
+        g_ata_devices[i].multiple = 0;
+        g_ata_devices[i].dma = 0;
+        g_ata_devices[i].dma_capable = 0;
+        g_ata_devices[i].bmide = 0;
         g_ata_devices[i].total_sectors = ata_identify_total_sectors(&g_ata_devices[i]);
         g_ata_devices[i].present = g_ata_devices[i].total_sectors > 0;
         
@@ -963,6 +1631,10 @@ static void disk_probe_devices(void) {
                 uint32_t ports_bitmap;
 
                 if ((pci_config_read32((uint8_t)bus, device, function, 0x00) & 0xFFFFU) == 0xFFFFU) continue;
+                if (class_code == AHCI_CLASS_STORAGE && subclass == IDE_SUBCLASS) {
+                    ata_attach_bus_master((uint8_t)bus, device, function, prog_if);
+                    continue;
+                }
                 if (class_code != AHCI_CLASS_STORAGE || subclass != AHCI_SUBCLASS_SATA || prog_if != AHCI_PROGIF_AHCI) continue;
 
                 pci_config_write32((uint8_t)bus, device, function, 0x04, pci_config_read32((uint8_t)bus, device, function, 0x04) | 0x00000006U);
@@ -976,7 +1648,8 @@ static void disk_probe_devices(void) {
                 if (!abar || (abar >> 32) != 0) continue;
 
                 hba = (volatile ahci_hba_regs_t *)(uintptr_t)abar;
-                hba->ghc |= AHCI_GHC_AE;
+                // Interrupts stay off until ahci_irq_setup() routes them somewhere.
+                hba->ghc = (hba->ghc | AHCI_GHC_AE) & ~AHCI_GHC_IE;
                 ports_bitmap = hba->pi;
 
                 for (int port_index = 0; port_index < 32 && g_disk_device_count < DISK_MAX_DEVICES; port_index++) {
@@ -992,11 +1665,14 @@ static void disk_probe_devices(void) {
                     ahci->hba = hba;
                     ahci->port = &hba->ports[port_index];
                     ahci->port_index = (uint8_t)port_index;
+                    ahci->pci_bus = (uint8_t)bus;
+                    ahci->pci_slot = device;
+                    ahci->pci_function = function;
                     ahci->name = "sata";
                     ahci->present = ahci_prepare_port(ahci);
                     if (!ahci->present) continue;
 
-                    ahci->total_sectors = ahci_identify_total_sectors(ahci);
+                    ahci->total_sectors = ahci_identify_device(ahci);
                     ahci->present = ahci->total_sectors > 0;
                     if (!ahci->present) continue;
 
@@ -1086,7 +1762,7 @@ static void ata_write_zero_sectors(uint32_t lba, uint32_t count) {
         // But it still needs the data in a buffer.
         
         for (uint32_t i = 0; i < count; i++) {
-            if (!usb_storage_write_sector(device->backend_index, lba + i, zero)) {
+            if (!ata_write_sector(lba + i, zero)) {
                 g_disk_io_error = 1;
                 return;
             }
@@ -1104,25 +1780,137 @@ static void ata_write_zero_sectors(uint32_t lba, uint32_t count) {
     }
 }
 
-static int ata_read_sector(uint32_t lba, uint8_t *buffer) {
-    disk_device_t *device = disk_current_device();
+static ata_device_t *disk_ata_device_at(const disk_device_t *device) {
+    if (device->backend_index < 0 || device->backend_index >= ATA_MAX_DEVICES) return 0;
+    if (!g_ata_devices[device->backend_index].present) return 0;
+    return &g_ata_devices[device->backend_index];
+}
 
-    if (!device) return 0;
-    if (device->type == DISK_BACKEND_ATA) return ata_device_read_sector(disk_current_ata_device(), lba, buffer);
-    if (device->type == DISK_BACKEND_AHCI) return ahci_device_read_sector(disk_current_ahci_device(), lba, buffer);
+static ahci_device_t *disk_ahci_device_at(const disk_device_t *device) {
+    if (device->backend_index < 0 || device->backend_index >= AHCI_MAX_DEVICES) return 0;
+    if (!g_ahci_devices[device->backend_index].present) return 0;
+    return &g_ahci_devices[device->backend_index];
+}
+
+// Uncached sector I/O on device `dev`; the block cache calls these on a miss or write-back.
+static int disk_raw_read_sector(int dev, uint32_t lba, uint8_t *buffer) {
+    if (dev < 0 || dev >= g_disk_device_count) return 0;
+    disk_device_t *device = &g_disk_devices[dev];
+    if (device->type == DISK_BACKEND_ATA) return ata_device_read_sector(disk_ata_device_at(device), lba, buffer);
+    if (device->type == DISK_BACKEND_AHCI) return ahci_device_read_sector(disk_ahci_device_at(device), lba, buffer);
     if (device->type == DISK_BACKEND_USB) return usb_storage_read_sector(device->backend_index, lba, buffer);
     return 0;
 }
 
-static int ata_write_sector(uint32_t lba, const uint8_t *buffer) {
-    disk_device_t *device = disk_current_device();
-    if (!device) return 0;
-    if (device->type == DISK_BACKEND_ATA) return ata_device_write_sector(disk_current_ata_device(), lba, buffer);
-    if (device->type == DISK_BACKEND_AHCI) return ahci_device_write_sector(disk_current_ahci_device(), lba, buffer);
+static int disk_raw_write_sector(int dev, uint32_t lba, const uint8_t *buffer) {
+    if (dev < 0 || dev >= g_disk_device_count) return 0;
+    disk_device_t *device = &g_disk_devices[dev];
+    if (device->type == DISK_BACKEND_ATA) return ata_device_write_sector(disk_ata_device_at(device), lba, buffer);
+    if (device->type == DISK_BACKEND_AHCI) return ahci_device_write_sector(disk_ahci_device_at(device), lba, buffer);
     if (device->type == DISK_BACKEND_USB) return usb_storage_write_sector(device->backend_index, lba, buffer);
     return 0;
 }
 
+// Uncached multi-sector I/O. AHCI and ATA take the whole range in as few commands as
+// possible; USB still goes one sector at a time.
+static int disk_raw_read_sectors(int dev, uint32_t lba, uint32_t count, uint8_t *buffer) {
+    if (dev < 0 || dev >= g_disk_device_count) return 0;
+    disk_device_t *device = &g_disk_devices[dev];
+    if (device->type == DISK_BACKEND_ATA) return ata_device_transfer(disk_ata_device_at(device), lba, count, buffer, 0);
+    if (device->type == DISK_BACKEND_AHCI) return ahci_device_transfer(disk_ahci_device_at(device), lba, count, buffer, 0);
+    for (uint32_t i = 0; i < count; i++) {
+        if (!disk_raw_read_sector(dev, lba + i, buffer + (i * 512))) return 0;
+    }
+    return 1;
+}
+
+static int disk_raw_write_sectors(int dev, uint32_t lba, uint32_t count, const uint8_t *buffer) {
+    if (dev < 0 || dev >= g_disk_device_count) return 0;
+    disk_device_t *device = &g_disk_devices[dev];
+    if (device->type == DISK_BACKEND_ATA) return ata_device_transfer(disk_ata_device_at(device), lba, count, (uint8_t *)buffer, 1);
+    if (device->type == DISK_BACKEND_AHCI) return ahci_device_transfer(disk_ahci_device_at(device), lba, count, (uint8_t *)buffer, 1);
+    for (uint32_t i = 0; i < count; i++) {
+        if (!disk_raw_write_sector(dev, lba + i, buffer + (i * 512))) return 0;
+    }
+    return 1;
+}
+
+// Sector I/O on the active device, through the block cache.
+static int ata_read_sector(uint32_t lba, uint8_t *buffer) {
+    if (!disk_current_device()) return 0;
+    return bcache_read(g_disk_active_index, lba, buffer);
+}
+
+static int ata_write_sector(uint32_t lba, const uint8_t *buffer) {
+    if (!disk_current_device()) return 0;
+    fat32_ra_drop(g_disk_active_index);
+    return bcache_write(g_disk_active_index, lba, buffer);
+}
+
+// Transfers of `count` consecutive sectors; the FAT32 code issues one per cluster or
+// contiguous run.
+static int disk_read_sectors(uint32_t lba, uint32_t count, uint8_t *buffer) {
+    if (!disk_current_device()) return 0;
+    if (count == 0) return 1;
+    return bcache_read_many(g_disk_active_index, lba, count, buffer);
+}
+
+static int disk_write_sectors(uint32_t lba, uint32_t count, const uint8_t *buffer) {
+    if (!disk_current_device()) return 0;
+    if (count == 0) return 1;
+    fat32_ra_drop(g_disk_active_index);
+    return bcache_write_many(g_disk_active_index, lba, count, buffer);
+}
+
+// Several transfers in flight at once on an NCQ disk: each is queued on submit and
+// disk_batch_wait() collects them. Without NCQ, or for buffers DMA cannot reach, a transfer
+// simply completes on submit. `b` must start zeroed.
+typedef struct {
+    ahci_device_t *ahci;
+    int slots[AHCI_MAX_SLOTS];
+    uint16_t sizes[AHCI_MAX_SLOTS];
+    int pending;
+    int failed;
+} disk_batch_t;
+
+static int disk_batch_wait(disk_batch_t *b) {
+    for (int i = 0; i < b->pending; i++) {
+        if (!ahci_complete(b->ahci, b->slots[i], b->sizes[i])) b->failed = 1;
+    }
+    b->pending = 0;
+    return !b->failed;
+}
+
+static void disk_batch_io(disk_batch_t *b, uint32_t lba, uint32_t count, uint8_t *buffer, int write) {
+    disk_device_t *device = disk_current_device();
+    ahci_device_t *ahci = NULL;
+
+    if (b->failed || count == 0) return;
+    if (device && device->type == DISK_BACKEND_AHCI) ahci = disk_ahci_device_at(device);
+    if (ahci && ahci->ncq && count <= AHCI_MAX_SECTORS && disk_dma_buffer_ok(buffer, count * 512U)) {
+        if (write) {
+            bcache_drop_range(g_disk_active_index, lba, count);
+            fat32_ra_drop(g_disk_active_index);
+        } else if (!bcache_flush_range(g_disk_active_index, lba, count)) ahci = NULL;
+        if (ahci) {
+            // One slot stays free for the single-sector I/O interleaved with a batch.
+            if (b->pending + 1 >= ahci->queue_depth || (b->ahci && b->ahci != ahci)) (void)disk_batch_wait(b);
+            int slot = ahci_submit(ahci, write ? AHCI_ATA_CMD_WRITE_DMA_EXT : AHCI_ATA_CMD_READ_DMA_EXT,
+                                   lba, (uint16_t)count, buffer, write);
+            if (slot >= 0) {
+                b->ahci = ahci;
+                b->slots[b->pending] = slot;
+                b->sizes[b->pending] = (uint16_t)count;
+                b->pending++;
+                return;
+            }
+        }
+    }
+    // Synchronous transfers may need every slot.
+    if (!disk_batch_wait(b)) return;
+    if (!(write ? disk_write_sectors(lba, count, buffer) : disk_read_sectors(lba, count, buffer))) b->failed = 1;
+}
+
 static uint32_t fat32_cluster_to_lba(uint32_t cluster) {
     return g_fat32.data_start_lba + ((cluster - 2) * g_fat32.sectors_per_cluster);
 }
@@ -1137,29 +1925,24 @@ static void fat32_set_dir_first_cluster(fat32_dir_entry_t *entry, uint32_t clust
 }
 
 static void fat32_read_cluster(uint32_t cluster, uint8_t *buffer) {
-    uint32_t first_lba = fat32_cluster_to_lba(cluster);
-    for (uint8_t i = 0; i < g_fat32.sectors_per_cluster; i++) {
-        if (!ata_read_sector(first_lba + i, buffer + (i * 512))) {
-            g_disk_io_error = 1;
-            return;
-        }
-    }
+    if (!disk_read_sectors(fat32_cluster_to_lba(cluster), g_fat32.sectors_per_cluster, buffer)) g_disk_io_error = 1;
 }
 
 static void fat32_write_cluster(uint32_t cluster, const uint8_t *buffer) {
-    uint32_t first_lba = fat32_cluster_to_lba(cluster);
-    for (uint8_t i = 0; i < g_fat32.sectors_per_cluster; i++) {
-        if (!ata_write_sector(first_lba + i, buffer + (i * 512))) {
-            g_disk_io_error = 1;
-            return;
-        }
-    }
+    if (!disk_write_sectors(fat32_cluster_to_lba(cluster), g_fat32.sectors_per_cluster, buffer)) g_disk_io_error = 1;
 }
 
 static int fat32_mount(void) {
     uint8_t sector[512];
     uint32_t boot_lba = 0;
+    uint32_t gen = g_disk_media_gen[g_disk_active_index];
 
+    if (g_fat32.mounted && g_fat32.mount_gen == gen) return 1;
+    g_fat32.mounted = 0;
+    if (g_fat32.free_map) {
+        kmem_free(g_fat32.free_map);
+        g_fat32.free_map = NULL;
+    }
     if (!ata_read_sector(0, sector)) return 0;
     if (sector[510] != 0x55 || sector[511] != 0xAA) return 0;
 
@@ -1183,6 +1966,16 @@ static int fat32_mount(void) {
     g_fat32.data_start_lba = g_fat32.partition_lba + g_fat32.reserved_sector_count + (g_fat32.num_fats * g_fat32.fat_size_sectors);
     g_fat32.total_clusters = (g_fat32.total_sectors - (g_fat32.data_start_lba - g_fat32.partition_lba)) / g_fat32.sectors_per_cluster;
     g_fat32.alloc_search_hint = 3;
+    g_fat32.fsinfo_lba = 0;
+    g_fat32.free_count = FAT32_FSINFO_UNKNOWN;
+    g_fat32.fsinfo_dirty = 0;
+    {
+        uint16_t fsinfo_sector = read_le16(&sector[48]);
+        if (fsinfo_sector != 0 && fsinfo_sector != 0xFFFF && fsinfo_sector < g_fat32.reserved_sector_count) {
+            g_fat32.fsinfo_lba = boot_lba + fsinfo_sector;
+        }
+    }
+    g_fat32.mount_gen = gen;
     g_fat32.mounted = 1;
     if (!g_fat32.current_path[0]) fat32_reset_cwd();
 
@@ -1191,42 +1984,198 @@ static int fat32_mount(void) {
         return 0;
     }
 
+    // FSInfo only carries hints; a bad one is ignored rather than failing the mount.
+    if (g_fat32.fsinfo_lba && ata_read_sector(g_fat32.fsinfo_lba, sector)
+        && read_le32(&sector[0]) == 0x41615252 && read_le32(&sector[484]) == 0x61417272) {
+        uint32_t free_count = read_le32(&sector[488]);
+        uint32_t next_free = read_le32(&sector[492]);
+        if (free_count <= g_fat32.total_clusters) g_fat32.free_count = free_count;
+        if (next_free >= 2 && next_free < g_fat32.total_clusters + 2) g_fat32.alloc_search_hint = next_free;
+    } else {
+        g_fat32.fsinfo_lba = 0;
+    }
+
     return 1;
 }
 
-static uint32_t fat32_read_fat_entry(uint32_t cluster) {
+// Writes the window's dirty sectors to every FAT copy.
+static int fat32_fat_flush(void) {
+    fat32_fat_window_t *w = &g_fat32_window;
+    fat32_volume_t *volume;
+    if (w->dev < 0 || !w->dirty) return 1;
+    if (w->gen != g_disk_media_gen[w->dev]) {
+        // The volume went away under the window (format, re-probe); its FAT is obsolete.
+        w->dev = -1;
+        w->dirty = 0;
+        return 1;
+    }
+    // The window may belong to a device other than the active one (flushed on `disk use`).
+    volume = &g_fat32_volumes[w->dev];
+    fat32_ra_drop(w->dev);
+    for (uint32_t i = 0; i < w->count; i++) {
+        if (!(w->dirty & (1U << i))) continue;
+        for (uint8_t fat = 0; fat < volume->num_fats; fat++) {
+            uint32_t lba = volume->fat_start_lba + (fat * volume->fat_size_sectors) + w->first + i;
+            if (!bcache_write(w->dev, lba, &w->data[i * 512])) {
+                g_disk_io_error = 1;
+                return 0;
+            }
+        }
+    }
+    w->dirty = 0;
+    return 1;
+}
+
+// Returns the cached copy of FAT sector `fat_sector` (of the first FAT), loading the window
+// around it if needed.
+static uint8_t *fat32_fat_sector(uint32_t fat_sector) {
+    fat32_fat_window_t *w = &g_fat32_window;
+    int dev = g_disk_active_index;
+
+    if (fat_sector >= g_fat32.fat_size_sectors) return NULL;
+    if (w->dev == dev && w->gen == g_disk_media_gen[dev]
+        && fat_sector >= w->first && fat_sector < w->first + w->count) {
+        return &w->data[(fat_sector - w->first) * 512];
+    }
+    if (!fat32_fat_flush()) return NULL;
+
+    w->dev = -1;
+    w->first = fat_sector - (fat_sector % FAT32_FAT_WINDOW_SECTORS);
+    w->count = g_fat32.fat_size_sectors - w->first;
+    if (w->count > FAT32_FAT_WINDOW_SECTORS) w->count = FAT32_FAT_WINDOW_SECTORS;
+    if (!disk_read_sectors(g_fat32.fat_start_lba + w->first, w->count, w->data)) return NULL;
+    w->dev = dev;
+    w->gen = g_disk_media_gen[dev];
+    w->dirty = 0;
+    return &w->data[(fat_sector - w->first) * 512];
+}
+
+static void fat32_sync_fsinfo(void) {
     uint8_t sector[512];
+    if (!g_fat32.mounted || g_fat32.mount_gen != g_disk_media_gen[g_disk_active_index]) return;
+    if (!g_fat32.fsinfo_dirty || !g_fat32.fsinfo_lba) return;
+    if (!ata_read_sector(g_fat32.fsinfo_lba, sector)) return;
+    write_le32(&sector[488], g_fat32.free_count);
+    write_le32(&sector[492], g_fat32.alloc_search_hint);
+    if (ata_write_sector(g_fat32.fsinfo_lba, sector)) g_fat32.fsinfo_dirty = 0;
+}
+
+static uint32_t fat32_read_fat_entry(uint32_t cluster) {
     uint32_t fat_offset = cluster * 4;
-    uint32_t sector_lba = g_fat32.fat_start_lba + (fat_offset / 512);
-    uint16_t offset = (uint16_t)(fat_offset % 512);
+    uint8_t *sector = fat32_fat_sector(fat_offset / 512);
 
-    if (!ata_read_sector(sector_lba, sector)) {
+    if (!sector) {
         g_disk_io_error = 1;
         return 0;
     }
-    return read_le32(&sector[offset]) & 0x0FFFFFFF;
+    return read_le32(&sector[fat_offset % 512]) & 0x0FFFFFFF;
 }
 
+// Updates the window only; callers finish with fat32_fat_flush().
 static void fat32_write_fat_entry(uint32_t cluster, uint32_t value) {
-    uint8_t sector[512];
     uint32_t fat_offset = cluster * 4;
-    uint32_t fat_value = value & 0x0FFFFFFF;
+    uint8_t *sector = fat32_fat_sector(fat_offset / 512);
+    uint32_t offset = fat_offset % 512;
 
-    for (uint8_t fat = 0; fat < g_fat32.num_fats; fat++) {
-        uint32_t sector_lba = g_fat32.fat_start_lba + (fat * g_fat32.fat_size_sectors) + (fat_offset / 512);
-        uint16_t offset = (uint16_t)(fat_offset % 512);
-        if (!ata_read_sector(sector_lba, sector)) {
-            g_disk_io_error = 1;
-            return;
+    if (!sector) {
+        g_disk_io_error = 1;
+        return;
+    }
+    write_le32(&sector[offset], (value & 0x0FFFFFFF) | (read_le32(&sector[offset]) & 0xF0000000));
+    g_fat32_window.dirty |= 1U << (fat_offset / 512 - g_fat32_window.first);
+}
+
+static void fat32_map_set(uint32_t cluster, int free) {
+    uint32_t bit = cluster - 2;
+    if (!g_fat32.free_map || cluster < 2 || bit >= g_fat32.total_clusters) return;
+    if (free) g_fat32.free_map[bit >> 6] |= 1ULL << (bit & 63);
+    else g_fat32.free_map[bit >> 6] &= ~(1ULL << (bit & 63));
+}
+
+// Builds the free-cluster map with one pass over the FAT the first time the volume allocates.
+// Without memory for it allocation falls back to scanning the FAT through the window.
+static int fat32_build_free_map(void) {
+    uint32_t words = (g_fat32.total_clusters + 63) / 64;
+    uint32_t free_count = 0;
+    int io_error = g_disk_io_error;
+
+    if (g_fat32.free_map) return 1;
+    g_fat32.free_map = (uint64_t *)kmem_alloc((uint64_t)words * 8, 16);
+    if (!g_fat32.free_map) return 0;
+    kmemset(g_fat32.free_map, 0, words * 8);
+
+    g_disk_io_error = 0;
+    for (uint32_t cluster = 2; cluster < g_fat32.total_clusters + 2; cluster++) {
+        uint32_t value = fat32_read_fat_entry(cluster);
+        if (g_disk_io_error) {
+            kmem_free(g_fat32.free_map);
+            g_fat32.free_map = NULL;
+            return 0;
         }
-        fat_value |= read_le32(&sector[offset]) & 0xF0000000;
-        write_le32(&sector[offset], fat_value);
-        if (!ata_write_sector(sector_lba, sector)) {
-            g_disk_io_error = 1;
-            return;
+        if (value == 0) {
+            fat32_map_set(cluster, 1);
+            free_count++;
         }
-        fat_value = value & 0x0FFFFFFF;
+        if ((cluster & 8191U) == 8191U) task_yield();
     }
+    g_disk_io_error = io_error;
+    if (g_fat32.free_count != free_count) g_fat32.fsinfo_dirty = 1;
+    g_fat32.free_count = free_count;
+    return 1;
+}
+
+static int fat32_map_is_free(uint32_t bit) {
+    return (g_fat32.free_map[bit >> 6] >> (bit & 63)) & 1ULL;
+}
+
+// Scans map bits [lo, hi) for a free run of at least `want`. Returns 1 with it in *start/*len,
+// otherwise 0 with the longest run seen so far (across calls) left in *start/*len.
+static int fat32_map_scan_runs(uint32_t lo, uint32_t hi, uint32_t want, uint32_t *start, uint32_t *len) {
+    uint32_t bit = lo;
+    while (bit < hi) {
+        uint64_t word = g_fat32.free_map[bit >> 6];
+        if ((bit & 63) == 0 && word == 0) {
+            bit += 64;
+            continue;
+        }
+        if (!fat32_map_is_free(bit)) {
+            bit++;
+            continue;
+        }
+        uint32_t first = bit;
+        while (bit < hi) {
+            if ((bit & 63) == 0 && bit + 64 <= hi && g_fat32.free_map[bit >> 6] == ~0ULL) {
+                bit += 64;
+                continue;
+            }
+            if (!fat32_map_is_free(bit)) break;
+            bit++;
+        }
+        if (bit - first > *len) {
+            *start = first;
+            *len = bit - first;
+        }
+        if (*len >= want) return 1;
+    }
+    return 0;
+}
+
+// Picks where the next `want` clusters go: the first free run long enough at or after the
+// search hint, else the longest free run. Returns its first cluster with its length (at most
+// `want`) in *len_out, or 0 when the volume is full.
+static uint32_t fat32_map_find_run(uint32_t want, uint32_t *len_out) {
+    uint32_t total = g_fat32.total_clusters;
+    uint32_t hint = g_fat32.alloc_search_hint;
+    uint32_t start = 0;
+    uint32_t len = 0;
+
+    hint = (hint >= 2 && hint - 2 < total) ? hint - 2 : 0;
+    if (!fat32_map_scan_runs(hint, total, want, &start, &len)) {
+        (void)fat32_map_scan_runs(0, hint, want, &start, &len);
+    }
+    if (len == 0) return 0;
+    *len_out = len > want ? want : len;
+    return start + 2;
 }
 
 static void fat32_format_name_for_output(const uint8_t short_name[11], char *out) {
@@ -1556,57 +2505,95 @@ static uint32_t fat32_find_free_cluster(void) {
     return 0;
 }
 
-static uint32_t fat32_allocate_cluster_chain(uint32_t count) {
+// Allocates a chain of `count` clusters, taking contiguous runs where the free map allows.
+// `zero` clears the clusters (directories); file data is written over them by the caller.
+// With `contiguous` the chain must be a single run. Returns the first cluster or 0.
+static uint32_t fat32_allocate_clusters(uint32_t count, int zero, int contiguous) {
     uint32_t first = 0;
     uint32_t prev = 0;
+    uint32_t allocated = 0;
     uint8_t zero_cluster[4096];
     uint32_t cluster_bytes = (uint32_t)g_fat32.sectors_per_cluster * 512U;
 
-    if (cluster_bytes > sizeof(zero_cluster)) return 0;
-    kmemset(zero_cluster, 0, cluster_bytes);
+    if (count == 0 || cluster_bytes > sizeof(zero_cluster)) return 0;
+    if (zero) kmemset(zero_cluster, 0, cluster_bytes);
 
-    for (uint32_t i = 0; i < count; i++) {
-        uint32_t cluster = fat32_find_free_cluster();
-        if (cluster == 0) {
+    // With the map the free count is exact, so a request that cannot fit fails before
+    // anything is written.
+    if (fat32_build_free_map()) {
+        if (count > g_fat32.free_count) return 0;
+    } else if (contiguous) {
+        return 0;
+    }
+
+    while (allocated < count) {
+        uint32_t run = 1;
+        uint32_t cluster = g_fat32.free_map ? fat32_map_find_run(count - allocated, &run) : fat32_find_free_cluster();
+        if (cluster == 0 || (contiguous && run < count)) {
             if (first) {
                 uint32_t curr = first;
                 while (curr >= 2 && !is_fat32_eoc(curr)) {
                     uint32_t next = fat32_read_fat_entry(curr);
                     fat32_write_fat_entry(curr, 0);
+                    fat32_map_set(curr, 1);
+                    if (g_fat32.free_count != FAT32_FSINFO_UNKNOWN) g_fat32.free_count++;
                     if (is_fat32_eoc(next)) break;
                     curr = next;
                 }
             }
+            (void)fat32_fat_flush();
             return 0;
         }
 
-        fat32_write_fat_entry(cluster, FAT32_EOC);
-        fat32_write_cluster(cluster, zero_cluster);
-        g_fat32.alloc_search_hint = cluster + 1;
+        for (uint32_t i = 0; i < run; i++, cluster++) {
+            fat32_map_set(cluster, 0);
+            if (g_fat32.free_count != FAT32_FSINFO_UNKNOWN && g_fat32.free_count) g_fat32.free_count--;
+            fat32_write_fat_entry(cluster, FAT32_EOC);
+            if (zero) fat32_write_cluster(cluster, zero_cluster);
+            if (!first) first = cluster;
+            if (prev) fat32_write_fat_entry(prev, cluster);
+            prev = cluster;
+            if ((++allocated & 31U) == 31U) task_yield();
+        }
+        g_fat32.alloc_search_hint = prev + 1;
         if (g_fat32.alloc_search_hint >= g_fat32.total_clusters + 2) g_fat32.alloc_search_hint = 2;
-
-        if (!first) first = cluster;
-        if (prev) fat32_write_fat_entry(prev, cluster);
-        prev = cluster;
-        if ((i & 31U) == 31U) task_yield();
     }
 
+    g_fat32.fsinfo_dirty = 1;
+    if (!fat32_fat_flush()) return 0;
     return first;
 }
 
+static uint32_t fat32_allocate_cluster_chain(uint32_t count) {
+    return fat32_allocate_clusters(count, 1, 0);
+}
+
+static void fat32_release_cluster(uint32_t cluster) {
+    uint32_t bit = cluster - 2;
+    if (g_fat32.free_map && bit < g_fat32.total_clusters
+        && (g_fat32.free_map[bit >> 6] & (1ULL << (bit & 63)))) {
+        return;
+    }
+    fat32_write_fat_entry(cluster, 0);
+    fat32_map_set(cluster, 1);
+    if (g_fat32.free_count != FAT32_FSINFO_UNKNOWN && g_fat32.free_count < g_fat32.total_clusters) g_fat32.free_count++;
+}
+
 static void fat32_free_cluster_chain(uint32_t first_cluster) {
     uint32_t cluster = first_cluster;
     while (cluster >= 2 && !is_fat32_eoc(cluster)) {
         uint32_t next = fat32_read_fat_entry(cluster);
-        fat32_write_fat_entry(cluster, 0);
+        fat32_release_cluster(cluster);
         if (cluster < g_fat32.alloc_search_hint || g_fat32.alloc_search_hint < 2) g_fat32.alloc_search_hint = cluster;
         if (is_fat32_eoc(next)) break;
         cluster = next;
         if ((cluster & 31U) == 31U) task_yield();
     }
 
-    if (cluster >= 2 && cluster < FAT32_EOC) fat32_write_fat_entry(cluster, 0);
+    if (cluster >= 2 && cluster < FAT32_EOC) fat32_release_cluster(cluster);
     if (cluster >= 2 && cluster < g_fat32.alloc_search_hint) g_fat32.alloc_search_hint = cluster;
+    g_fat32.fsinfo_dirty = 1;
+    (void)fat32_fat_flush();
 }
 
 static int fat32_find_free_dir_slots(uint32_t dir_cluster, int needed, fat32_dir_slot_t *out_slots) {
@@ -1642,6 +2629,7 @@ static int fat32_find_free_dir_slots(uint32_t dir_cluster, int needed, fat32_dir
                 uint32_t extra = fat32_allocate_cluster_chain(1);
                 if (!extra) return 0;
                 fat32_write_fat_entry(cluster, extra);
+                if (!fat32_fat_flush()) return 0;
                 for (int i = 0; i < needed; i++) {
                     out_slots[i].sector_lba = fat32_cluster_to_lba(extra) + (uint32_t)((i * 32) / 512);
                     out_slots[i].offset = (uint16_t)((i * 32) % 512);
@@ -1740,28 +2728,178 @@ static int fat32_directory_is_empty(uint32_t cluster) {
     return 1;
 }
 
+// Follows the chain from *cluster while clusters are consecutive, up to `max` clusters.
+// Returns the run length and leaves *cluster at the cluster after the run (EOC at the end).
+static uint32_t fat32_chain_run(uint32_t *cluster, uint32_t max) {
+    uint32_t curr = *cluster;
+    uint32_t run = 1;
+    uint32_t next = fat32_read_fat_entry(curr);
+
+    while (run < max && next == curr + 1) {
+        curr = next;
+        run++;
+        next = fat32_read_fat_entry(curr);
+    }
+    *cluster = next;
+    return run;
+}
+
+// Reads `limit` bytes of the chain at `*cluster` into `out` with one transfer per contiguous
+// run and leaves *cluster at the cluster after the last run. Returns the bytes read, short on
+// an I/O error or a truncated chain.
+static uint32_t fat32_read_runs(uint32_t *cluster, uint32_t limit, uint8_t *out) {
+    uint8_t tail[512];
+    uint32_t cluster_bytes = (uint32_t)g_fat32.sectors_per_cluster * 512U;
+    uint32_t c = *cluster;
+    uint32_t done = 0;
+    disk_batch_t batch;
+
+    kmemset(&batch, 0, sizeof(batch));
+
+    while (done < limit && c >= 2 && !is_fat32_eoc(c)) {
+        uint32_t lba = fat32_cluster_to_lba(c);
+        uint32_t run = fat32_chain_run(&c, (limit - done + cluster_bytes - 1) / cluster_bytes);
+        uint32_t bytes = run * cluster_bytes;
+        if (bytes > limit - done) bytes = limit - done;
+
+        // Runs of a fragmented file are queued together; only the tail sector is read inline.
+        disk_batch_io(&batch, lba, bytes / 512, out + done, 0);
+        if (batch.failed) {
+            g_disk_io_error = 1;
+            break;
+        }
+        if (bytes % 512) {
+            if (!ata_read_sector(lba + bytes / 512, tail)) {
+                g_disk_io_error = 1;
+                break;
+            }
+            kmemcpy(out + done + (bytes & ~511U), tail, bytes % 512);
+        }
+        done += bytes;
+    }
+    if (!disk_batch_wait(&batch)) g_disk_io_error = 1;
+    *cluster = c;
+    return done;
+}
+
+static fat32_ra_stream_t *fat32_ra_find(uint32_t first_cluster, uint32_t size) {
+    int dev = g_disk_active_index;
+    for (int i = 0; i < FAT32_RA_STREAMS; i++) {
+        fat32_ra_stream_t *ra = &g_fat32_ra[i];
+        if (!ra->used || ra->dev != dev || ra->gen != g_disk_media_gen[dev]) continue;
+        if (ra->first_cluster != first_cluster || ra->file_size != size) continue;
+        ra->last_use = ++g_fat32_ra_clock;
+        return ra;
+    }
+    return NULL;
+}
+
+// (Re)fills a stream from the start of the file. A new stream reads four times the request,
+// at least FAT32_RA_MIN_BYTES; each refill of a file read short again doubles its window, up
+// to FAT32_RA_MAX_BYTES. Returns NULL when the request does not fit or the read failed.
+static fat32_ra_stream_t *fat32_ra_fill(fat32_ra_stream_t *ra, uint32_t first_cluster, uint32_t size, uint32_t limit) {
+    uint32_t cluster_bytes = (uint32_t)g_fat32.sectors_per_cluster * 512U;
+    uint32_t cluster = first_cluster;
+    uint32_t window;
+
+    if (limit > FAT32_RA_MAX_BYTES) {
+        if (ra) ra->used = 0;
+        return NULL;
+    }
+    if (ra) {
+        window = ra->window * 2U;
+    } else {
+        window = limit * 4U;
+        for (int i = 0; i < FAT32_RA_STREAMS; i++) {
+            fat32_ra_stream_t *slot = &g_fat32_ra[i];
+            if (!ra || !slot->used || (ra->used && slot->last_use < ra->last_use)) ra = slot;
+            if (!ra->used) break;
+        }
+        if (!ra->data) ra->data = (uint8_t *)kmem_alloc(FAT32_RA_MAX_BYTES, 4096);
+        if (!ra->data) return NULL;
+    }
+    if (window < FAT32_RA_MIN_BYTES) window = FAT32_RA_MIN_BYTES;
+    if (window > FAT32_RA_MAX_BYTES) window = FAT32_RA_MAX_BYTES;
+    if (window < limit) window = limit;
+    window = (window + cluster_bytes - 1U) / cluster_bytes * cluster_bytes;
+    if (window > size) window = size;
+
+    ra->used = 0;
+    if (fat32_read_runs(&cluster, window, ra->data) != window) return NULL;
+    ra->used = 1;
+    ra->dev = g_disk_active_index;
+    ra->gen = g_disk_media_gen[ra->dev];
+    ra->first_cluster = first_cluster;
+    ra->file_size = size;
+    ra->len = window;
+    ra->next_cluster = cluster;
+    ra->window = window;
+    ra->last_use = ++g_fat32_ra_clock;
+    g_fat32_ra_fills++;
+    return ra;
+}
+
+// Reads min(size, maxlen) bytes of the file whose chain starts at `cluster` into `out`, through
+// its readahead stream when it has one or the read stops short of the end.
+static uint32_t fat32_read_chain(uint32_t cluster, uint32_t size, uint8_t *out, uint32_t maxlen) {
+    uint32_t limit = size < maxlen ? size : maxlen;
+    fat32_ra_stream_t *ra = fat32_ra_find(cluster, size);
+    uint32_t done = 0;
+
+    if (ra && (ra->len >= limit || limit == size)) {
+        g_fat32_ra_hits++;
+    } else if (limit < size) {
+        ra = fat32_ra_fill(ra, cluster, size, limit);
+    }
+    if (ra) {
+        done = ra->len < limit ? ra->len : limit;
+        kmemcpy(out, ra->data, done);
+        if (done == limit) return done;
+        cluster = ra->next_cluster;
+    }
+    return done + fat32_read_runs(&cluster, limit - done, out + done);
+}
+
 static int fat32_write_file_data(uint32_t first_cluster, const char *text, uint32_t size) {
-    uint8_t cluster_buffer[4096];
+    uint8_t tail[512];
     uint32_t cluster_bytes = (uint32_t)g_fat32.sectors_per_cluster * 512U;
     uint32_t cluster = first_cluster;
     uint32_t copied = 0;
+    disk_batch_t batch;
 
-    if (cluster_bytes > sizeof(cluster_buffer)) return 0;
+    if (cluster_bytes > 4096U) return 0;
     if (size == 0) return 1;
-
-    while (cluster >= 2) {
-        kmemset(cluster_buffer, 0, cluster_bytes);
-        uint32_t to_copy = size - copied;
-        if (to_copy > cluster_bytes) to_copy = cluster_bytes;
-        for (uint32_t i = 0; i < to_copy; i++) cluster_buffer[i] = (uint8_t)text[copied + i];
-        fat32_write_cluster(cluster, cluster_buffer);
-        copied += to_copy;
-        if (copied >= size) return 1;
-
-        cluster = fat32_read_fat_entry(cluster);
-        if (is_fat32_eoc(cluster)) break;
+    kmemset(&batch, 0, sizeof(batch));
+
+    while (copied < size && cluster >= 2 && !is_fat32_eoc(cluster)) {
+        uint32_t lba = fat32_cluster_to_lba(cluster);
+        uint32_t run = fat32_chain_run(&cluster, (size - copied + cluster_bytes - 1) / cluster_bytes);
+        uint32_t bytes = run * cluster_bytes;
+        uint32_t sectors;
+        if (bytes > size - copied) bytes = size - copied;
+        sectors = bytes / 512;
+
+        disk_batch_io(&batch, lba, sectors, (uint8_t *)text + copied, 1);
+        if (batch.failed) break;
+        if (bytes % 512) {
+            kmemset(tail, 0, sizeof(tail));
+            kmemcpy(tail, text + copied + (bytes & ~511U), bytes % 512);
+            if (!ata_write_sector(lba + sectors, tail)) {
+                g_disk_io_error = 1;
+                break;
+            }
+            sectors++;
+        }
+        copied += bytes;
+        // File clusters are not zeroed at allocation; clear the slack after the last byte.
+        if (copied >= size && sectors < run * g_fat32.sectors_per_cluster) {
+            ata_write_zero_sectors(lba + sectors, run * g_fat32.sectors_per_cluster - sectors);
+            if (g_disk_io_error) break;
+        }
     }
 
+    if (!disk_batch_wait(&batch)) g_disk_io_error = 1;
+    if (g_disk_io_error) return 0;
     return copied >= size;
 }
 
@@ -1947,10 +3085,73 @@ int disk_select_device(int index) {
     if (!disk_require_not_busy("disk use")) return 0;
     disk_probe_devices();
     if (index < 0 || index >= g_disk_device_count || g_disk_devices[index].type == DISK_BACKEND_NONE) return 0;
+    fat32_sync_fsinfo();
+    (void)fat32_fat_flush();
+    // The new device may be a re-plugged stick behind the same index.
+    bcache_invalidate(-1);
+    disk_invalidate_volume(index);
     g_disk_active_index = index;
     return 1;
 }
 
+int disk_sync(void) {
+    if (!disk_require_not_busy_quiet()) return 0;
+    fat32_sync_fsinfo();
+    return bcache_flush(-1);
+}
+
+void cmd_disk_cache(const char *arg) {
+    bcache_stats_t st;
+    if (!disk_require_not_busy("disk cache")) return;
+    if (arg && strcmp(arg, "writeback") == 0) {
+        bcache_set_write_back(1);
+    } else if (arg && strcmp(arg, "writethrough") == 0) {
+        bcache_set_write_back(0);
+    } else if (arg && strcmp(arg, "flush") == 0) {
+        if (!disk_sync()) puts("disk cache: write-back failed\n");
+    } else if (arg) {
+        puts("disk cache: use writeback, writethrough or flush\n");
+        return;
+    }
+
+    bcache_get_stats(&st);
+    puts("disk cache: ");
+    puts(st.write_back ? "write-back" : "write-through");
+    puts(", ");
+    print_uint(st.cached);
+    puts("/");
+    print_uint(BCACHE_ENTRIES);
+    puts(" sectors, ");
+    print_uint(st.dirty);
+    puts(" dirty\n");
+    uint64_t lookups = st.hits + st.misses;
+    puts("hits ");
+    print_uint((uint32_t)st.hits);
+    puts(", misses ");
+    print_uint((uint32_t)st.misses);
+    if (lookups) {
+        puts(" (");
+        print_uint((uint32_t)(st.hits * 100 / lookups));
+        puts("% hit)");
+    }
+    puts(", writes ");
+    print_uint((uint32_t)st.writes);
+    puts(", write-backs ");
+    print_uint((uint32_t)st.writebacks);
+    puts(", evictions ");
+    print_uint((uint32_t)st.evictions);
+    puts(", range reads ");
+    print_uint((uint32_t)st.range_reads);
+    puts(", range writes ");
+    print_uint((uint32_t)st.range_writes);
+    putchar('\n');
+    puts("readahead: ");
+    print_uint((uint32_t)g_fat32_ra_hits);
+    puts(" hits, ");
+    print_uint((uint32_t)g_fat32_ra_fills);
+    puts(" fills\n");
+}
+
 void cmd_disk_devices(void) {
     if (!disk_require_not_busy("disk devices")) return;
     disk_probe_devices();
@@ -1964,8 +3165,24 @@ void cmd_disk_devices(void) {
         puts(g_disk_devices[i].label);
         puts(") ");
         print_uint(size_mb);
-        if (!g_disk_devices[i].writable) puts(" MiB ro\n");
-        else puts(" MiB rw\n");
+        puts(g_disk_devices[i].writable ? " MiB rw" : " MiB ro");
+        if (g_disk_devices[i].type == DISK_BACKEND_AHCI) {
+            ahci_device_t *ahci = disk_ahci_device_at(&g_disk_devices[i]);
+            if (ahci && ahci->ncq) {
+                puts(" ncq:");
+                print_uint(ahci->queue_depth);
+            }
+            if (ahci && ahci->irq_vector) puts(ahci->irq_vector == CPU_AHCI_VECTOR ? " irq:msi" : " irq:intx");
+        } else if (g_disk_devices[i].type == DISK_BACKEND_ATA) {
+            ata_device_t *ata = disk_ata_device_at(&g_disk_devices[i]);
+            if (ata && ata->dma) {
+                puts(" dma");
+            } else if (ata && ata->multiple) {
+                puts(" multi:");
+                print_uint(ata->multiple);
+            }
+        }
+        putchar('\n');
     }
 
     if (!g_disk_device_count) puts("disk devices: no disks detected\n");
@@ -2124,6 +3341,8 @@ void cmd_disk_format(void) {
     fsinfo[510] = 0x55;
     fsinfo[511] = 0xAA;
 
+    // Whatever was mounted here is gone even if the format fails half way.
+    disk_invalidate_volume(g_disk_active_index);
     if (!ata_write_sector(0, mbr)
         || !ata_write_sector(partition_lba, sector)
         || !ata_write_sector(partition_lba + 1, fsinfo)
@@ -2153,7 +3372,7 @@ void cmd_disk_format(void) {
     }
 
 
-    g_fat32.mounted = 0;
+    disk_invalidate_volume(g_disk_active_index);
     fat32_reset_cwd();
     if (!fat32_mount()) {
         puts("disk format: FAT32 mount failed after format\n");
@@ -2386,7 +3605,6 @@ void disk_prepare_session(void) {
     (void)disk_current_device();
     fat32_reset_cwd();
     g_disk_io_error = 0;
-    g_fat32.mounted = 0;
     (void)fat32_mount();
 }
 
@@ -2558,7 +3776,7 @@ void cmd_disk_write(const char *path, const char *text) {
     clusters_needed = (file_size + cluster_bytes - 1) / cluster_bytes;
 
     if (clusters_needed > 0) {
-        first_cluster = fat32_allocate_cluster_chain(clusters_needed);
+        first_cluster = fat32_allocate_clusters(clusters_needed, 0, 0);
         if (!first_cluster) {
             puts("disk write: out of clusters\n");
             return;
@@ -2688,7 +3906,7 @@ static int disk_write_file_internal(const char *path, const char *data, uint32_t
     clusters_needed = (file_size + cluster_bytes - 1) / cluster_bytes;
 
     if (clusters_needed > 0) {
-        first_cluster = fat32_allocate_cluster_chain(clusters_needed);
+        first_cluster = fat32_allocate_clusters(clusters_needed, 0, 0);
         if (!first_cluster) return 0;
         if (!fat32_write_file_data(first_cluster, data, file_size)) {
             fat32_free_cluster_chain(first_cluster);
@@ -2741,37 +3959,20 @@ static int disk_write_file_internal(const char *path, const char *data, uint32_t
 
 static int disk_read_text_file_internal(const char *path, char *out, int maxlen) {
     fat32_lookup_result_t entry;
-    uint32_t file_cluster;
     uint32_t remaining;
-    uint8_t cluster_buffer[4096];
-    uint32_t cluster_bytes;
     char resolved_path[128];
-    int offset = 0;
+    uint32_t offset;
 
     if (!fat32_normalize_path(path, resolved_path) || strcmp(resolved_path, "/") == 0) return 0;
     if (!fat32_resolve_path(resolved_path, NULL, &entry)) return 0;
     if (entry.entry.attr & FAT32_ATTR_DIRECTORY) return 0;
 
-    file_cluster = fat32_dir_first_cluster(&entry.entry);
     remaining = entry.entry.file_size;
-    cluster_bytes = (uint32_t)g_fat32.sectors_per_cluster * 512U;
-    if (cluster_bytes > sizeof(cluster_buffer)) return 0;
+    if ((uint32_t)g_fat32.sectors_per_cluster * 512U > 4096U) return 0;
     if ((int)remaining >= maxlen) return 0;
 
-    while (remaining > 0 && file_cluster >= 2) {
-        fat32_read_cluster(file_cluster, cluster_buffer);
-        if (g_disk_io_error) return 0;
-
-        {
-            uint32_t chunk = remaining > cluster_bytes ? cluster_bytes : remaining;
-            for (uint32_t i = 0; i < chunk && offset < maxlen - 1; i++) out[offset++] = (char)cluster_buffer[i];
-            remaining -= chunk;
-        }
-
-        if (remaining == 0) break;
-        file_cluster = fat32_read_fat_entry(file_cluster);
-        if (is_fat32_eoc(file_cluster)) break;
-    }
+    offset = fat32_read_chain(fat32_dir_first_cluster(&entry.entry), remaining, (uint8_t *)out, (uint32_t)maxlen - 1);
+    if (g_disk_io_error) return 0;
 
     out[offset] = '\0';
     return 1;
@@ -2779,12 +3980,8 @@ static int disk_read_text_file_internal(const char *path, char *out, int maxlen)
 
 int disk_read_file(const char *path, char *out, int maxlen, uint32_t *size_out) {
     fat32_lookup_result_t entry;
-    uint32_t file_cluster;
     uint32_t remaining;
-    uint8_t cluster_buffer[4096];
-    uint32_t cluster_bytes;
     char resolved_path[128];
-    int offset = 0;
 
     g_disk_io_error = 0;
     if (!disk_require_not_busy_quiet()) return 0;
@@ -2793,26 +3990,12 @@ int disk_read_file(const char *path, char *out, int maxlen, uint32_t *size_out)
     if (!fat32_resolve_path(resolved_path, NULL, &entry)) return 0;
     if (entry.entry.attr & FAT32_ATTR_DIRECTORY) return 0;
 
-    file_cluster = fat32_dir_first_cluster(&entry.entry);
     remaining = entry.entry.file_size;
-    cluster_bytes = (uint32_t)g_fat32.sectors_per_cluster * 512U;
-    if (cluster_bytes > sizeof(cluster_buffer)) return 0;
+    if ((uint32_t)g_fat32.sectors_per_cluster * 512U > 4096U) return 0;
     if ((int)remaining > maxlen) return 0;
 
-    while (remaining > 0 && file_cluster >= 2) {
-        fat32_read_cluster(file_cluster, cluster_buffer);
-        if (g_disk_io_error) return 0;
-
-        {
-            uint32_t chunk = remaining > cluster_bytes ? cluster_bytes : remaining;
-            for (uint32_t i = 0; i < chunk && offset < maxlen; i++) out[offset++] = (char)cluster_buffer[i];
-            remaining -= chunk;
-        }
-
-        if (remaining == 0) break;
-        file_cluster = fat32_read_fat_entry(file_cluster);
-        if (is_fat32_eoc(file_cluster)) break;
-    }
+    (void)fat32_read_chain(fat32_dir_first_cluster(&entry.entry), remaining, (uint8_t *)out, (uint32_t)maxlen);
+    if (g_disk_io_error) return 0;
 
     if (size_out) *size_out = entry.entry.file_size;
     return 1;
@@ -2820,12 +4003,8 @@ int disk_read_file(const char *path, char *out, int maxlen, uint32_t *size_out)
 
 int disk_read_file_prefix(const char *path, char *out, int maxlen, uint32_t *bytes_read_out) {
     fat32_lookup_result_t entry;
-    uint32_t file_cluster;
-    uint32_t remaining;
-    uint8_t cluster_buffer[4096];
-    uint32_t cluster_bytes;
     char resolved_path[128];
-    int offset = 0;
+    uint32_t offset;
 
     if (bytes_read_out) *bytes_read_out = 0;
     g_disk_io_error = 0;
@@ -2836,25 +4015,12 @@ int disk_read_file_prefix(const char *path, char *out, int maxlen, uint32_t *byt
     if (!fat32_resolve_path(resolved_path, NULL, &entry)) return 0;
     if (entry.entry.attr & FAT32_ATTR_DIRECTORY) return 0;
 
-    file_cluster = fat32_dir_first_cluster(&entry.entry);
-    remaining = entry.entry.file_size;
-    cluster_bytes = (uint32_t)g_fat32.sectors_per_cluster * 512U;
-    if (cluster_bytes > sizeof(cluster_buffer)) return 0;
+    if ((uint32_t)g_fat32.sectors_per_cluster * 512U > 4096U) return 0;
 
-    while (remaining > 0 && file_cluster >= 2 && offset < maxlen) {
-        fat32_read_cluster(file_cluster, cluster_buffer);
-        if (g_disk_io_error) return 0;
+    offset = fat32_read_chain(fat32_dir_first_cluster(&entry.entry), entry.entry.file_size, (uint8_t *)out, (uint32_t)maxlen);
+    if (g_disk_io_error) return 0;
 
-        uint32_t chunk = remaining > cluster_bytes ? cluster_bytes : remaining;
-        for (uint32_t i = 0; i < chunk && offset < maxlen; i++) out[offset++] = (char)cluster_buffer[i];
-        remaining -= chunk;
-
-        if (remaining == 0) break;
-        file_cluster = fat32_read_fat_entry(file_cluster);
-        if (is_fat32_eoc(file_cluster)) break;
-    }
-
-    if (bytes_read_out) *bytes_read_out = (uint32_t)offset;
+    if (bytes_read_out) *bytes_read_out = offset;
     return 1;
 }
 
@@ -2894,12 +4060,18 @@ int disk_touch_file(const char *path) {
     return disk_write_file(path, "", 0);
 }
 
+// Runs as one exclusive section: a background copy must not interleave with the FAT updates
+// of whatever its shell runs next.
 int disk_copy_file(const char *src_path, const char *dst_path) {
     char buffer[8192];
     uint32_t size = 0;
+    int ok = 0;
 
-    if (!disk_read_file(src_path, buffer, sizeof(buffer), &size)) return 0;
-    return disk_write_file(dst_path, buffer, size);
+    if (!disk_require_not_busy_quiet()) return 0;
+    disk_exclusive_begin();
+    if (disk_read_file(src_path, buffer, sizeof(buffer), &size)) ok = disk_write_file(dst_path, buffer, size);
+    disk_exclusive_end();
+    return ok;
 }
 
 void cmd_disk_cat(const char *path) {
@@ -3015,6 +4187,108 @@ void cmd_disk_rm(const char *path) {
     }
 }
 
+void cmd_disk_defrag(const char *path) {
+    fat32_lookup_result_t entry;
+    char resolved_path[128];
+    uint32_t first_cluster;
+    uint32_t new_first = 0;
+    uint32_t cluster;
+    uint32_t clusters = 0;
+    uint32_t fragments = 0;
+    uint32_t dst_lba;
+    uint8_t *buffer = NULL;
+
+    g_disk_io_error = 0;
+    if (!disk_require_not_busy("disk defrag")) return;
+    disk_exclusive_begin();
+    if (!disk_require_active_device("disk defrag")) goto out;
+    if (!disk_current_is_writable()) {
+        puts("disk defrag: device is read-only\n");
+        goto out;
+    }
+    if (!fat32_mount()) {
+        puts("Disk not formatted as FAT32.\n");
+        goto out;
+    }
+
+    if (!fat32_normalize_path(path, resolved_path) || strcmp(resolved_path, "/") == 0
+        || !fat32_resolve_path(resolved_path, NULL, &entry)) {
+        puts("disk defrag: file not found\n");
+        goto out;
+    }
+    if (entry.entry.attr & FAT32_ATTR_DIRECTORY) {
+        puts("disk defrag: target is a directory\n");
+        goto out;
+    }
+
+    first_cluster = fat32_dir_first_cluster(&entry.entry);
+    cluster = first_cluster;
+    while (cluster >= 2 && !is_fat32_eoc(cluster) && !g_disk_io_error) {
+        clusters += fat32_chain_run(&cluster, 0xFFFFFFFFU);
+        fragments++;
+    }
+    if (g_disk_io_error) {
+        puts("disk defrag: disk read error\n");
+        goto out;
+    }
+    if (fragments <= 1) {
+        puts("disk defrag: file is already contiguous\n");
+        goto out;
+    }
+
+    buffer = (uint8_t *)kmem_alloc(DISK_DEFRAG_CHUNK_SECTORS * 512U, 16);
+    if (!buffer) {
+        puts("disk defrag: out of memory\n");
+        goto out;
+    }
+    new_first = fat32_allocate_clusters(clusters, 0, 1);
+    if (!new_first) {
+        puts("disk defrag: no contiguous free space for the file\n");
+        goto out;
+    }
+
+    // Copy run by run into the new extent; the old chain stays valid until the entry moves.
+    cluster = first_cluster;
+    dst_lba = fat32_cluster_to_lba(new_first);
+    while (cluster >= 2 && !is_fat32_eoc(cluster)) {
+        uint32_t lba = fat32_cluster_to_lba(cluster);
+        uint32_t sectors = fat32_chain_run(&cluster, 0xFFFFFFFFU) * g_fat32.sectors_per_cluster;
+        while (sectors > 0) {
+            uint32_t n = sectors > DISK_DEFRAG_CHUNK_SECTORS ? DISK_DEFRAG_CHUNK_SECTORS : sectors;
+            if (!disk_read_sectors(lba, n, buffer) || !disk_write_sectors(dst_lba, n, buffer)) {
+                g_disk_io_error = 1;
+                break;
+            }
+            lba += n;
+            dst_lba += n;
+            sectors -= n;
+            task_yield();
+        }
+        if (g_disk_io_error) break;
+    }
+    if (g_disk_io_error) {
+        fat32_free_cluster_chain(new_first);
+        puts("disk defrag: disk I/O error, file left unchanged\n");
+        goto out;
+    }
+
+    fat32_set_dir_first_cluster(&entry.entry, new_first);
+    if (!fat32_write_dir_entry_at(&entry.slot, &entry.entry)) {
+        fat32_free_cluster_chain(new_first);
+        puts("disk defrag: failed to update directory entry\n");
+        goto out;
+    }
+    fat32_free_cluster_chain(first_cluster);
+
+    puts("disk defrag: merged ");
+    print_uint(fragments);
+    puts(" fragments\n");
+
+out:
+    if (buffer) kmem_free(buffer);
+    disk_exclusive_end();
+}
+
 const char *disk_get_cwd_path(void) {
     if (!disk_require_not_busy_quiet()) return "/";
     return g_fat32.current_path[0] ? g_fat32.current_path : "/";
@@ -3059,13 +4333,15 @@ void cmd_disk_install(void) {
     // BIOS/Legacy: Write kernel to sector 1+
     // UEFI: Files will be synced from RAM FS to FAT32
 
+    // 64 sectors per command, yielding in between like disk_io_breathe().
     uint8_t *kmem = (uint8_t *)kernel_start;
-    for (uint32_t i = 0; i < num_sectors; i++) {
-        if (!ata_write_sector(DISK_LEGACY_BOOT_START_LBA + i, kmem + (i * 512))) {
+    for (uint32_t i = 0; i < num_sectors; i += 64U) {
+        uint32_t n = num_sectors - i > 64U ? 64U : num_sectors - i;
+        if (!disk_write_sectors(DISK_LEGACY_BOOT_START_LBA + i, n, kmem + (i * 512))) {
             puts("Failed to write kernel data to disk\n");
             goto out;
         }
-        disk_io_breathe(i);
+        task_yield();
     }
 
     puts("Install complete! You can now boot directly from this hard disk.\n");
@@ -3078,8 +4354,6 @@ void cmd_disk_exec(const char *path) {
     fat32_lookup_result_t entry;
     uint32_t file_cluster;
     uint32_t remaining;
-    uint8_t cluster_buffer[4096];
-    uint32_t cluster_bytes;
     char resolved_path[128];
 
     g_disk_io_error = 0;
@@ -3107,35 +4381,25 @@ void cmd_disk_exec(const char *path) {
 
     file_cluster = fat32_dir_first_cluster(&entry.entry);
     remaining = entry.entry.file_size;
-    cluster_bytes = (uint32_t)g_fat32.sectors_per_cluster * 512U;
     
     if (remaining == 0) {
         puts("exec: file is empty\n");
         return;
     }
-    if (remaining > (uint32_t)MLJOS_APP_REGION_SIZE) {
+    if (remaining > (uint32_t)MLJOS_APP_MAX_SIZE) {
         puts("exec: app image too large\n");
         return;
     }
+    if (!task_reset_app_space()) {
+        puts("exec: no task address space\n");
+        return;
+    }
 
     char *app_start = (char *)(uintptr_t)MLJOS_APP_VADDR;
-    kmem_memset(app_start, 0, (uint64_t)MLJOS_APP_REGION_SIZE);
-    uint32_t offset = 0;
-
-    while (remaining > 0 && file_cluster >= 2) {
-        fat32_read_cluster(file_cluster, cluster_buffer);
-        if (g_disk_io_error) {
-            puts("exec: disk read error\n");
-            return;
-        }
-        uint32_t chunk = remaining > cluster_bytes ? cluster_bytes : remaining;
-        for (uint32_t i = 0; i < chunk && offset < (uint32_t)MLJOS_APP_REGION_SIZE; i++) {
-            app_start[offset++] = (char)cluster_buffer[i];
-        }
-        remaining -= chunk;
-        if (remaining == 0) break;
-        file_cluster = fat32_read_fat_entry(file_cluster);
-        if (is_fat32_eoc(file_cluster)) break;
+    uint32_t offset = fat32_read_chain(file_cluster, remaining, (uint8_t *)app_start, (uint32_t)MLJOS_APP_MAX_SIZE);
+    if (g_disk_io_error) {
+        puts("exec: disk read error\n");
+        return;
     }
 
     if (disk_is_elf_image(app_start, offset)) {
@@ -3150,6 +4414,21 @@ void cmd_disk_exec(const char *path) {
     app(api);
 }
 
+int disk_file_size(const char *path, uint32_t *size_out) {
+    fat32_lookup_result_t entry;
+    char resolved_path[128];
+
+    g_disk_io_error = 0;
+    if (!size_out) return 0;
+    if (!disk_require_not_busy_quiet()) return 0;
+    if (!fat32_mount()) return 0;
+    if (!fat32_normalize_path(path, resolved_path) || strcmp(resolved_path, "/") == 0) return 0;
+    if (!fat32_resolve_path(resolved_path, NULL, &entry)) return 0;
+    if (entry.entry.attr & FAT32_ATTR_DIRECTORY) return 0;
+    *size_out = entry.entry.file_size;
+    return 1;
+}
+
 int disk_can_exec_path(const char *path) {
     fat32_lookup_result_t entry;
     char resolved_path[128];
@@ -0,0 +1,186 @@
+#include "fpu.h"
+
+#include "cpu.h"
+#include "kmem.h"
+#include "smp.h"
+#include "task.h"
+
+#define CR0_MP (1ULL << 1)
+#define CR0_EM (1ULL << 2)
+#define CR0_TS (1ULL << 3)
+#define CR0_NE (1ULL << 5)
+#define CR4_OSFXSR     (1ULL << 9)
+#define CR4_OSXMMEXCPT (1ULL << 10)
+#define CR4_OSXSAVE    (1ULL << 18)
+#define XCR0_X87 (1ULL << 0)
+#define XCR0_SSE (1ULL << 1)
+#define XCR0_AVX (1ULL << 2)
+#define MXCSR_DEFAULT 0x1F80U
+#define FPU_NM_VECTOR 7
+// task_t.fpu_cpu when no CPU holds the task's registers.
+#define FPU_NO_CPU 0xFFFFFFFFU
+
+static int g_fpu_xsave = 0;
+static uint64_t g_fpu_xcr0 = 0;
+static uint32_t g_fpu_size = 512;
+// Register state right after FNINIT with the default MXCSR; loaded by a task's first #NM.
+static uint8_t g_fpu_init_area[FPU_AREA_MAX] __attribute__((aligned(64)));
+
+static inline uint64_t read_cr0(void) {
+    uint64_t v;
+    __asm__ volatile ("mov %%cr0, %0" : "=r"(v));
+    return v;
+}
+
+static inline void write_cr0(uint64_t v) {
+    __asm__ volatile ("mov %0, %%cr0" : : "r"(v) : "memory");
+}
+
+static inline uint64_t read_cr4(void) {
+    uint64_t v;
+    __asm__ volatile ("mov %%cr4, %0" : "=r"(v));
+    return v;
+}
+
+static inline void write_cr4(uint64_t v) {
+    __asm__ volatile ("mov %0, %%cr4" : : "r"(v) : "memory");
+}
+
+static void fpu_save(void *area) {
+    if (g_fpu_xsave) {
+        __asm__ volatile ("xsave64 (%0)" : : "r"(area), "a"((uint32_t)g_fpu_xcr0),
+                          "d"((uint32_t)(g_fpu_xcr0 >> 32)) : "memory");
+    } else {
+        __asm__ volatile ("fxsave64 (%0)" : : "r"(area) : "memory");
+    }
+}
+
+static void fpu_restore(const void *area) {
+    if (g_fpu_xsave) {
+        __asm__ volatile ("xrstor64 (%0)" : : "r"(area), "a"((uint32_t)g_fpu_xcr0),
+                          "d"((uint32_t)(g_fpu_xcr0 >> 32)) : "memory");
+    } else {
+        __asm__ volatile ("fxrstor64 (%0)" : : "r"(area) : "memory");
+    }
+}
+
+// CR0 writes serialise, so the per-CPU copy of TS avoids redundant ones.
+static void fpu_set_ts(cpu_local_t *cpu) {
+    if (cpu->fpu_ts) return;
+    write_cr0(read_cr0() | CR0_TS);
+    cpu->fpu_ts = 1;
+}
+
+static void fpu_clear_ts(cpu_local_t *cpu) {
+    __asm__ volatile ("clts" ::: "memory");
+    cpu->fpu_ts = 0;
+}
+
+// #NM: the running task touched vector registers for the first time in this run.
+static void fpu_trap(interrupt_frame_t *frame) {
+    (void)frame;
+    cpu_local_t *cpu = smp_this_cpu();
+    task_t *t = cpu->current;
+    fpu_clear_ts(cpu);
+    if (!t) {
+        // Scheduler loop outside kernel_fpu_begin(): the last owner was saved when it
+        // switched out, so the registers only have to be marked as no longer its.
+        cpu->fpu_owner = NULL;
+        return;
+    }
+    // Unless this CPU still holds exactly the task's registers from an earlier run.
+    if (cpu->fpu_owner != t || t->fpu_cpu != cpu->index) {
+        fpu_restore(t->fpu_valid ? t->fpu_area : g_fpu_init_area);
+        cpu->fpu_owner = t;
+        t->fpu_cpu = cpu->index;
+    }
+}
+
+static void fpu_enable_cpu(void) {
+    write_cr0((read_cr0() | CR0_MP | CR0_NE) & ~(CR0_EM | CR0_TS));
+    uint64_t cr4 = read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT;
+    if (g_fpu_xsave) cr4 |= CR4_OSXSAVE;
+    write_cr4(cr4);
+    if (g_fpu_xsave) {
+        __asm__ volatile ("xsetbv" : : "c"(0), "a"((uint32_t)g_fpu_xcr0), "d"((uint32_t)(g_fpu_xcr0 >> 32)));
+    }
+}
+
+void fpu_init(void) {
+    uint32_t a, b, c, d;
+    __asm__ volatile ("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(1), "c"(0));
+    if (c & (1U << 26)) {
+        g_fpu_xsave = 1;
+        g_fpu_xcr0 = XCR0_X87 | XCR0_SSE;
+        if (c & (1U << 28)) g_fpu_xcr0 |= XCR0_AVX;
+    }
+    fpu_enable_cpu();
+    if (g_fpu_xsave) {
+        // EBX: save area size for the features enabled in XCR0.
+        __asm__ volatile ("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(0xD), "c"(0));
+        g_fpu_size = b;
+        if (g_fpu_size > FPU_AREA_MAX) {
+            g_fpu_xsave = 0;
+            g_fpu_size = 512;
+            write_cr4(read_cr4() & ~CR4_OSXSAVE);
+        }
+    }
+
+    uint32_t mxcsr = MXCSR_DEFAULT;
+    __asm__ volatile ("fninit; ldmxcsr %0" : : "m"(mxcsr));
+    kmem_memset(g_fpu_init_area, 0, sizeof(g_fpu_init_area));
+    fpu_save(g_fpu_init_area);
+
+    cpu_set_isr_handler(FPU_NM_VECTOR, fpu_trap);
+}
+
+void fpu_init_ap(void) {
+    fpu_enable_cpu();
+}
+
+int fpu_task_init(task_t *t) {
+    if (!t->fpu_area) {
+        t->fpu_area = kmem_alloc(FPU_AREA_MAX, 64);
+        if (!t->fpu_area) return 0;
+        kmem_memset(t->fpu_area, 0, FPU_AREA_MAX);
+    }
+    t->fpu_valid = 0;
+    t->fpu_cpu = FPU_NO_CPU;
+    return 1;
+}
+
+void fpu_switch_in(cpu_local_t *cpu, task_t *t) {
+    (void)t;
+    fpu_set_ts(cpu);
+}
+
+void fpu_switch_out(cpu_local_t *cpu, task_t *t) {
+    // TS is clear only if the task used vector registers during this run.
+    if (!cpu->fpu_ts && cpu->fpu_owner == t) {
+        if (t->state == TASK_DEAD) {
+            cpu->fpu_owner = NULL;
+        } else {
+            fpu_save(t->fpu_area);
+            t->fpu_valid = 1;
+        }
+    }
+    fpu_set_ts(cpu);
+}
+
+void kernel_fpu_begin(void) {
+    cpu_local_t *cpu = smp_this_cpu();
+    task_t *owner = cpu->fpu_owner;
+    // Kernel code running inside a task may sit on top of that task's live registers.
+    if (!cpu->fpu_ts && owner && owner == cpu->current) {
+        fpu_save(owner->fpu_area);
+        owner->fpu_valid = 1;
+    }
+    cpu->fpu_owner = NULL;
+    fpu_clear_ts(cpu);
+    fpu_restore(g_fpu_init_area);
+}
+
+void kernel_fpu_end(void) {
+    // The next vector instruction of the task (if any) traps and reloads its own state.
+    fpu_set_ts(smp_this_cpu());
+}
@@ -23,6 +23,7 @@
 #include "apps/time_app.h"
 #include "apps/date_app.h"
 #include "apps/terminal_app.h"
+#include "apps/taskmgr_app.h"
 #include "apps/files_app.h"
 #include "apps/paint_app.h"
 #include "boot/limine_bootx64_efi.h"
@@ -536,6 +537,9 @@ void fs_init(void) {
     fs_node_t *terminal = fs_create_node(apps_dir ? apps_dir : fs_root, "terminal.app", FS_FILE, 0, 0, 0755);
     if (terminal) { terminal->size = terminal_app_size; terminal->content = (char*)terminal_app_data; }
 
+    fs_node_t *taskmgr = fs_create_node(apps_dir ? apps_dir : fs_root, "taskmgr.app", FS_FILE, 0, 0, 0755);
+    if (taskmgr) { taskmgr->size = taskmgr_app_size; taskmgr->content = (char*)taskmgr_app_data; }
+
     fs_node_t *files_node = fs_create_node(apps_dir ? apps_dir : fs_root, "files.app", FS_FILE, 0, 0, 0755);
     if (files_node) { files_node->size = files_app_size; files_node->content = (char*)files_app_data; }
 
@@ -1062,6 +1066,16 @@ int fs_resolve_app_command(const char *name, char *out, int out_size) {
     return 1;
 }
 
+int fs_file_size(const char *path, uint32_t *size_out) {
+    fs_node_t *file = fs_resolve_node(fs_current_dir(), path);
+
+    if (!file || !size_out) return 0;
+    if (file->flags != FS_FILE) return 0;
+    if (!fs_has_perm(file, FS_PERM_READ)) return 0;
+    *size_out = file->size;
+    return 1;
+}
+
 int fs_can_exec_path(const char *path) {
     fs_node_t *file = fs_resolve_node(fs_current_dir(), path);
 
@@ -1127,11 +1141,14 @@ void cmd_ram_exec(const char *path) {
 
     {
         char *app_start = (char *)(uintptr_t)MLJOS_APP_VADDR;
-        if (file->size > (uint32_t)MLJOS_APP_REGION_SIZE) {
+        if (file->size > (uint32_t)MLJOS_APP_MAX_SIZE) {
             puts("exec: app image too large\n");
             return;
         }
-        kmem_memset(app_start, 0, (uint64_t)MLJOS_APP_REGION_SIZE);
+        if (!task_reset_app_space()) {
+            puts("exec: no task address space\n");
+            return;
+        }
         for (uint32_t i = 0; i < file->size; i++) app_start[i] = file->content[i];
         mljos_api_t *api = task_current_api();
         if (!api || !api->puts) api = &os_api;
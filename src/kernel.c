@@ -5,7 +5,11 @@
 #include "wm.h"
 #include "net.h"
 #include "cpu.h"
+#include "pmm.h"
+#include "smp.h"
+#include "timer.h"
 #include "sound.h"
+#include "workq.h"
 
 struct multiboot_tag {
     uint32_t type;
@@ -23,22 +27,50 @@ struct multiboot_tag_framebuffer {
     uint8_t reserved;
 };
 
+struct multiboot_mmap_entry {
+    uint64_t addr;
+    uint64_t len;
+    uint32_t type;
+    uint32_t zero;
+};
+
+struct multiboot_tag_mmap {
+    struct multiboot_tag common;
+    uint32_t entry_size;
+    uint32_t entry_version;
+};
+
 void kernel_main(uintptr_t mbi) {
     uint32_t mbi_size = *(uint32_t *)mbi;
     struct multiboot_tag *tag = (struct multiboot_tag *)(mbi + 8);
 
+    // Per-CPU area first: the console already asks for the current task.
+    smp_init_bsp();
+    pmm_init();
     while (tag->type != 0) {
         if (tag->type == 8) { // Framebuffer tag
             struct multiboot_tag_framebuffer *fb_tag = (struct multiboot_tag_framebuffer *)tag;
             console_init((uint32_t *)fb_tag->framebuffer_addr, fb_tag->framebuffer_width, fb_tag->framebuffer_height, fb_tag->framebuffer_pitch);
-            break;
+        } else if (tag->type == 6) { // Memory map tag
+            struct multiboot_tag_mmap *mm = (struct multiboot_tag_mmap *)tag;
+            uintptr_t p = (uintptr_t)mm + sizeof(*mm);
+            uintptr_t end = (uintptr_t)mm + mm->common.size;
+            while (mm->entry_size && p + sizeof(struct multiboot_mmap_entry) <= end) {
+                struct multiboot_mmap_entry *e = (struct multiboot_mmap_entry *)p;
+                pmm_add_region(e->addr, e->len, e->type == 1);
+                p += mm->entry_size;
+            }
         }
         tag = (struct multiboot_tag *)((uintptr_t)tag + ((tag->size + 7) & ~7));
     }
+    pmm_finalize(mbi, mbi_size);
 
     cpu_init();
 
     task_init();
+    workq_init();
+    timer_init();
+    cpu_sti();
     wm_init();
     net_init();
     console_set_visible(NULL, 0);
@@ -47,9 +79,11 @@ void kernel_main(uintptr_t mbi) {
     sound_beep(440, 250);
 
     shell_boot();
+    smp_start_aps();
 
-    // Main WM + cooperative scheduler loop.
+    // Main WM + scheduler loop. The APs only run tasks.
     for (;;) {
+        kernel_lock();
         wm_pump_input();
 
         char launch[32];
@@ -60,6 +94,11 @@ void kernel_main(uintptr_t mbi) {
         wm_reap_closed_windows();
         wm_compose_if_dirty();
         net_poll();
-        task_schedule_once();
+        kernel_unlock();
+        int ran = task_schedule_once();
+        task_pool_scrub();
+        // Nothing to run: sleep until the next interrupt (at most one PIT tick away, so
+        // polled input and the network are still serviced every millisecond).
+        if (!ran) smp_idle();
     }
 }
@@ -1,8 +1,70 @@
 #include "kmem.h"
 
+#include "app_layout.h"
+#include "pmm.h"
+
 extern char _kernel_end;
 
-static uintptr_t g_heap = 0;
+// General-purpose kernel heap.
+//
+// The arena is one contiguous range [g_heap_start, g_heap_limit). Blocks are laid out back to back
+// from g_heap_start up to g_heap_top; everything above g_heap_top is untouched "wilderness" that
+// the heap grows into on demand. The arena is the largest free run of physical frames below
+// MLJOS_APP_VADDR; frames are claimed from the page-frame allocator as the top moves up and
+// handed back when it drops, so other users of physical memory can take whatever the heap
+// does not need.
+//
+// Every block starts with a 16-byte boundary tag (own size + size of the physically previous
+// block), so freeing can merge neighbours in O(1). Small requests (<= 2 KiB, 16-byte aligned) are
+// rounded to a size class and recycled through short per-class LIFO lists without coalescing;
+// larger or over-aligned requests (and small blocks once their class list is full) use binned
+// free lists of coalesced blocks.
+
+#define KMEM_HDR_SIZE     16ULL
+#define KMEM_MIN_BLOCK    32ULL
+#define KMEM_FLAG_USED    1ULL
+#define KMEM_FLAG_CACHED  2ULL   // parked on a small size-class list (still USED for the coalescer)
+#define KMEM_FLAGS_MASK   15ULL
+#define KMEM_SMALL_MAX    2048ULL
+#define KMEM_SMALL_CACHE  32     // blocks kept per size class before falling back to coalescing
+#define KMEM_BIN_COUNT    64
+#define KMEM_COMMIT_SLACK (64 * 1024ULL)   // committed frames kept above the top before trimming
+
+typedef struct kmem_block {
+    uint64_t size;       // total block bytes including this header, low bits = KMEM_FLAG_*
+    uint64_t prev_size;  // total bytes of the physically preceding block (0 for the first block)
+} kmem_block_t;
+
+// Lives in the payload of free blocks.
+typedef struct kmem_free_node {
+    struct kmem_free_node *next;
+    struct kmem_free_node *prev;
+} kmem_free_node_t;
+
+static const uint32_t k_small_sizes[] = {
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256, 320, 384, 448, 512,
+    640, 768, 896, 1024, 1280, 1536, 1792, 2048,
+};
+#define KMEM_SMALL_CLASSES ((int)(sizeof(k_small_sizes) / sizeof(k_small_sizes[0])))
+
+static uintptr_t g_heap_start = 0;
+static uintptr_t g_heap_top = 0;
+static uintptr_t g_heap_limit = 0;
+static uint64_t g_top_prev_size = 0;   // size of the block ending at g_heap_top
+static uintptr_t g_heap_committed = 0;  // frames in [g_heap_start, g_heap_committed) belong to the heap
+static int g_heap_pmm = 0;              // 0 = no memory map, the arena is a guessed range
+
+static kmem_free_node_t *g_small_free[KMEM_SMALL_CLASSES];
+static uint32_t g_small_count[KMEM_SMALL_CLASSES];
+static kmem_free_node_t *g_bins[KMEM_BIN_COUNT];
+
+static uint64_t g_live_bytes = 0;
+static uint64_t g_live_blocks = 0;
+static uint64_t g_cached_bytes = 0;
+static uint64_t g_cached_blocks = 0;
+static uint64_t g_alloc_count = 0;
+static uint64_t g_free_count = 0;
 
 static uintptr_t align_up(uintptr_t v, uint64_t align) {
     if (align == 0) return v;
@@ -10,18 +72,388 @@ static uintptr_t align_up(uintptr_t v, uint64_t align) {
     return (v + mask) & ~mask;
 }
 
+static inline uint64_t blk_size(const kmem_block_t *b) { return b->size & ~KMEM_FLAGS_MASK; }
+static inline int blk_used(const kmem_block_t *b) { return (b->size & KMEM_FLAG_USED) != 0; }
+static inline void *blk_payload(kmem_block_t *b) { return (void *)((uintptr_t)b + KMEM_HDR_SIZE); }
+static inline kmem_block_t *blk_from_payload(void *p) { return (kmem_block_t *)((uintptr_t)p - KMEM_HDR_SIZE); }
+
+static inline kmem_block_t *blk_next(kmem_block_t *b) {
+    uintptr_t n = (uintptr_t)b + blk_size(b);
+    return n < g_heap_top ? (kmem_block_t *)n : NULL;
+}
+
+static inline kmem_block_t *blk_prev(kmem_block_t *b) {
+    if (!b->prev_size) return NULL;
+    return (kmem_block_t *)((uintptr_t)b - b->prev_size);
+}
+
+// Keeps the successor's boundary tag (or the top marker) in sync after `b` changed size.
+static void blk_fix_next_prev(kmem_block_t *b) {
+    kmem_block_t *n = blk_next(b);
+    if (n) n->prev_size = blk_size(b);
+    else g_top_prev_size = blk_size(b);
+}
+
+static int small_class_for(uint64_t size) {
+    for (int i = 0; i < KMEM_SMALL_CLASSES; ++i) {
+        if (size <= k_small_sizes[i]) return i;
+    }
+    return -1;
+}
+
+static int small_class_exact(uint64_t payload) {
+    for (int i = 0; i < KMEM_SMALL_CLASSES; ++i) {
+        if (payload == k_small_sizes[i]) return i;
+        if (payload < k_small_sizes[i]) break;
+    }
+    return -1;
+}
+
+static int bin_index(uint64_t block_size) {
+    int i = 0;
+    while (block_size > 1 && i < KMEM_BIN_COUNT - 1) {
+        block_size >>= 1;
+        i++;
+    }
+    return i;
+}
+
+static void bin_insert(kmem_block_t *b) {
+    kmem_free_node_t *n = (kmem_free_node_t *)blk_payload(b);
+    int i = bin_index(blk_size(b));
+    n->prev = NULL;
+    n->next = g_bins[i];
+    if (g_bins[i]) g_bins[i]->prev = n;
+    g_bins[i] = n;
+}
+
+static void bin_remove(kmem_block_t *b) {
+    kmem_free_node_t *n = (kmem_free_node_t *)blk_payload(b);
+    int i = bin_index(blk_size(b));
+    if (n->prev) n->prev->next = n->next;
+    else g_bins[i] = n->next;
+    if (n->next) n->next->prev = n->prev;
+}
+
+// Makes sure the frames backing [g_heap_start, end) are claimed from the page-frame allocator.
+static int heap_commit(uintptr_t end) {
+    if (end > g_heap_limit) return 0;
+    if (end <= g_heap_committed) return 1;
+    if (!g_heap_pmm) {
+        g_heap_committed = end;
+        return 1;
+    }
+    uintptr_t page = align_up(end, PMM_FRAME_SIZE);
+    if (page > g_heap_limit) page = g_heap_limit;
+    if (!pmm_claim(g_heap_committed, page - g_heap_committed)) return 0;
+    g_heap_committed = page;
+    return 1;
+}
+
+static void heap_trim(void) {
+    if (!g_heap_pmm) return;
+    uintptr_t page = align_up(g_heap_top, PMM_FRAME_SIZE);
+    if (g_heap_committed <= page + KMEM_COMMIT_SLACK) return;
+    pmm_free_frames(page, (g_heap_committed - page) / PMM_FRAME_SIZE);
+    g_heap_committed = page;
+}
+
+// Returns a free block to the large free lists, merging it with free neighbours and handing it
+// back to the wilderness if it ends at the top of the heap.
+static void blk_release(kmem_block_t *b) {
+    b->size = blk_size(b);
+
+    kmem_block_t *n = blk_next(b);
+    if (n && !blk_used(n)) {
+        bin_remove(n);
+        b->size += blk_size(n);
+    }
+    kmem_block_t *p = blk_prev(b);
+    if (p && !blk_used(p)) {
+        bin_remove(p);
+        p->size += blk_size(b);
+        b = p;
+    }
+
+    if ((uintptr_t)b + blk_size(b) >= g_heap_top) {
+        g_heap_top = (uintptr_t)b;
+        g_top_prev_size = b->prev_size;
+        heap_trim();
+        return;
+    }
+    blk_fix_next_prev(b);
+    bin_insert(b);
+}
+
+// Computes where a block with `need` total bytes and a payload aligned to `align` fits inside the
+// span [base, base + span). Leading gaps smaller than a minimal block are skipped.
+static int place_in_span(uintptr_t base, uint64_t span, uint64_t need, uint64_t align, uintptr_t *out_block) {
+    uintptr_t payload = align_up(base + KMEM_HDR_SIZE, align);
+    while (payload - KMEM_HDR_SIZE != base && payload - KMEM_HDR_SIZE - base < KMEM_MIN_BLOCK) {
+        payload += align;
+    }
+    uintptr_t blk = payload - KMEM_HDR_SIZE;
+    if (blk + need > base + span || blk + need < blk) return 0;
+    *out_block = blk;
+    return 1;
+}
+
+static kmem_block_t *alloc_from_bins(uint64_t need, uint64_t align) {
+    for (int i = bin_index(need); i < KMEM_BIN_COUNT; ++i) {
+        for (kmem_free_node_t *n = g_bins[i]; n; n = n->next) {
+            kmem_block_t *b = blk_from_payload(n);
+            uint64_t bsize = blk_size(b);
+            uintptr_t base = (uintptr_t)b;
+            uintptr_t at;
+            if (bsize < need) continue;
+            if (!place_in_span(base, bsize, need, align, &at)) continue;
+
+            bin_remove(b);
+            uint64_t prev_size = b->prev_size;
+            if (at != base) {
+                // Leading gap stays free.
+                b->size = at - base;
+                bin_insert(b);
+                prev_size = at - base;
+                bsize -= at - base;
+            }
+            kmem_block_t *out = (kmem_block_t *)at;
+            out->prev_size = prev_size;
+            uint64_t tail = bsize - need;
+            if (tail >= KMEM_MIN_BLOCK) {
+                out->size = need;
+                kmem_block_t *t = (kmem_block_t *)(at + need);
+                t->size = tail;
+                t->prev_size = need;
+                blk_fix_next_prev(t);
+                bin_insert(t);
+            } else {
+                out->size = bsize;
+                blk_fix_next_prev(out);
+            }
+            return out;
+        }
+    }
+    return NULL;
+}
+
+static kmem_block_t *alloc_from_top(uint64_t need, uint64_t align) {
+    uintptr_t base = g_heap_top;
+    uintptr_t at;
+    if (base >= g_heap_limit) return NULL;
+    if (!place_in_span(base, g_heap_limit - base, need, align, &at)) return NULL;
+    if (!heap_commit(at + need)) return NULL;
+
+    uint64_t prev_size = g_top_prev_size;
+    if (at != base) {
+        kmem_block_t *gap = (kmem_block_t *)base;
+        gap->size = at - base;
+        gap->prev_size = prev_size;
+        bin_insert(gap);
+        prev_size = at - base;
+    }
+    kmem_block_t *out = (kmem_block_t *)at;
+    out->size = need;
+    out->prev_size = prev_size;
+    g_heap_top = at + need;
+    g_top_prev_size = need;
+    return out;
+}
+
+// Flushes every small size-class cache back into the coalescing lists.
+static void kmem_consolidate(void) {
+    for (int i = 0; i < KMEM_SMALL_CLASSES; ++i) {
+        kmem_free_node_t *n = g_small_free[i];
+        g_small_free[i] = NULL;
+        while (n) {
+            kmem_free_node_t *next = n->next;
+            kmem_block_t *b = blk_from_payload(n);
+            g_cached_bytes -= blk_size(b);
+            g_cached_blocks--;
+            blk_release(b);
+            n = next;
+        }
+        g_small_count[i] = 0;
+    }
+}
+
+static kmem_block_t *alloc_block(uint64_t need, uint64_t align) {
+    kmem_block_t *b = alloc_from_bins(need, align);
+    if (!b) b = alloc_from_top(need, align);
+    if (!b && g_cached_blocks) {
+        kmem_consolidate();
+        b = alloc_from_bins(need, align);
+        if (!b) b = alloc_from_top(need, align);
+    }
+    return b;
+}
+
+static int ptr_to_live_block(void *ptr, kmem_block_t **out) {
+    uintptr_t p = (uintptr_t)ptr;
+    if (p < g_heap_start + KMEM_HDR_SIZE || p >= g_heap_top || (p & 15U)) return 0;
+    kmem_block_t *b = blk_from_payload(ptr);
+    if ((b->size & (KMEM_FLAG_USED | KMEM_FLAG_CACHED)) != KMEM_FLAG_USED) return 0;
+    *out = b;
+    return 1;
+}
+
 void kmem_init(void) {
-    // Start heap after kernel image. Keep a small gap for safety.
-    uintptr_t start = (uintptr_t)&_kernel_end;
-    g_heap = align_up(start + 0x10000, 16);
+    // Per-task address spaces shadow everything from MLJOS_APP_VADDR upwards.
+    uint64_t base = 0;
+    uint64_t len = pmm_largest_run(0, MLJOS_APP_VADDR, &base);
+    if (len) {
+        g_heap_pmm = 1;
+        g_heap_start = (uintptr_t)base;
+        g_heap_limit = (uintptr_t)(base + len);
+    } else {
+        // No memory map: start after the kernel image with a small gap for the boot info.
+        g_heap_pmm = 0;
+        g_heap_start = align_up((uintptr_t)&_kernel_end + 0x10000, 16);
+        g_heap_limit = (uintptr_t)MLJOS_APP_VADDR;
+    }
+    g_heap_top = g_heap_start;
+    g_heap_committed = g_heap_start;
+    g_top_prev_size = 0;
+    kmem_memset(g_small_free, 0, sizeof(g_small_free));
+    kmem_memset(g_small_count, 0, sizeof(g_small_count));
+    kmem_memset(g_bins, 0, sizeof(g_bins));
+    g_live_bytes = 0;
+    g_live_blocks = 0;
+    g_cached_bytes = 0;
+    g_cached_blocks = 0;
+    g_alloc_count = 0;
+    g_free_count = 0;
 }
 
 void *kmem_alloc(uint64_t size, uint64_t align) {
     if (size == 0) size = 1;
     if (align < 16) align = 16;
-    uintptr_t p = align_up(g_heap, align);
-    g_heap = p + (uintptr_t)size;
-    return (void *)p;
+    if (align & (align - 1)) return NULL;
+    if (size > g_heap_limit - g_heap_start) return NULL;
+
+    kmem_block_t *b = NULL;
+    int cls = (align == 16) ? small_class_for(size) : -1;
+    if (cls >= 0) {
+        size = k_small_sizes[cls];
+        if (g_small_free[cls]) {
+            kmem_free_node_t *n = g_small_free[cls];
+            g_small_free[cls] = n->next;
+            g_small_count[cls]--;
+            b = blk_from_payload(n);
+            g_cached_bytes -= blk_size(b);
+            g_cached_blocks--;
+        }
+    }
+
+    if (!b) {
+        uint64_t need = align_up(size, 16) + KMEM_HDR_SIZE;
+        if (need < KMEM_MIN_BLOCK) need = KMEM_MIN_BLOCK;
+        b = alloc_block(need, align);
+        if (!b) return NULL;
+    }
+
+    b->size = blk_size(b) | KMEM_FLAG_USED;
+    g_live_bytes += blk_size(b);
+    g_live_blocks++;
+    g_alloc_count++;
+    return blk_payload(b);
+}
+
+void kmem_free(void *ptr) {
+    kmem_block_t *b;
+    if (!ptr) return;
+    // Pointers outside the heap (static data, bootloader memory) and double frees are ignored.
+    if (!ptr_to_live_block(ptr, &b)) return;
+
+    g_live_bytes -= blk_size(b);
+    g_live_blocks--;
+    g_free_count++;
+
+    int cls = small_class_exact(blk_size(b) - KMEM_HDR_SIZE);
+    if (cls >= 0 && g_small_count[cls] < KMEM_SMALL_CACHE) {
+        kmem_free_node_t *n = (kmem_free_node_t *)ptr;
+        b->size |= KMEM_FLAG_CACHED;
+        n->next = g_small_free[cls];
+        n->prev = NULL;
+        g_small_free[cls] = n;
+        g_small_count[cls]++;
+        g_cached_bytes += blk_size(b);
+        g_cached_blocks++;
+        return;
+    }
+    blk_release(b);
+}
+
+void *kmem_realloc(void *ptr, uint64_t size) {
+    kmem_block_t *b;
+    if (!ptr) return kmem_alloc(size, 16);
+    if (size == 0) {
+        kmem_free(ptr);
+        return NULL;
+    }
+    if (!ptr_to_live_block(ptr, &b)) return NULL;
+
+    uint64_t have = blk_size(b) - KMEM_HDR_SIZE;
+    if (size <= have) return ptr;
+
+    // Try to grow in place into a free successor or the wilderness.
+    uint64_t need = align_up(size, 16) + KMEM_HDR_SIZE;
+    kmem_block_t *n = blk_next(b);
+    if (n && !blk_used(n) && blk_size(b) + blk_size(n) >= need) {
+        uint64_t total = blk_size(b) + blk_size(n);
+        bin_remove(n);
+        g_live_bytes -= blk_size(b);
+        if (total - need >= KMEM_MIN_BLOCK) {
+            b->size = need | KMEM_FLAG_USED;
+            kmem_block_t *t = (kmem_block_t *)((uintptr_t)b + need);
+            t->size = total - need;
+            t->prev_size = need;
+            blk_fix_next_prev(t);
+            bin_insert(t);
+        } else {
+            b->size = total | KMEM_FLAG_USED;
+            blk_fix_next_prev(b);
+        }
+        g_live_bytes += blk_size(b);
+        return ptr;
+    }
+    if (!n && heap_commit((uintptr_t)b + need)) {
+        g_live_bytes += need - blk_size(b);
+        b->size = need | KMEM_FLAG_USED;
+        g_heap_top = (uintptr_t)b + need;
+        g_top_prev_size = need;
+        return ptr;
+    }
+
+    void *np = kmem_alloc(size, 16);
+    if (!np) return NULL;
+    kmem_memcpy(np, ptr, have);
+    kmem_free(ptr);
+    return np;
+}
+
+void kmem_get_stats(kmem_stats_t *out) {
+    if (!out) return;
+    kmem_memset(out, 0, sizeof(*out));
+    out->heap_bytes = g_heap_top - g_heap_start;
+    out->reserve_bytes = g_heap_committed - g_heap_top;
+    if (g_heap_pmm) out->reserve_bytes += pmm_free_run(g_heap_committed, g_heap_limit);
+    else out->reserve_bytes += g_heap_limit - g_heap_committed;
+    out->live_bytes = g_live_bytes;
+    out->live_blocks = g_live_blocks;
+    out->free_bytes = g_cached_bytes;
+    out->free_blocks = g_cached_blocks;
+    out->cached_bytes = g_cached_bytes;
+    out->alloc_count = g_alloc_count;
+    out->free_count = g_free_count;
+    for (int i = 0; i < KMEM_BIN_COUNT; ++i) {
+        for (kmem_free_node_t *n = g_bins[i]; n; n = n->next) {
+            uint64_t s = blk_size(blk_from_payload(n));
+            out->free_bytes += s;
+            out->free_blocks++;
+            if (s > out->largest_free) out->largest_free = s;
+        }
+    }
 }
 
 void kmem_memset(void *dst, uint8_t value, uint64_t size) {
@@ -34,4 +466,3 @@ void kmem_memcpy(void *dst, const void *src, uint64_t size) {
     const uint8_t *s = (const uint8_t *)src;
     for (uint64_t i = 0; i < size; ++i) d[i] = s[i];
 }
-
@@ -1,5 +1,7 @@
 #include "launcher.h"
 
+#include "app_layout.h"
+#include "chan.h"
 #include "console.h"
 #include "disk.h"
 #include "fs.h"
@@ -7,6 +9,7 @@
 #include "kstring.h"
 #include "rtc.h"
 #include "shell.h"
+#include "taskmgr_app.h"
 #include "terminal_app.h"
 #include "task.h"
 #include "ui.h"
@@ -29,41 +32,55 @@ static void fill_minimal_gui_api(mljos_api_t *api) {
     api->get_date = api_get_date;
 }
 
-static int load_app_image(const char *app_path, void **out_image, uint32_t *out_size) {
-    if (!app_path || !out_image || !out_size) return 0;
-
-    // 2MiB max per app (mapped as a single 2MiB page at MLJOS_APP_VADDR).
-    int maxlen = 2 * 1024 * 1024;
-    char *buf = (char *)kmem_alloc((uint64_t)maxlen, 16);
+// Reads an app image from one backend: its size first, then a single buffer that fits it.
+// fs_read_file NUL-terminates, so the buffer has one byte past the image.
+static int load_app_image_from(int from_disk, const char *app_path, void **out_image, uint32_t *out_size) {
     uint32_t size = 0;
-
-    int ok = 0;
-    if (users_system_is_installed()) {
-        // Prefer disk, fallback to RAM.
-        ok = disk_read_file(app_path, buf, maxlen, &size);
-        if (!ok) ok = fs_read_file(app_path, buf, maxlen, &size);
-    } else {
-        ok = fs_read_file(app_path, buf, maxlen, &size);
-        if (!ok) ok = disk_read_file(app_path, buf, maxlen, &size);
+    uint32_t got = 0;
+    int ok = from_disk ? disk_file_size(app_path, &size) : fs_file_size(app_path, &size);
+    if (!ok || size == 0 || size > MLJOS_APP_MAX_SIZE) return 0;
+
+    char *buf = (char *)kmem_alloc((uint64_t)size + 1, 16);
+    if (!buf) return 0;
+    if (from_disk) ok = disk_read_file(app_path, buf, (int)size + 1, &got);
+    else ok = fs_read_file(app_path, buf, (int)size + 1, &got);
+    if (!ok || got == 0) {
+        kmem_free(buf);
+        return 0;
     }
-
-    if (!ok || size == 0) return 0;
     *out_image = buf;
-    *out_size = size;
+    *out_size = got;
     return 1;
 }
 
+static int load_app_image(const char *app_path, void **out_image, uint32_t *out_size) {
+    if (!app_path || !out_image || !out_size) return 0;
+
+    // Prefer disk once the system is installed, fall back to RAM (and the other way round).
+    int disk_first = users_system_is_installed();
+    if (load_app_image_from(disk_first, app_path, out_image, out_size)) return 1;
+    return load_app_image_from(!disk_first, app_path, out_image, out_size);
+}
+
 int launcher_launch_gui(const char *name) {
     return launcher_launch_gui_args(name, NULL);
 }
 
 int launcher_launch_gui_args(const char *name, const char *open_path) {
+    return launcher_launch_gui_chan(name, open_path, 0);
+}
+
+int launcher_launch_gui_chan(const char *name, const char *open_path, int chan) {
     if (!name || !name[0]) return 0;
 
     if (strcmp(name, "terminal") == 0) {
         (void)open_path;
         return terminal_spawn();
     }
+    if (strcmp(name, "taskmgr") == 0) {
+        (void)open_path;
+        return taskmgr_spawn();
+    }
 
     char app_path[128];
     if (!fs_resolve_app_command(name, app_path, sizeof(app_path))) return 0;
@@ -73,9 +90,14 @@ int launcher_launch_gui_args(const char *name, const char *open_path) {
     if (!load_app_image(app_path, &image, &image_size)) return 0;
 
     wm_window_t *w = wm_window_create(name, 520, 360);
-    if (!w) return 0;
+    if (!w) {
+        kmem_free(image);
+        return 0;
+    }
 
+    // The task copies the image into its own region.
     task_t *t = task_create_app(name, image, image_size);
+    kmem_free(image);
     if (!t) {
         wm_window_destroy(w);
         return 0;
@@ -83,17 +105,18 @@ int launcher_launch_gui_args(const char *name, const char *open_path) {
     
     if (open_path) {
         int i = 0;
-        while (open_path[i] && i < (int)sizeof(t->shell_open_path) - 1) {
-            t->shell_open_path[i] = open_path[i];
+        while (open_path[i] && i < (int)sizeof(t->shell->open_path) - 1) {
+            t->shell->open_path[i] = open_path[i];
             i++;
         }
-        t->shell_open_path[i] = '\0';
+        t->shell->open_path[i] = '\0';
     }
 
     // Initialize full system API for the app
     shell_init_task_api(t);
 
     fill_minimal_gui_api(&t->api);
+    if (chan && chan_grant(t, chan)) t->api.launch_chan = chan;
 
     if (strcmp(name, "terminal") == 0) {
         console_t *c = console_create();
@@ -0,0 +1,241 @@
+#include "pmm.h"
+
+#include "app_layout.h"
+#include "kmem.h"
+#include "spinlock.h"
+
+extern char _kernel_start;
+extern char _kernel_end;
+
+// boot.asm identity-maps the first 4GiB with 2MiB pages; frames above that are not reachable
+// by the kernel, so they are never handed out.
+#define PMM_MAX_PHYS     0x100000000ULL
+#define PMM_MAX_FRAMES   (PMM_MAX_PHYS / PMM_FRAME_SIZE)
+#define PMM_FRAMES_LARGE (PMM_LARGE_FRAME_SIZE / PMM_FRAME_SIZE)
+#define PMM_MAX_LARGE    (PMM_MAX_PHYS / PMM_LARGE_FRAME_SIZE)
+#define PMM_MAX_HOLES    64
+
+// One bit per 4KiB frame, set = used/reserved. Per-2MiB counters of free frames make 2MiB
+// allocations a scan over 2048 entries instead of the whole bitmap.
+static uint64_t g_pmm_bitmap[PMM_MAX_FRAMES / 64];
+static uint16_t g_pmm_large_free[PMM_MAX_LARGE];
+static uint64_t g_pmm_free_frames = 0;
+static uint64_t g_pmm_total_frames = 0;
+static uint64_t g_pmm_max_frame = 0;   // one past the highest usable frame
+// Taken with IRQs off: demand-page faults allocate frames on any CPU.
+static spinlock_t g_pmm_lock = SPINLOCK_INIT;
+
+// Reserved map entries may overlap usable ones and arrive in any order, so they are
+// remembered and re-applied by pmm_finalize().
+typedef struct pmm_hole {
+    uint64_t first;
+    uint64_t end;
+} pmm_hole_t;
+
+static pmm_hole_t g_pmm_holes[PMM_MAX_HOLES];
+static int g_pmm_hole_count = 0;
+
+static inline int frame_used(uint64_t f) {
+    return (g_pmm_bitmap[f >> 6] >> (f & 63)) & 1ULL;
+}
+
+static void mark_used(uint64_t first, uint64_t count) {
+    for (uint64_t f = first; f < first + count; ++f) {
+        if (frame_used(f)) continue;
+        g_pmm_bitmap[f >> 6] |= 1ULL << (f & 63);
+        g_pmm_large_free[f / PMM_FRAMES_LARGE]--;
+        g_pmm_free_frames--;
+    }
+}
+
+static void mark_free(uint64_t first, uint64_t count) {
+    for (uint64_t f = first; f < first + count; ++f) {
+        if (!frame_used(f)) continue;
+        g_pmm_bitmap[f >> 6] &= ~(1ULL << (f & 63));
+        g_pmm_large_free[f / PMM_FRAMES_LARGE]++;
+        g_pmm_free_frames++;
+    }
+}
+
+// Converts [base, base + length) to a frame range, rounding inwards (usable) or outwards.
+static int to_frames(uint64_t base, uint64_t length, int inwards, uint64_t *first, uint64_t *end) {
+    if (length == 0 || base >= PMM_MAX_PHYS) return 0;
+    uint64_t top = base + length;
+    if (top < base || top > PMM_MAX_PHYS) top = PMM_MAX_PHYS;
+    if (inwards) {
+        *first = (base + PMM_FRAME_SIZE - 1) / PMM_FRAME_SIZE;
+        *end = top / PMM_FRAME_SIZE;
+    } else {
+        *first = base / PMM_FRAME_SIZE;
+        *end = (top + PMM_FRAME_SIZE - 1) / PMM_FRAME_SIZE;
+    }
+    return *end > *first;
+}
+
+static void reserve_range(uint64_t base, uint64_t length) {
+    uint64_t first;
+    uint64_t end;
+    if (to_frames(base, length, 0, &first, &end)) mark_used(first, end - first);
+}
+
+void pmm_init(void) {
+    kmem_memset(g_pmm_bitmap, 0xFF, sizeof(g_pmm_bitmap));
+    kmem_memset(g_pmm_large_free, 0, sizeof(g_pmm_large_free));
+    g_pmm_free_frames = 0;
+    g_pmm_total_frames = 0;
+    g_pmm_max_frame = 0;
+    g_pmm_hole_count = 0;
+}
+
+void pmm_add_region(uint64_t base, uint64_t length, int usable) {
+    uint64_t first;
+    uint64_t end;
+    if (!usable) {
+        if (!to_frames(base, length, 0, &first, &end)) return;
+        if (g_pmm_hole_count < PMM_MAX_HOLES) {
+            g_pmm_holes[g_pmm_hole_count].first = first;
+            g_pmm_holes[g_pmm_hole_count].end = end;
+            g_pmm_hole_count++;
+        }
+        mark_used(first, end - first);
+        return;
+    }
+
+    if (!to_frames(base, length, 1, &first, &end)) return;
+    uint64_t before = g_pmm_free_frames;
+    mark_free(first, end - first);
+    g_pmm_total_frames += g_pmm_free_frames - before;
+    if (end > g_pmm_max_frame) g_pmm_max_frame = end;
+}
+
+void pmm_finalize(uintptr_t boot_info, uint32_t boot_info_size) {
+    for (int i = 0; i < g_pmm_hole_count; ++i) {
+        mark_used(g_pmm_holes[i].first, g_pmm_holes[i].end - g_pmm_holes[i].first);
+    }
+
+    // Real-mode IVT/BDA/EBDA and option ROMs.
+    reserve_range(0, 0x100000);
+    reserve_range((uint64_t)(uintptr_t)&_kernel_start,
+                  (uint64_t)((uintptr_t)&_kernel_end - (uintptr_t)&_kernel_start));
+    if (boot_info && boot_info_size) reserve_range((uint64_t)boot_info, boot_info_size);
+    // Task address spaces map their app image over this window, so kernel data placed there
+    // would be invisible while a task runs.
+    reserve_range(MLJOS_APP_VADDR, MLJOS_APP_MAX_SIZE);
+    reserve_range(MLJOS_SHM_VADDR, MLJOS_SHM_MAX_SIZE);
+}
+
+static uint64_t alloc_frames_locked(uint64_t count) {
+    if (count == 0 || count > g_pmm_free_frames) return 0;
+    uint64_t run = 0;
+    for (uint64_t f = g_pmm_max_frame; f-- > 0;) {
+        if ((f & 63) == 63 && g_pmm_bitmap[f >> 6] == ~0ULL) {
+            run = 0;
+            f -= 63;
+            continue;
+        }
+        if (frame_used(f)) {
+            run = 0;
+            continue;
+        }
+        if (++run == count) {
+            mark_used(f, count);
+            return f * PMM_FRAME_SIZE;
+        }
+    }
+    return 0;
+}
+
+uint64_t pmm_alloc_frames(uint64_t count) {
+    uint64_t flags = spin_lock_irqsave(&g_pmm_lock);
+    uint64_t phys = alloc_frames_locked(count);
+    spin_unlock_irqrestore(&g_pmm_lock, flags);
+    return phys;
+}
+
+uint64_t pmm_alloc_large(void) {
+    uint64_t phys = 0;
+    uint64_t flags = spin_lock_irqsave(&g_pmm_lock);
+    uint64_t chunks = (g_pmm_max_frame + PMM_FRAMES_LARGE - 1) / PMM_FRAMES_LARGE;
+    for (uint64_t c = chunks; c-- > 0;) {
+        if (g_pmm_large_free[c] != PMM_FRAMES_LARGE) continue;
+        mark_used(c * PMM_FRAMES_LARGE, PMM_FRAMES_LARGE);
+        phys = c * PMM_LARGE_FRAME_SIZE;
+        break;
+    }
+    spin_unlock_irqrestore(&g_pmm_lock, flags);
+    return phys;
+}
+
+void pmm_free_frames(uint64_t phys, uint64_t count) {
+    if (!phys || (phys & (PMM_FRAME_SIZE - 1))) return;
+    uint64_t first = phys / PMM_FRAME_SIZE;
+    uint64_t flags = spin_lock_irqsave(&g_pmm_lock);
+    if (first < g_pmm_max_frame) {
+        if (count > g_pmm_max_frame - first) count = g_pmm_max_frame - first;
+        mark_free(first, count);
+    }
+    spin_unlock_irqrestore(&g_pmm_lock, flags);
+}
+
+void pmm_free_large(uint64_t phys) {
+    if (phys & (PMM_LARGE_FRAME_SIZE - 1)) return;
+    pmm_free_frames(phys, PMM_FRAMES_LARGE);
+}
+
+int pmm_claim(uint64_t phys, uint64_t bytes) {
+    uint64_t first;
+    uint64_t end;
+    if (!to_frames(phys, bytes, 0, &first, &end)) return bytes == 0;
+    int ok = 1;
+    uint64_t flags = spin_lock_irqsave(&g_pmm_lock);
+    if (end > g_pmm_max_frame) ok = 0;
+    for (uint64_t f = first; ok && f < end; ++f) {
+        if (frame_used(f)) ok = 0;
+    }
+    if (ok) mark_used(first, end - first);
+    spin_unlock_irqrestore(&g_pmm_lock, flags);
+    return ok;
+}
+
+uint64_t pmm_free_run(uint64_t phys, uint64_t limit) {
+    uint64_t f = (phys + PMM_FRAME_SIZE - 1) / PMM_FRAME_SIZE;
+    uint64_t end = limit / PMM_FRAME_SIZE;
+    if (end > g_pmm_max_frame) end = g_pmm_max_frame;
+    uint64_t start = f;
+    while (f < end && !frame_used(f)) f++;
+    return (f - start) * PMM_FRAME_SIZE;
+}
+
+uint64_t pmm_largest_run(uint64_t lo, uint64_t hi, uint64_t *out_base) {
+    uint64_t f = (lo + PMM_FRAME_SIZE - 1) / PMM_FRAME_SIZE;
+    uint64_t end = hi / PMM_FRAME_SIZE;
+    uint64_t best = 0;
+    uint64_t best_first = 0;
+    if (end > g_pmm_max_frame) end = g_pmm_max_frame;
+    while (f < end) {
+        if (frame_used(f)) {
+            f++;
+            continue;
+        }
+        uint64_t first = f;
+        while (f < end && !frame_used(f)) f++;
+        if (f - first > best) {
+            best = f - first;
+            best_first = first;
+        }
+    }
+    if (out_base) *out_base = best_first * PMM_FRAME_SIZE;
+    return best * PMM_FRAME_SIZE;
+}
+
+void pmm_get_stats(pmm_stats_t *out) {
+    if (!out) return;
+    kmem_memset(out, 0, sizeof(*out));
+    out->total_bytes = g_pmm_total_frames * PMM_FRAME_SIZE;
+    out->free_bytes = g_pmm_free_frames * PMM_FRAME_SIZE;
+    out->highest_addr = g_pmm_max_frame * PMM_FRAME_SIZE;
+    uint64_t chunks = (g_pmm_max_frame + PMM_FRAMES_LARGE - 1) / PMM_FRAMES_LARGE;
+    for (uint64_t c = 0; c < chunks; ++c) {
+        if (g_pmm_large_free[c] == PMM_FRAMES_LARGE) out->free_large++;
+    }
+}
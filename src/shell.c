@@ -1,20 +1,28 @@
 #include "shell.h"
 #include "apps_registry.h"
+#include "chan.h"
 #include "clipboard.h"
 #include "console.h"
+#include "cpu.h"
 #include "disk.h"
 #include "fs.h"
 #include "launcher.h"
 #include "io.h"
+#include "kmem.h"
 #include "kstring.h"
 #include "rtc.h"
 #include "task.h"
 #include "ui.h"
 #include "usb.h"
 #include "net.h"
+#include "pmm.h"
+#include "smp.h"
+#include "timer.h"
 #include "users.h"
 #include "wm.h"
+#include "workq.h"
 #include "sdk/mljos_app.h"
+#include "shm.h"
 #include "sound.h"
 
 static int app_read_file(const char *path, char *buf, int maxlen, unsigned int *size_out);
@@ -32,6 +40,7 @@ static void os_get_time(uint8_t *h, uint8_t *m, uint8_t *s);
 static void os_get_date(uint8_t *d, uint8_t *mo, uint16_t *y);
 static int os_launch_app(const char *name_or_path);
 static int os_launch_app_args(const char *name_or_path, const char *open_path);
+static int os_launch_app_chan(const char *name_or_path, const char *open_path, int ch);
 static int os_clipboard_set(const char *text);
 static int os_clipboard_get(char *out, int maxlen);
 static int os_clipboard_has_text(void);
@@ -60,25 +69,25 @@ static char g_kernel_open_path[128];
 static storage_target_t *active_storage_ptr(void) {
     task_t *t = task_current();
     if (!t) return &g_kernel_active_storage;
-    return (storage_target_t *)&t->shell_active_storage;
+    return (storage_target_t *)&t->shell->active_storage;
 }
 
 static shell_location_t *shell_location_ptr(void) {
     task_t *t = task_current();
     if (!t) return &g_kernel_shell_location;
-    return (shell_location_t *)&t->shell_location;
+    return (shell_location_t *)&t->shell->location;
 }
 
 static uint32_t *launch_flags_ptr(void) {
     task_t *t = task_current();
     if (!t) return &g_kernel_launch_flags;
-    return &t->shell_launch_flags;
+    return &t->shell->launch_flags;
 }
 
 static char *open_path_ptr(void) {
     task_t *t = task_current();
     if (!t) return g_kernel_open_path;
-    return t->shell_open_path;
+    return t->shell->open_path;
 }
 
 #define SHELL_OPEN_PATH_MAX 128
@@ -113,9 +122,40 @@ mljos_api_t os_api = {
     .clipboard_has_text = os_clipboard_has_text,
     .launch_flags = 0,
     .ui = NULL,
+    .now_ns = timer_now_ns,
+    .sleep_ms = task_sleep_ms,
+    .set_timer = task_set_timer,
+    .chan_create = chan_create,
+    .chan_send = chan_send,
+    .chan_recv = chan_recv,
+    .chan_wait = chan_wait,
+    .chan_close = chan_close,
+    .launch_app_chan = os_launch_app_chan,
+    .launch_chan = 0,
+    .shm_open = shm_open,
+    .shm_close = shm_close,
 };
 
 #define HISTORY_SIZE 16
+// Background jobs (`<command> &`), run by the kernel workers. A shell reports its finished
+// jobs before the next prompt.
+#define SHELL_JOBS_MAX 8
+
+typedef struct shell_job {
+    int used;
+    int id;
+    // The shell that started the job. task_t's are recycled, so `owner_seq` tells whether
+    // `owner` is still that shell.
+    task_t *owner;
+    uint64_t owner_seq;
+    work_t work;
+    char desc[64];
+    char src[128];
+    char dst[128];
+} shell_job_t;
+
+static shell_job_t g_shell_jobs[SHELL_JOBS_MAX];
+static int g_shell_job_next_id = 1;
 
 static void *g_kernel_shell_jmp_env[8];
 static int g_kernel_jmp_ready = 0;
@@ -124,31 +164,31 @@ static int g_shell_booted = 0;
 static void **shell_jmp_env_ptr(void) {
     task_t *t = task_current();
     if (!t) return g_kernel_shell_jmp_env;
-    return t->shell_jmp_env;
+    return t->shell->jmp_env;
 }
 
 static int *shell_jmp_ready_ptr(void) {
     task_t *t = task_current();
     if (!t) return &g_kernel_jmp_ready;
-    return &t->shell_jmp_ready;
+    return &t->shell->jmp_ready;
 }
 
 static char (*shell_history_ptr(void))[128] {
     task_t *t = task_current();
     if (!t) return NULL;
-    return t->shell_history;
+    return t->shell->history;
 }
 
 static int *shell_history_count_ptr(void) {
     task_t *t = task_current();
     if (!t) return NULL;
-    return &t->shell_history_count;
+    return &t->shell->history_count;
 }
 
 static int *shell_history_pos_ptr(void) {
     task_t *t = task_current();
     if (!t) return NULL;
-    return &t->shell_history_pos;
+    return &t->shell->history_pos;
 }
 
 void shell_boot(void) {
@@ -164,9 +204,10 @@ void shell_boot(void) {
 void shell_init_task_api(task_t *t) {
     if (!t) return;
     t->api = os_api;
-    t->api.open_path = t->shell_open_path;
+    t->api.open_path = t->shell->open_path;
     t->api.launch_flags = 0;
     t->api.ui = NULL;
+    t->api.launch_chan = 0;
 }
 
 static void os_set_cursor(int row, int col) {
@@ -198,8 +239,11 @@ static int os_read_key(void) {
                 if (ev.key == 3 && *shell_jmp_ready_ptr()) __builtin_longjmp(shell_jmp_env_ptr(), 1); // Ctrl+C
                 return ev.key;
             }
+            wm_window_wait_event(t->window, 0);
+        } else {
+            // No window means no keyboard input ever arrives; do not spin on it.
+            task_sleep_ticks(10);
         }
-        task_yield();
     }
 }
 
@@ -289,6 +333,10 @@ static int os_launch_app_args(const char *name_or_path, const char *open_path) {
     return launcher_launch_gui_args(name_or_path, open_path);
 }
 
+static int os_launch_app_chan(const char *name_or_path, const char *open_path, int ch) {
+    return launcher_launch_gui_chan(name_or_path, open_path, ch);
+}
+
 static int os_clipboard_set(const char *text) {
     return clipboard_set_text(text);
 }
@@ -301,7 +349,7 @@ static int os_clipboard_has_text(void) {
     return clipboard_has_text();
 }
 
-// Shell history is per-task; stored in task_t fields.
+// Shell history is per-task; stored in the task's task_shell_t.
 
 static void handle_command(char *line);
 static int shell_disk_primary_mode(void);
@@ -396,6 +444,9 @@ static void cmd_reboot(void) {
     COLOR = COLOR_ALERT;
     puts("Rebooting...\n");
     COLOR = old_color;
+    // A job inside a long disk operation (install, format) owns the cache until it finishes.
+    while (disk_is_busy()) task_sleep_ms(10);
+    (void)disk_sync();
     outb(0x64, 0xFE);
     for (;;) {
         __asm__ volatile ("hlt");
@@ -538,6 +589,9 @@ static void cmd_shutdown(void) {
     COLOR = COLOR_ALERT;
     puts("Shutdown...\n");
     COLOR = old_color;
+    // Waits for disk jobs like cmd_reboot().
+    while (disk_is_busy()) task_sleep_ms(10);
+    (void)disk_sync();
 
     // Try various shutdown ports
     outw(0x604, 0x2000);  // QEMU
@@ -562,6 +616,292 @@ static void cmd_ping(char **argv, int argc) {
     net_ping(ip);
 }
 
+static void print_kib(uint64_t bytes) {
+    print_uint((uint32_t)(bytes / 1024));
+    puts(" KiB");
+}
+
+static void cmd_mem(void) {
+    kmem_stats_t st;
+    pmm_stats_t ps;
+    kmem_get_stats(&st);
+    pmm_get_stats(&ps);
+
+    puts("ram:     ");
+    print_kib(ps.free_bytes);
+    puts(" free of ");
+    print_kib(ps.total_bytes);
+    puts(", ");
+    print_uint((uint32_t)ps.free_large);
+    puts(" free 2MiB frames\n");
+
+    puts("heap:    ");
+    print_kib(st.heap_bytes);
+    puts(" used, ");
+    print_kib(st.reserve_bytes);
+    puts(" reserve\n");
+
+    puts("live:    ");
+    print_kib(st.live_bytes);
+    puts(" in ");
+    print_uint((uint32_t)st.live_blocks);
+    puts(" blocks\n");
+
+    puts("free:    ");
+    print_kib(st.free_bytes);
+    puts(" in ");
+    print_uint((uint32_t)st.free_blocks);
+    puts(" blocks (");
+    print_kib(st.cached_bytes);
+    puts(" cached)\n");
+
+    // Fragmentation: share of free memory that is not part of the largest block.
+    uint32_t frag = 0;
+    if (st.free_bytes > 0) frag = (uint32_t)(100 - (st.largest_free * 100) / st.free_bytes);
+    puts("largest: ");
+    print_kib(st.largest_free);
+    puts(", fragmentation ");
+    print_uint(frag);
+    puts("%\n");
+
+    puts("calls:   ");
+    print_uint((uint32_t)st.alloc_count);
+    puts(" alloc, ");
+    print_uint((uint32_t)st.free_count);
+    puts(" free\n");
+}
+
+static void cmd_ctxbench(char **argv, int argc) {
+    int rounds = 10000;
+    if (argc > 1 && (!parse_decimal_number(argv[1], &rounds) || rounds <= 0)) {
+        puts("ctxbench: invalid round count\n");
+        return;
+    }
+
+    puts("PCID: ");
+    if (!cpu_pcid_enabled()) puts("not supported\n");
+    else if (cpu_has_invpcid()) puts("enabled (INVPCID)\n");
+    else puts("enabled\n");
+
+    uint64_t flush = task_bench_switch((uint32_t)rounds, 32, 0);
+    if (!flush) {
+        puts("ctxbench: must run inside a task\n");
+        return;
+    }
+    puts("switch, TLB flushed: ");
+    print_uint((uint32_t)flush);
+    puts(" cycles/round trip\n");
+    if (cpu_pcid_enabled()) {
+        uint64_t kept = task_bench_switch((uint32_t)rounds, 32, 1);
+        puts("switch, PCID kept:   ");
+        print_uint((uint32_t)kept);
+        puts(" cycles/round trip\n");
+    }
+}
+
+static void cmd_quantum(char **argv, int argc) {
+    if (argc > 1) {
+        int ms = 0;
+        if (!parse_decimal_number(argv[1], &ms) || ms <= 0) {
+            puts("quantum: invalid value\n");
+            return;
+        }
+        task_set_quantum_ms((uint32_t)ms);
+    }
+    puts("Scheduler quantum: ");
+    print_uint(task_get_quantum_ms());
+    puts(" ms\n");
+}
+
+static void cmd_cpus(void) {
+    puts("CPUs online: ");
+    print_uint(smp_cpu_count());
+    puts("\n");
+    uint64_t now = cpu_rdtsc();
+    for (uint32_t i = 0; i < SMP_MAX_CPUS; ++i) {
+        cpu_local_t *c = smp_cpu(i);
+        if (!c) continue;
+        uint64_t span = now - c->start_tsc;
+        uint32_t busy = span ? (uint32_t)(c->busy_tsc / (span / 100 + 1)) : 0;
+        if (busy > 100) busy = 100;
+        puts("CPU ");
+        print_uint(c->index);
+        puts(" (APIC ");
+        print_uint(c->apic_id);
+        puts("): ");
+        print_uint(busy);
+        puts("% in tasks, ");
+        print_uint(span ? (uint32_t)(c->idle_tsc / (span / 100 + 1)) : 0);
+        puts("% halted, ");
+        print_uint(span ? (uint32_t)(c->sched_tsc / (span / 100 + 1)) : 0);
+        puts("% scheduling, ");
+        print_uint((uint32_t)c->switches);
+        puts(" switches, ");
+        print_uint((uint32_t)c->steals);
+        puts(" stolen, ");
+        print_uint(c->rq_count);
+        puts(" queued");
+        if (c->current) {
+            puts(", running ");
+            puts(c->current->name);
+        }
+        puts("\n");
+    }
+}
+
+// Right-aligns `value` in a field of `width` characters.
+static void print_uint_padded(uint32_t value, int width) {
+    char buf[11];
+    int pos = 10;
+    buf[pos] = '\0';
+    do {
+        buf[--pos] = (char)('0' + (value % 10));
+        value /= 10;
+    } while (value > 0 && pos > 0);
+    for (int i = 10 - pos; i < width; ++i) putchar(' ');
+    puts(&buf[pos]);
+}
+
+static uint32_t tsc_to_ms(uint64_t cycles) {
+    uint64_t per_ms = timer_tsc_per_ms();
+    return per_ms ? (uint32_t)(cycles / per_ms) : 0;
+}
+
+static const char *task_state_name(const task_info_t *info) {
+    if (info->running) return "running";
+    switch (info->state) {
+    case TASK_RUNNABLE: return "ready";
+    case TASK_PAUSED: return "paused";
+    case TASK_BLOCKED: return "blocked";
+    case TASK_DEAD: return "dead";
+    default: return "?";
+    }
+}
+
+// One row per task. SINCE is how long a running task has gone without switching out, or how
+// long a waiting one has been off the CPU. With `load` (top), a %CPU column is added.
+static void print_task_table(const task_info_t *tasks, int count, const uint32_t *load) {
+    puts("  ID CPU STATE  ");
+    if (load) puts(" %CPU");
+    puts("  TIME ms MAXRUN ms SINCE ms   SWITCH  PREEMPT NAME\n");
+    for (int i = 0; i < count; ++i) {
+        const task_info_t *info = &tasks[i];
+        const char *state = task_state_name(info);
+        print_uint_padded(info->id, 4);
+        print_uint_padded(info->cpu, 4);
+        putchar(' ');
+        puts(state);
+        for (int pad = (int)strlen(state); pad < 7; ++pad) putchar(' ');
+        if (load) print_uint_padded(load[i], 5);
+        print_uint_padded(tsc_to_ms(info->run_tsc), 9);
+        print_uint_padded(tsc_to_ms(info->max_stretch_tsc), 10);
+        print_uint_padded(tsc_to_ms(info->stretch_tsc), 9);
+        print_uint_padded(info->switches, 9);
+        print_uint_padded(info->preemptions, 9);
+        putchar(' ');
+        puts(info->name);
+        puts("\n");
+    }
+}
+
+static void cmd_ps(void) {
+    task_info_t *tasks = (task_info_t *)kmem_alloc(sizeof(task_info_t) * TASK_MAX_IDS, 16);
+    if (!tasks) {
+        puts("ps: out of memory\n");
+        return;
+    }
+    int count = task_list(tasks, TASK_MAX_IDS);
+    print_task_table(tasks, count, NULL);
+    kmem_free(tasks);
+}
+
+// Waits up to `ticks` for a key press in the current task's window; returns 1 on a key.
+static int top_wait_key(task_t *self, uint32_t ticks) {
+    uint64_t end = timer_ticks() + ticks;
+    for (;;) {
+        if (self->killed) task_exit();
+        mljos_ui_event_t ev;
+        while (wm_window_poll_event(self->window, &ev)) {
+            if (ev.type == MLJOS_UI_EVENT_KEY_DOWN) return 1;
+        }
+        uint64_t now = timer_ticks();
+        if (now >= end) return 0;
+        wm_window_wait_event(self->window, (uint32_t)(end - now));
+    }
+}
+
+// Redraws the task table every second, sorted by CPU use over that second, until a key is
+// pressed. Without a window there is no keyboard to stop it, so it prints one table.
+static void cmd_top(void) {
+    task_t *self = task_current();
+    if (!self || !self->window) {
+        cmd_ps();
+        return;
+    }
+    task_info_t *tasks = (task_info_t *)kmem_alloc(sizeof(task_info_t) * TASK_MAX_IDS, 16);
+    uint64_t *prev = (uint64_t *)kmem_alloc(sizeof(uint64_t) * TASK_MAX_IDS, 16);
+    uint32_t *load = (uint32_t *)kmem_alloc(sizeof(uint32_t) * TASK_MAX_IDS, 16);
+    if (!tasks || !prev || !load) {
+        kmem_free(tasks);
+        kmem_free(prev);
+        kmem_free(load);
+        puts("top: out of memory\n");
+        return;
+    }
+
+    kmem_memset(prev, 0, sizeof(uint64_t) * TASK_MAX_IDS);
+    int count = task_list(tasks, TASK_MAX_IDS);
+    for (int i = 0; i < count; ++i) prev[tasks[i].id] = tasks[i].run_tsc;
+    uint64_t prev_tsc = cpu_rdtsc();
+    uint64_t prev_sched = task_sched_overhead_tsc();
+
+    while (!top_wait_key(self, TIMER_HZ)) {
+        count = task_list(tasks, TASK_MAX_IDS);
+        uint64_t now = cpu_rdtsc();
+        uint64_t span = now - prev_tsc;
+        uint64_t sched = task_sched_overhead_tsc();
+        for (int i = 0; i < count; ++i) {
+            uint64_t used = tasks[i].run_tsc - prev[tasks[i].id];
+            if (tasks[i].run_tsc < prev[tasks[i].id]) used = tasks[i].run_tsc;  // id reused
+            load[i] = span ? (uint32_t)(used * 100 / span) : 0;
+            prev[tasks[i].id] = tasks[i].run_tsc;
+        }
+        // Insertion sort, busiest first; the table is short.
+        for (int i = 1; i < count; ++i) {
+            task_info_t ti = tasks[i];
+            uint32_t li = load[i];
+            int j = i - 1;
+            while (j >= 0 && load[j] < li) {
+                tasks[j + 1] = tasks[j];
+                load[j + 1] = load[j];
+                j--;
+            }
+            tasks[j + 1] = ti;
+            load[j + 1] = li;
+        }
+
+        clear_screen();
+        puts("top - ");
+        print_uint((uint32_t)count);
+        puts(" tasks on ");
+        print_uint(smp_cpu_count());
+        puts(" CPUs, scheduler ");
+        // Per mille of one CPU, shown as a percentage with one decimal.
+        uint32_t permille = span ? (uint32_t)((sched - prev_sched) * 1000 / span) : 0;
+        print_uint(permille / 10);
+        putchar('.');
+        print_uint(permille % 10);
+        puts("% of a CPU (any key quits)\n");
+        print_task_table(tasks, count, load);
+        prev_tsc = now;
+        prev_sched = sched;
+    }
+
+    kmem_free(tasks);
+    kmem_free(prev);
+    kmem_free(load);
+}
+
 static void push_history(const char *line) {
     if (!line || !line[0]) return;
 
@@ -927,7 +1267,7 @@ static void print_usb_help(void) {
 
 static void cmd_mkdir_active(const char *path, int create_parents);
 static void cmd_rmdir_active(const char *path);
-static void run_install_wizard(void);
+static void run_install_wizard(int background);
 
 static void print_prompt(void) {
     const user_account_t *user = users_current();
@@ -946,12 +1286,12 @@ static void print_storage_help(void) {
     puts("Admin: useradd <name> <pass> [admin], userdel <name>, passwd [user], chmod <mode> <path>, chown <user> <path>, umask [mode]\n");
     if (shell_disk_primary_mode()) puts("Root: disk-backed session, cd <path>, cd /, pwd\n");
     else puts("Root: ls, cd ram, cd disk, cd /\n");
-    puts("Files: ls [path], cd <path>, pwd, mkdir <path>, mkdir -p <path>, rmdir <path>, touch <path>, rm <path>, cat <path>, write <path> <text>, cp <src> <dst>\n");
-    puts("Disk: disk devices, disk use <n>, disk format, disk ls/cd/pwd/mkdir/write/cat/rm\n");
+    puts("Files: ls [path], cd <path>, pwd, mkdir <path>, mkdir -p <path>, rmdir <path>, touch <path>, rm <path>, cat <path>, write <path> <text>, cp <src> <dst> [&]\n");
+    puts("Disk: disk devices, disk use <n>, disk format, disk cache [writeback|writethrough|flush], disk ls/cd/pwd/mkdir/write/cat/rm, disk defrag <file>\n");
     puts("Apps: bundled apps are stored in /apps and can be launched by name, like calc or edit\n");
     puts("Apps (GUI): `open <app>` launches the app in a window (if it supports GUI)\n");
     puts("Editor: `edit [path]` opens a file in the built-in editor\n");
-    puts("System: install, exec <app|path>, usb, gui [on|off], resolution [WxH|list], clear, help, shutdown, reboot\n");
+    puts("System: install [&], jobs, exec <app|path>, usb, gui [on|off], resolution [WxH|list], clear, help, shutdown, reboot\n");
     puts("Scripts: .scri in /system/autorun run on boot (run by typing file name)\n");
     print_usb_help();
 }
@@ -1278,7 +1618,137 @@ static void handle_umask(char **argv, int argc) {
     fs_set_umask(mode);
 }
 
-static void run_install_wizard(void) {
+static int install_job(void *arg) {
+    (void)arg;
+    cmd_disk_install();
+    if (!fs_sync_to_disk()) {
+        puts("install: warning, failed to copy RAM filesystem to FAT32\n");
+        return 0;
+    }
+    users_persist();
+    puts("install: filesystem and users copied to disk\n");
+    return 1;
+}
+
+static shell_job_t *shell_job_alloc(const char *desc) {
+    for (int i = 0; i < SHELL_JOBS_MAX; ++i) {
+        shell_job_t *j = &g_shell_jobs[i];
+        if (j->used) continue;
+        kmem_memset(j, 0, sizeof(*j));
+        j->used = 1;
+        j->id = g_shell_job_next_id++;
+        j->owner = task_current();
+        j->owner_seq = j->owner ? j->owner->seq : 0;
+        strncpy(j->desc, desc, sizeof(j->desc));
+        j->desc[sizeof(j->desc) - 1] = '\0';
+        return j;
+    }
+    return NULL;
+}
+
+static int shell_job_mine(const shell_job_t *j, const task_t *me) {
+    return me && j->owner == me && j->owner_seq == me->seq;
+}
+
+static int shell_job_orphaned(const shell_job_t *j) {
+    return !task_is_alive(j->owner) || j->owner->seq != j->owner_seq;
+}
+
+// Nobody is left to report a job whose shell exited while it ran.
+static void shell_job_complete(work_t *w) {
+    shell_job_t *j = (shell_job_t *)w->arg;
+    if (shell_job_orphaned(j)) j->used = 0;
+}
+
+// Queues `fn` as a background job. Jobs print to the kernel console: the shell's own console
+// goes away with its tab while the job may still be running.
+static void shell_job_start(const char *desc, work_fn_t fn, shell_job_t *j) {
+    j->work.complete = shell_job_complete;
+    if (!workq_submit(&j->work, fn, j)) {
+        j->used = 0;
+        puts(desc);
+        puts(": no kernel workers\n");
+        return;
+    }
+    puts("[");
+    print_uint((uint32_t)j->id);
+    puts("] ");
+    puts(j->desc);
+    putchar('\n');
+}
+
+static void shell_report_jobs(void) {
+    task_t *me = task_current();
+    for (int i = 0; i < SHELL_JOBS_MAX; ++i) {
+        shell_job_t *j = &g_shell_jobs[i];
+        if (!j->used || !j->work.done) continue;
+        if (!shell_job_mine(j, me) && !shell_job_orphaned(j)) continue;
+        if (shell_job_mine(j, me)) {
+            puts("[");
+            print_uint((uint32_t)j->id);
+            puts(j->work.result ? "] done " : "] failed ");
+            puts(j->desc);
+            putchar('\n');
+        }
+        j->used = 0;
+    }
+}
+
+static void cmd_jobs(void) {
+    task_t *me = task_current();
+    int any = 0;
+    for (int i = 0; i < SHELL_JOBS_MAX; ++i) {
+        shell_job_t *j = &g_shell_jobs[i];
+        if (!j->used || !shell_job_mine(j, me)) continue;
+        puts("[");
+        print_uint((uint32_t)j->id);
+        puts(j->work.done ? "] done    " : "] running ");
+        puts(j->desc);
+        putchar('\n');
+        any = 1;
+    }
+    if (!any) puts("jobs: no background jobs\n");
+    if (workq_pending()) {
+        puts("kernel work queue: ");
+        print_uint(workq_pending());
+        puts(" pending\n");
+    }
+}
+
+// Relative disk paths are resolved now: the disk cwd may change before the job runs.
+static void shell_disk_abs_path(const char *path, char *out, int size) {
+    int n = 0;
+    if (path[0] != '/') {
+        const char *cwd = disk_get_cwd_path();
+        while (cwd[n] && n < size - 1) {
+            out[n] = cwd[n];
+            n++;
+        }
+        if (n > 0 && out[n - 1] != '/' && n < size - 1) out[n++] = '/';
+    }
+    for (int i = 0; path[i] && n < size - 1; ++i) out[n++] = path[i];
+    out[n] = '\0';
+}
+
+static int cp_job(void *arg) {
+    shell_job_t *j = (shell_job_t *)arg;
+    // Another job may hold the disk (install, format); wait for it instead of failing.
+    while (disk_is_busy()) task_sleep_ms(10);
+    return disk_copy_file(j->src, j->dst);
+}
+
+static void shell_start_cp_job(const char *desc, const char *src, const char *dst) {
+    shell_job_t *j = shell_job_alloc(desc);
+    if (!j) {
+        puts("cp: too many background jobs\n");
+        return;
+    }
+    shell_disk_abs_path(src, j->src, sizeof(j->src));
+    shell_disk_abs_path(dst, j->dst, sizeof(j->dst));
+    shell_job_start("cp", cp_job, j);
+}
+
+static void run_install_wizard(int background) {
     char username[32];
     char user_password[32];
     char root_password[32];
@@ -1300,13 +1770,20 @@ static void run_install_wizard(void) {
         return;
     }
 
-    cmd_disk_install();
-    if (!fs_sync_to_disk()) {
-        puts("install: warning, failed to copy RAM filesystem to FAT32\n");
-        return;
+    // The copy runs on a kernel worker so it keeps the disk busy while this task waits.
+    if (background) {
+        shell_job_t *j = shell_job_alloc("install");
+        if (j) {
+            shell_job_start("install", install_job, j);
+            return;
+        }
     }
-    users_persist();
-    puts("install: filesystem and users copied to disk\n");
+    work_t work;
+    kmem_memset(&work, 0, sizeof(work));
+    task_t *t = task_current();
+    work.console = t ? t->console : NULL;
+    if (workq_submit(&work, install_job, NULL)) (void)workq_wait(&work);
+    else (void)install_job(NULL);
 }
 
 static int shell_ends_with(const char *text, const char *suffix) {
@@ -1446,6 +1923,19 @@ static void handle_command(char *line) {
         COLOR = old_color;
         return;
     }
+    // A trailing `&` runs the command as a background job where supported (cp on disk, install).
+    int background = 0;
+    if (argc > 1 && strcmp(argv[argc - 1], "&") == 0) {
+        if (strcmp(argv[0], "install") != 0
+            && !(strcmp(argv[0], "cp") == 0 && shell_disk_primary_mode())) {
+            puts(argv[0]);
+            puts(": background not supported\n");
+            COLOR = old_color;
+            return;
+        }
+        background = 1;
+        argc--;
+    }
 
     if (strcmp(argv[0], "time") == 0) {
         cmd_time();
@@ -1465,6 +1955,18 @@ static void handle_command(char *line) {
         cmd_shutdown();
     } else if (strcmp(argv[0], "ping") == 0) {
         cmd_ping(argv, argc);
+    } else if (strcmp(argv[0], "mem") == 0) {
+        cmd_mem();
+    } else if (strcmp(argv[0], "ctxbench") == 0) {
+        cmd_ctxbench(argv, argc);
+    } else if (strcmp(argv[0], "quantum") == 0) {
+        cmd_quantum(argv, argc);
+    } else if (strcmp(argv[0], "cpus") == 0) {
+        cmd_cpus();
+    } else if (strcmp(argv[0], "ps") == 0) {
+        cmd_ps();
+    } else if (strcmp(argv[0], "top") == 0) {
+        cmd_top();
     } else if (strcmp(argv[0], "clear") == 0) {
         shell_exec_app_command("clear");
     } else if (strcmp(argv[0], "login") == 0 || strcmp(argv[0], "logout") == 0) {
@@ -1501,9 +2003,11 @@ static void handle_command(char *line) {
         else if (shell_location == SHELL_ROOT || active_storage != STORAGE_RAM) puts("chown: available only in ram storage\n");
         else if (argc > 2) cmd_chown(argv[1], argv[2]);
         else puts("chown: usage chown <user> <path>\n");
+    } else if (strcmp(argv[0], "jobs") == 0) {
+        cmd_jobs();
     } else if (strcmp(argv[0], "install") == 0) {
         if (!users_effective_is_root()) puts("install: requires root\n");
-        else run_install_wizard();
+        else run_install_wizard(background);
     } else if (strcmp(argv[0], "ls") == 0) {
         if (argc > 1) {
             strncpy(open_path_ptr(), argv[1], SHELL_OPEN_PATH_MAX);
@@ -1553,7 +2057,11 @@ static void handle_command(char *line) {
     } else if (strcmp(argv[0], "cp") == 0) {
         if (shell_disk_primary_mode()) {
             if (argc > 2) {
-                if (!disk_copy_file(argv[1], argv[2])) puts("cp: failed to copy file on disk\n");
+                if (background) {
+                    join_args(joined, sizeof(joined), argv, 0, 3);
+                    shell_start_cp_job(joined, argv[1], argv[2]);
+                }
+                else if (!disk_copy_file(argv[1], argv[2])) puts("cp: failed to copy file on disk\n");
             } else puts("cp: missing operands\n");
         } else if (shell_location == SHELL_ROOT) puts("cp: select a storage first with cd ram\n");
         else if (active_storage == STORAGE_DISK) puts("cp: available only for ram storage\n");
@@ -1579,9 +2087,11 @@ static void handle_command(char *line) {
         // Clear after launching app to avoid leaking path into the next run
         open_path_ptr()[0] = '\0';
     } else if (strcmp(argv[0], "disk") == 0) {
-        if (argc < 2) puts("disk: missing command (devices, use, format, probe, ls, cd, pwd, mkdir, write, cat, rm)\n");
+        if (argc < 2) puts("disk: missing command (devices, use, format, probe, cache, ls, cd, pwd, mkdir, write, cat, rm, defrag)\n");
         else if (strcmp(argv[1], "devices") == 0 || strcmp(argv[1], "list") == 0) {
             cmd_disk_devices();
+        } else if (strcmp(argv[1], "cache") == 0) {
+            cmd_disk_cache(argc > 2 ? argv[2] : NULL);
         } else if (strcmp(argv[1], "probe") == 0) {
             disk_probe_devices_reset();
             cmd_disk_devices();
@@ -1615,6 +2125,9 @@ static void handle_command(char *line) {
         } else if (strcmp(argv[1], "rm") == 0) {
             if (argc > 2) cmd_disk_rm(argv[2]);
             else puts("disk rm: missing path\n");
+        } else if (strcmp(argv[1], "defrag") == 0) {
+            if (argc > 2) cmd_disk_defrag(argv[2]);
+            else puts("disk defrag: missing path\n");
         } else if (strcmp(argv[1], "cat") == 0) {
             if (argc > 2) cmd_disk_cat(argv[2]);
             else puts("disk cat: missing path\n");
@@ -1639,7 +2152,7 @@ static void handle_command(char *line) {
             }
         }
     } else if (strcmp(argv[0], "help") == 0) {
-        puts("Commands: time, date, echo, gui, resolution, shutdown, reboot, clear, help\n");
+        puts("Commands: time, date, echo, gui, resolution, mem, ctxbench, quantum, cpus, ps, top, shutdown, reboot, clear, help\n");
         print_storage_help();
     } else if (strcmp(argv[0], "usb") == 0) {
         if (argc == 1 || strcmp(argv[1], "controllers") == 0 || strcmp(argv[1], "list") == 0) {
@@ -1735,6 +2248,7 @@ void shell_run(void) {
     {
         char linebuf[128];
         while (1) {
+            shell_report_jobs();
             print_prompt();
             (void)read_line(linebuf, sizeof(linebuf));
             handle_command(linebuf);
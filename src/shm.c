@@ -0,0 +1,135 @@
+#include "shm.h"
+
+#include "kmem.h"
+#include "kstring.h"
+#include "pmm.h"
+
+#define SHM_PAGE_SIZE 4096U
+#define SHM_SLOT_SIZE (2 * 1024 * 1024U)
+#define SHM_MAX_PTS (SHM_MAX_SIZE / SHM_SLOT_SIZE)
+#define SHM_PTE_FLAGS 0x03ULL    // present, writable
+
+typedef struct shm_obj {
+    char name[SHM_NAME_MAX];
+    uint32_t refs;           // attached tasks; 0 = free slot
+    uint32_t size;
+    uint32_t pt_count;
+    uint64_t pts[SHM_MAX_PTS];
+} shm_obj_t;
+
+static shm_obj_t g_shm[SHM_MAX_OBJECTS];
+
+// Frees the object's frames and page tables.
+static void shm_destroy(shm_obj_t *o) {
+    for (uint32_t i = 0; i < o->pt_count; ++i) {
+        uint64_t *pt = (uint64_t *)(uintptr_t)o->pts[i];
+        for (int j = 0; j < 512; ++j) {
+            if (pt[j]) pmm_free_frames(pt[j] & ~0xFFFULL, 1);
+        }
+        pmm_free_frames(o->pts[i], 1);
+    }
+    kmem_memset(o, 0, sizeof(*o));
+}
+
+static int shm_create(shm_obj_t *o, const char *name, uint32_t size) {
+    kmem_memset(o, 0, sizeof(*o));
+    uint32_t pages = (size + SHM_PAGE_SIZE - 1) / SHM_PAGE_SIZE;
+    for (uint32_t p = 0; p < pages; ++p) {
+        if ((p & 511) == 0) {
+            uint64_t pt = pmm_alloc_frames(1);
+            if (!pt) goto fail;
+            kmem_memset((void *)(uintptr_t)pt, 0, SHM_PAGE_SIZE);
+            o->pts[o->pt_count++] = pt;
+        }
+        uint64_t frame = pmm_alloc_frames(1);
+        if (!frame) goto fail;
+        kmem_memset((void *)(uintptr_t)frame, 0, SHM_PAGE_SIZE);
+        uint64_t *pt = (uint64_t *)(uintptr_t)o->pts[p / 512];
+        pt[p & 511] = frame | SHM_PTE_FLAGS;
+    }
+    strncpy(o->name, name, SHM_NAME_MAX);
+    o->name[SHM_NAME_MAX - 1] = '\0';
+    o->size = size;
+    return 1;
+
+fail:
+    shm_destroy(o);
+    return 0;
+}
+
+// First run of `count` free slots in t's shared window, or -1.
+static int shm_find_slots(const task_t *t, uint32_t count) {
+    uint32_t run = 0;
+    for (uint32_t s = 0; s < MLJOS_SHM_SLOTS; ++s) {
+        run = t->shm_slot[s] ? 0 : run + 1;
+        if (run == count) return (int)(s + 1 - count);
+    }
+    return -1;
+}
+
+static void shm_detach(task_t *t, uint32_t slot) {
+    shm_obj_t *o = &g_shm[t->shm_slot[slot] - 1];
+    for (uint32_t i = 0; i < o->pt_count; ++i) t->shm_slot[slot + i] = 0;
+    task_shm_unmap(t, slot, o->pt_count);
+    if (--o->refs == 0) shm_destroy(o);
+}
+
+void *shm_open(const char *name, uint32_t size, uint32_t *size_out) {
+    task_t *t = task_current();
+    if (!t || !t->page_tables || !name || !name[0] || size > SHM_MAX_SIZE) return NULL;
+
+    shm_obj_t *o = NULL;
+    shm_obj_t *spare = NULL;
+    for (int i = 0; i < SHM_MAX_OBJECTS; ++i) {
+        if (!g_shm[i].refs) {
+            if (!spare) spare = &g_shm[i];
+        } else if (strncmp(g_shm[i].name, name, SHM_NAME_MAX - 1) == 0) {
+            o = &g_shm[i];
+            break;
+        }
+    }
+    uint8_t index;
+    if (o) {
+        if (size > o->size) return NULL;
+        index = (uint8_t)(o - g_shm + 1);
+        // Already attached: hand out the same mapping again.
+        for (uint32_t s = 0; s < MLJOS_SHM_SLOTS; ++s) {
+            if (t->shm_slot[s] != index) continue;
+            if (size_out) *size_out = o->size;
+            return (void *)(uintptr_t)(MLJOS_SHM_VADDR + (uint64_t)s * SHM_SLOT_SIZE);
+        }
+    } else {
+        if (!size || !spare || !shm_create(spare, name, size)) return NULL;
+        o = spare;
+        index = (uint8_t)(o - g_shm + 1);
+    }
+
+    int slot = shm_find_slots(t, o->pt_count);
+    if (slot < 0) {
+        if (!o->refs) shm_destroy(o);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < o->pt_count; ++i) t->shm_slot[slot + i] = index;
+    task_shm_map(t, (uint32_t)slot, o->pts, o->pt_count);
+    o->refs++;
+    if (size_out) *size_out = o->size;
+    return (void *)(uintptr_t)(MLJOS_SHM_VADDR + (uint64_t)slot * SHM_SLOT_SIZE);
+}
+
+int shm_close(void *addr) {
+    task_t *t = task_current();
+    uint64_t a = (uint64_t)(uintptr_t)addr;
+    if (!t || a < MLJOS_SHM_VADDR || a >= MLJOS_SHM_VADDR + MLJOS_SHM_MAX_SIZE) return 0;
+    uint32_t slot = (uint32_t)((a - MLJOS_SHM_VADDR) / SHM_SLOT_SIZE);
+    if (!t->shm_slot[slot]) return 0;
+    // Any address inside the mapping will do: walk back to its first slot.
+    while (slot > 0 && t->shm_slot[slot - 1] == t->shm_slot[slot]) slot--;
+    shm_detach(t, slot);
+    return 1;
+}
+
+void shm_release_all(task_t *t) {
+    for (uint32_t s = 0; s < MLJOS_SHM_SLOTS; ++s) {
+        if (t->shm_slot[s]) shm_detach(t, s);
+    }
+}
@@ -0,0 +1,340 @@
+#include "smp.h"
+
+#include "cpu.h"
+#include "kmem.h"
+#include "task.h"
+#include "timer.h"
+
+#define MSR_APIC_BASE 0x1B
+#define MSR_EFER      0xC0000080
+#define MSR_GS_BASE   0xC0000101
+
+#define LAPIC_ID          0x020
+#define LAPIC_EOI         0x0B0
+#define LAPIC_SVR         0x0F0
+#define LAPIC_ICR_LO      0x300
+#define LAPIC_ICR_HI      0x310
+#define LAPIC_LVT_TIMER   0x320
+#define LAPIC_LVT_LINT0   0x350
+#define LAPIC_LVT_LINT1   0x360
+#define LAPIC_TIMER_INIT  0x380
+#define LAPIC_TIMER_CUR   0x390
+#define LAPIC_TIMER_DIV   0x3E0
+
+#define LAPIC_SVR_ENABLE      0x100
+#define LAPIC_LVT_MASKED      0x10000
+#define LAPIC_TIMER_PERIODIC  0x20000
+#define LAPIC_DELIVERY_EXTINT 0x700
+#define LAPIC_DELIVERY_NMI    0x400
+#define LAPIC_ICR_PENDING     0x1000
+// Destination shorthand "all excluding self", level assert.
+#define LAPIC_ICR_ALL_BUT_SELF 0xC4000
+#define LAPIC_ICR_INIT        0x500
+#define LAPIC_ICR_STARTUP     0x600
+#define LAPIC_ICR_ASSERT      0x4000
+
+// Real-mode entry point for the APs. Must be page aligned and inside the reserved low 1MiB;
+// the SIPI vector is the page number.
+#define SMP_TRAMPOLINE_ADDR 0x8000ULL
+#define SMP_AP_STACK_SIZE (16 * 1024)
+#define SMP_CALIBRATE_TICKS 10
+
+#define SMP_STR2(x) #x
+#define SMP_STR(x) SMP_STR2(x)
+
+static cpu_local_t g_cpus[SMP_MAX_CPUS];
+static volatile uint32_t g_cpu_online = 1;
+static volatile uint32_t *g_lapic = NULL;
+static uint32_t g_lapic_timer_count = 0;   // LAPIC timer counts per timer tick (divider 16)
+static uint64_t g_bsp_cr0 = 0;
+static uint64_t g_bsp_cr4 = 0;
+static uint64_t g_bsp_efer = 0;
+
+// AP startup code, copied to SMP_TRAMPOLINE_ADDR. Every AP that answers the broadcast SIPI
+// walks real mode -> protected mode -> long mode on the kernel page tables, takes the next
+// index from smp_tramp_count and jumps to smp_tramp_entry on its own stack.
+__asm__ (
+    ".section .text\n"
+    ".code16\n"
+    ".global smp_trampoline_start\n"
+    "smp_trampoline_start:\n"
+    "cli\n"
+    "cld\n"
+    "xorw %ax, %ax\n"
+    "movw %ax, %ds\n"
+    "lgdtl " SMP_STR(SMP_TRAMPOLINE_ADDR) " + (smp_tramp_gdt_desc - smp_trampoline_start)\n"
+    "movl %cr0, %eax\n"
+    "orl $1, %eax\n"
+    "movl %eax, %cr0\n"
+    "ljmpl $0x08, $(" SMP_STR(SMP_TRAMPOLINE_ADDR) " + (smp_tramp_32 - smp_trampoline_start))\n"
+
+    ".code32\n"
+    "smp_tramp_32:\n"
+    "movw $0x10, %ax\n"
+    "movw %ax, %ds\n"
+    "movw %ax, %es\n"
+    "movw %ax, %ss\n"
+    "movl %cr4, %eax\n"
+    "orl $0x20, %eax\n"                   // PAE
+    "movl %eax, %cr4\n"
+    "movl " SMP_STR(SMP_TRAMPOLINE_ADDR) " + (smp_tramp_cr3 - smp_trampoline_start), %eax\n"
+    "movl %eax, %cr3\n"
+    "movl $0xC0000080, %ecx\n"
+    "rdmsr\n"
+    "orl $0x100, %eax\n"                  // EFER.LME
+    "wrmsr\n"
+    "movl %cr0, %eax\n"
+    "orl $0x80000001, %eax\n"             // PG | PE
+    "movl %eax, %cr0\n"
+    "ljmpl $0x18, $(" SMP_STR(SMP_TRAMPOLINE_ADDR) " + (smp_tramp_64 - smp_trampoline_start))\n"
+
+    ".code64\n"
+    "smp_tramp_64:\n"
+    "movw $0x20, %ax\n"
+    "movw %ax, %ds\n"
+    "movw %ax, %es\n"
+    "movw %ax, %ss\n"
+    "movl $1, %eax\n"
+    "lock xaddl %eax, " SMP_STR(SMP_TRAMPOLINE_ADDR) " + (smp_tramp_count - smp_trampoline_start)\n"
+    "cmpl $(" SMP_STR(SMP_MAX_CPUS) " - 1), %eax\n"
+    "jae 1f\n"
+    "movq " SMP_STR(SMP_TRAMPOLINE_ADDR) " + (smp_tramp_stacks - smp_trampoline_start)(,%rax,8), %rsp\n"
+    "testq %rsp, %rsp\n"
+    "jz 1f\n"
+    "leal 1(%eax), %edi\n"
+    "movq " SMP_STR(SMP_TRAMPOLINE_ADDR) " + (smp_tramp_entry - smp_trampoline_start), %rcx\n"
+    "jmpq *%rcx\n"
+    // More CPUs than SMP_MAX_CPUS (or no stack for this one): park the extra ones.
+    "1:\n"
+    "cli\n"
+    "hlt\n"
+    "jmp 1b\n"
+
+    ".align 8\n"
+    "smp_tramp_gdt:\n"
+    ".quad 0\n"
+    ".quad 0x00CF9A000000FFFF\n"          // 0x08: 32-bit code
+    ".quad 0x00CF92000000FFFF\n"          // 0x10: data
+    ".quad 0x00AF9A000000FFFF\n"          // 0x18: 64-bit code
+    ".quad 0x00AF92000000FFFF\n"          // 0x20: data
+    "smp_tramp_gdt_desc:\n"
+    ".word 5 * 8 - 1\n"
+    ".long " SMP_STR(SMP_TRAMPOLINE_ADDR) " + (smp_tramp_gdt - smp_trampoline_start)\n"
+    ".align 8\n"
+    ".global smp_tramp_cr3\n"
+    "smp_tramp_cr3: .quad 0\n"
+    ".global smp_tramp_entry\n"
+    "smp_tramp_entry: .quad 0\n"
+    ".global smp_tramp_count\n"
+    "smp_tramp_count: .long 0, 0\n"
+    ".global smp_tramp_stacks\n"
+    "smp_tramp_stacks: .fill " SMP_STR(SMP_MAX_CPUS) ", 8, 0\n"
+    ".global smp_trampoline_end\n"
+    "smp_trampoline_end:\n"
+);
+
+extern char smp_trampoline_start[];
+extern char smp_trampoline_end[];
+extern char smp_tramp_cr3[];
+extern char smp_tramp_entry[];
+extern char smp_tramp_count[];
+extern char smp_tramp_stacks[];
+
+// Address of a trampoline variable in the copy at SMP_TRAMPOLINE_ADDR.
+static void *tramp_var(const char *sym) {
+    return (void *)(uintptr_t)(SMP_TRAMPOLINE_ADDR + (uint64_t)(sym - smp_trampoline_start));
+}
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return g_lapic[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+    g_lapic[reg / 4] = value;
+}
+
+static inline uint64_t read_cr(int n) {
+    uint64_t v = 0;
+    if (n == 0) __asm__ volatile ("mov %%cr0, %0" : "=r"(v));
+    else if (n == 3) __asm__ volatile ("mov %%cr3, %0" : "=r"(v));
+    else if (n == 4) __asm__ volatile ("mov %%cr4, %0" : "=r"(v));
+    return v;
+}
+
+static void lapic_send_ipi(uint32_t icr_lo) {
+    lapic_write(LAPIC_ICR_HI, 0);
+    lapic_write(LAPIC_ICR_LO, icr_lo);
+    while (lapic_read(LAPIC_ICR_LO) & LAPIC_ICR_PENDING) __asm__ volatile ("pause");
+}
+
+static void lapic_timer_irq(interrupt_frame_t *frame) {
+    lapic_write(LAPIC_EOI, 0);
+    task_timer_tick(frame);
+}
+
+static void lapic_resched_irq(interrupt_frame_t *frame) {
+    (void)frame;  // only here to end HLT; the scheduler loop does the rest
+    lapic_write(LAPIC_EOI, 0);
+}
+
+static void lapic_spurious_irq(interrupt_frame_t *frame) {
+    (void)frame;  // no EOI for spurious interrupts
+}
+
+static void lapic_start_timer(void) {
+    if (!g_lapic_timer_count) return;
+    lapic_write(LAPIC_TIMER_DIV, 0x3);  // divide by 16
+    lapic_write(LAPIC_LVT_TIMER, CPU_LAPIC_TIMER_VECTOR | LAPIC_TIMER_PERIODIC);
+    lapic_write(LAPIC_TIMER_INIT, g_lapic_timer_count);
+}
+
+// Busy-waits at least `ticks` PIT ticks (IRQs must be on).
+static void delay_ticks(uint64_t ticks) {
+    uint64_t end = timer_ticks() + ticks + 1;
+    while (timer_ticks() < end) __asm__ volatile ("pause");
+}
+
+static void cpu_local_init(cpu_local_t *c, uint32_t index) {
+    kmem_memset(c, 0, sizeof(*c));
+    c->self = c;
+    c->index = index;
+    c->start_tsc = cpu_rdtsc();
+    cpu_wrmsr(MSR_GS_BASE, (uint64_t)(uintptr_t)c);
+}
+
+void smp_init_bsp(void) {
+    cpu_local_init(&g_cpus[0], 0);
+    g_cpus[0].online = 1;
+}
+
+static void ap_main(uint64_t index) __attribute__((noreturn, used));
+static void ap_main(uint64_t index) {
+    // Match the BSP's control registers (SSE, PCIDE, ...) before running any C code that
+    // might need them.
+    __asm__ volatile ("mov %0, %%cr0" : : "r"(g_bsp_cr0));
+    __asm__ volatile ("mov %0, %%cr4" : : "r"(g_bsp_cr4));
+    cpu_wrmsr(MSR_EFER, g_bsp_efer);
+    cpu_init_ap();
+
+    cpu_local_t *c = &g_cpus[index];
+    cpu_local_init(c, (uint32_t)index);
+    c->apic_id = lapic_read(LAPIC_ID) >> 24;
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | CPU_SPURIOUS_VECTOR);
+    // Legacy PIC interrupts stay on the BSP.
+    lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_LVT_LINT1, LAPIC_LVT_MASKED);
+    lapic_start_timer();
+    c->online = 1;
+    __atomic_add_fetch(&g_cpu_online, 1, __ATOMIC_RELEASE);
+    cpu_sti();
+
+    // APs only run tasks; the WM, input and network stay on the BSP's kernel loop.
+    for (;;) {
+        if (!task_schedule_once()) smp_idle();
+    }
+}
+
+void smp_start_aps(void) {
+    uint32_t a, b, c, d;
+    __asm__ volatile ("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(1), "c"(0));
+    if (!(d & (1U << 9))) return;  // no local APIC
+    uint64_t base = cpu_rdmsr(MSR_APIC_BASE);
+    if (!(base & (1ULL << 11))) return;  // globally disabled by firmware
+    g_lapic = (volatile uint32_t *)(uintptr_t)(base & 0xFFFFF000ULL);
+
+    cpu_set_isr_handler(CPU_LAPIC_TIMER_VECTOR, lapic_timer_irq);
+    cpu_set_isr_handler(CPU_SPURIOUS_VECTOR, lapic_spurious_irq);
+    cpu_set_isr_handler(CPU_RESCHED_VECTOR, lapic_resched_irq);
+
+    // BSP: software-enable the LAPIC (its timer does not count otherwise) and keep the PIC
+    // wired through LINT0 in virtual-wire mode.
+    g_cpus[0].apic_id = lapic_read(LAPIC_ID) >> 24;
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | CPU_SPURIOUS_VECTOR);
+    lapic_write(LAPIC_LVT_LINT0, LAPIC_DELIVERY_EXTINT);
+    lapic_write(LAPIC_LVT_LINT1, LAPIC_DELIVERY_NMI);
+
+    // Calibrate the LAPIC timer against the PIT. The BSP keeps using the PIT for its tick.
+    lapic_write(LAPIC_TIMER_DIV, 0x3);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+    delay_ticks(0);
+    lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFFU);
+    delay_ticks(SMP_CALIBRATE_TICKS - 1);
+    uint32_t elapsed = 0xFFFFFFFFU - lapic_read(LAPIC_TIMER_CUR);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+    g_lapic_timer_count = elapsed / SMP_CALIBRATE_TICKS;
+
+    g_bsp_cr0 = read_cr(0);
+    g_bsp_cr4 = read_cr(4);
+    g_bsp_efer = cpu_rdmsr(MSR_EFER);
+
+    uint64_t size = (uint64_t)(smp_trampoline_end - smp_trampoline_start);
+    kmem_memcpy((void *)(uintptr_t)SMP_TRAMPOLINE_ADDR, smp_trampoline_start, size);
+    *(uint64_t *)tramp_var(smp_tramp_cr3) = read_cr(3) & ~0xFFFULL;
+    *(uint64_t *)tramp_var(smp_tramp_entry) = (uint64_t)(uintptr_t)ap_main;
+    *(uint32_t *)tramp_var(smp_tramp_count) = 0;
+    uint64_t *stacks = (uint64_t *)tramp_var(smp_tramp_stacks);
+    for (int i = 0; i < SMP_MAX_CPUS - 1; ++i) {
+        uint8_t *stack = (uint8_t *)kmem_alloc(SMP_AP_STACK_SIZE, 16);
+        // ap_main is entered with a jump: leave RSP%16 == 8 as after a call.
+        stacks[i] = stack ? (uint64_t)(uintptr_t)(stack + SMP_AP_STACK_SIZE - 8) : 0;
+        if (!stack) break;
+    }
+
+    // INIT, then the startup IPI twice (the second one is ignored by CPUs already running).
+    lapic_send_ipi(LAPIC_ICR_ALL_BUT_SELF | LAPIC_ICR_INIT);
+    delay_ticks(10);
+    uint32_t vector = (uint32_t)(SMP_TRAMPOLINE_ADDR >> 12);
+    lapic_send_ipi(LAPIC_ICR_ALL_BUT_SELF | LAPIC_ICR_STARTUP | vector);
+    delay_ticks(1);
+    lapic_send_ipi(LAPIC_ICR_ALL_BUT_SELF | LAPIC_ICR_STARTUP | vector);
+
+    // There is no CPU count to wait for without ACPI, so give them a fixed time to show up.
+    uint32_t seen = 0;
+    for (int i = 0; i < 20; ++i) {
+        delay_ticks(10);
+        uint32_t n = g_cpu_online;
+        if (n == seen && n > 1) break;
+        seen = n;
+    }
+}
+
+void smp_idle(void) {
+    cpu_local_t *c = smp_this_cpu();
+    uint64_t start = cpu_rdtsc();
+    cpu_cli();
+    // Publish `idle` before looking at the run queues; a waker makes the task runnable before
+    // it reads `idle`, so one of the two always sees the other.
+    __atomic_store_n(&c->idle, 1, __ATOMIC_SEQ_CST);
+    if (task_any_runnable()) cpu_sti();
+    else __asm__ volatile ("sti; hlt" ::: "memory");  // STI shadow: no wake-up is lost
+    c->idle = 0;
+    c->idle_tsc += cpu_rdtsc() - start;
+}
+
+void smp_kick(uint32_t index) {
+    cpu_local_t *c = smp_cpu(index);
+    if (!g_lapic || !c || c == smp_this_cpu() || !c->idle) return;
+    uint64_t flags = cpu_irq_save();
+    lapic_write(LAPIC_ICR_HI, c->apic_id << 24);
+    lapic_write(LAPIC_ICR_LO, LAPIC_ICR_ASSERT | CPU_RESCHED_VECTOR);
+    while (lapic_read(LAPIC_ICR_LO) & LAPIC_ICR_PENDING) __asm__ volatile ("pause");
+    cpu_irq_restore(flags);
+}
+
+int smp_msi_apic_id(void) {
+    if (!g_lapic) return -1;
+    return (int)g_cpus[0].apic_id;
+}
+
+void smp_lapic_eoi(void) {
+    if (g_lapic) lapic_write(LAPIC_EOI, 0);
+}
+
+uint32_t smp_cpu_count(void) {
+    return g_cpu_online;
+}
+
+cpu_local_t *smp_cpu(uint32_t index) {
+    if (index >= SMP_MAX_CPUS || !g_cpus[index].online) return NULL;
+    return &g_cpus[index];
+}
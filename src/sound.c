@@ -1,15 +1,6 @@
 #include "sound.h"
 #include "io.h"
-
-static void delay_ms(uint32_t ms) {
-    // Increased loop constant for better visibility in VMs.
-    // Roughly calibrated for typical modern CPU speed in a VM.
-    for (uint32_t i = 0; i < ms; i++) {
-        for (volatile uint32_t j = 0; j < 2000000; j++) {
-            __asm__ volatile ("nop");
-        }
-    }
-}
+#include "task.h"
 
 void sound_play(uint32_t freq) {
     if (freq == 0) {
@@ -40,6 +31,7 @@ void sound_stop(void) {
 
 void sound_beep(uint32_t freq, uint32_t duration_ms) {
     sound_play(freq);
-    delay_ms(duration_ms);
+    // Sleeps when called from a task; the boot beep spins on the timer tick instead.
+    task_sleep_ms(duration_ms);
     sound_stop();
 }
@@ -1,19 +1,77 @@
 #include "task.h"
 
 #include "app_layout.h"
+#include "chan.h"
+#include "shm.h"
+#include "cpu.h"
+#include "fpu.h"
 #include "kmem.h"
+#include "pmm.h"
 #include "sdk/mljos_app.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "timer.h"
 #include "wm.h"
 
-#define MAX_TASKS 16
 #define TASK_STACK_SIZE (64 * 1024)
-#define APP_REGION_SIZE (2 * 1024 * 1024ULL)
+#define TASK_DEFAULT_QUANTUM_MS 10
 
-static task_t g_tasks[MAX_TASKS];
-static task_t *g_current = NULL;
-static task_context_t g_kernel_ctx;
+#define PAGE_SIZE 4096ULL
+#define PTE_PRESENT 0x01ULL
+#define PTE_WRITE 0x02ULL
+#define PTE_ADDR_MASK 0x000FFFFFFFFFF000ULL
+// The app window lives in one page directory of the identity map (PD0..PD3 cover 4GiB).
+#define APP_PDPT_INDEX ((MLJOS_APP_VADDR >> 30) & 0x1FFULL)
+#define APP_PD_FIRST ((MLJOS_APP_VADDR >> 21) & 0x1FFULL)
+#define APP_PT_COUNT (MLJOS_APP_MAX_SIZE / (2 * 1024 * 1024ULL))
+#define SHM_PD_FIRST ((MLJOS_SHM_VADDR >> 21) & 0x1FFULL)
+
+#define TASK_POOL_MAX 4
+#define ZERO_POOL_MAX 64
+#define ZERO_POOL_BATCH 4
+// Function pointers in mljos_api_t plus mljos_ui_api_t, each routed through a gate thunk.
+#define GATE_THUNKS 48
+#define GATE_THUNK_SIZE 16
+
+// Kernel stack and page tables of a reaped task (its app window already unmapped), kept for
+// the next launch.
+typedef struct task_space {
+    void *stack;
+    void *page_tables;
+} task_space_t;
+
+// Task structures are allocated on demand and recycled through a free list; ids come from a
+// bitmap. Both are only touched under the kernel lock.
+static task_t *g_task_free = NULL;
+static task_t *g_task_all = NULL;
+static uint64_t g_task_seq = 0;
+static uint64_t g_task_ids[TASK_MAX_IDS / 64];
+static uint32_t g_task_id_hint = 1;
+static task_space_t g_task_pool[TASK_POOL_MAX];
+static int g_task_pool_count = 0;
+// Frames zeroed ahead of time by task_pool_scrub(), so demand faults rarely clear a page inline.
+// Demand faults of apps running on other CPUs take them without the kernel lock.
+static uint64_t g_zero_frames[ZERO_POOL_MAX];
+static int g_zero_count = 0;
+static spinlock_t g_zero_lock = SPINLOCK_INIT;
 static uint64_t g_kernel_cr3 = 0;
-static int g_rr_pos = 0;
+// Big kernel lock: the WM, console, disk, FS, net and kernel heap were written for a single
+// CPU and call into each other freely, so all of them are serialised by this one lock. Kernel
+// tasks hold it whenever they run; app tasks drop it while executing app code and take it
+// again through their API gate.
+static spinlock_t g_kernel_lock = SPINLOCK_INIT;
+// Address-space generation each CPU last used per PCID; a mismatch means the CPU may still
+// cache translations of an earlier task in the slot (or of pages this task has since dropped).
+static uint32_t g_pcid_gen[SMP_MAX_CPUS][TASK_MAX_IDS];
+static uint32_t g_tlb_gen = 0;
+// What the scheduler passes to ctx_switch as `cr3_bits`. With PCIDs on, bit 63 keeps the TLB
+// entries of the incoming address space instead of flushing them.
+static uint64_t g_cr3_noflush = 0;
+
+#define CR3_NOFLUSH (1ULL << 63)
+#define BENCH_STACK_SIZE (16 * 1024)
+#define BENCH_MAX_PAGES 64
+static uint32_t g_quantum_ticks = TASK_DEFAULT_QUANTUM_MS * TIMER_HZ / 1000;
 
 static inline uint64_t read_cr3(void) {
     uint64_t v;
@@ -25,10 +83,11 @@ static inline void write_cr3(uint64_t v) {
     __asm__ volatile ("mov %0, %%cr3" : : "r"(v) : "memory");
 }
 
-__attribute__((naked)) static void ctx_switch(task_context_t *old_ctx, task_context_t *new_ctx) {
+// `cr3_bits` is OR-ed into the CR3 loaded from `new_ctx`.
+__attribute__((naked)) static void ctx_switch(task_context_t *old_ctx, task_context_t *new_ctx, uint64_t cr3_bits) {
     __asm__ volatile (
         ".intel_syntax noprefix\n"
-        // rdi = old, rsi = new
+        // rdi = old, rsi = new, rdx = cr3_bits
         "mov [rdi + 0], rsp\n"
         "mov [rdi + 8], rbx\n"
         "mov [rdi + 16], rbp\n"
@@ -42,6 +101,7 @@ __attribute__((naked)) static void ctx_switch(task_context_t *old_ctx, task_cont
         "mov [rdi + 64], rax\n"
 
         "mov rax, [rsi + 64]\n"
+        "or rax, rdx\n"
         "mov cr3, rax\n"
         "mov rsp, [rsi + 0]\n"
         "mov rbx, [rsi + 8]\n"
@@ -57,35 +117,203 @@ __attribute__((naked)) static void ctx_switch(task_context_t *old_ctx, task_cont
     );
 }
 
+// Entry for calls from app code into the kernel: r11 holds the kernel function, the
+// arguments are still in place (no API function takes stack arguments). The call runs under
+// the kernel lock.
+__asm__ (
+    ".section .text\n"
+    ".global task_api_gate\n"
+    "task_api_gate:\n"
+    "pushq %rbp\n"
+    "movq %rsp, %rbp\n"
+    "pushq %rdi\n"
+    "pushq %rsi\n"
+    "pushq %rdx\n"
+    "pushq %rcx\n"
+    "pushq %r8\n"
+    "pushq %r9\n"
+    "pushq %r11\n"
+    "pushq %rax\n"
+    "call kernel_lock\n"
+    "popq %rax\n"
+    "popq %r11\n"
+    "popq %r9\n"
+    "popq %r8\n"
+    "popq %rcx\n"
+    "popq %rdx\n"
+    "popq %rsi\n"
+    "popq %rdi\n"
+    "call *%r11\n"
+    "pushq %rax\n"
+    "pushq %rdx\n"
+    "call kernel_unlock\n"
+    "popq %rdx\n"
+    "popq %rax\n"
+    "popq %rbp\n"
+    "ret\n"
+);
+
+extern char task_api_gate[];
+
+// The API table an app task is started with: copies of its mljos_api_t and UI table whose
+// function pointers lead through task_api_gate.
+typedef struct api_gate {
+    mljos_api_t api;
+    mljos_ui_api_t ui;
+    uint8_t thunks[GATE_THUNKS][GATE_THUNK_SIZE];
+    int used;
+} api_gate_t;
+
+// movabs $fn, %r11; jmp task_api_gate
+static void *gate_thunk(api_gate_t *g, void *fn) {
+    if (!fn || g->used >= GATE_THUNKS) return fn;
+    uint8_t *code = g->thunks[g->used++];
+    code[0] = 0x49;
+    code[1] = 0xBB;
+    kmem_memcpy(code + 2, &fn, 8);
+    code[10] = 0xE9;
+    int32_t rel = (int32_t)((int64_t)(uintptr_t)task_api_gate - (int64_t)(uintptr_t)(code + 15));
+    kmem_memcpy(code + 11, &rel, 4);
+    code[15] = 0x90;
+    return code;
+}
+
+#define GATE(g, s, f) ((s).f = (__typeof__((s).f))gate_thunk((g), (void *)(s).f))
+
+static api_gate_t *api_gate_build(const mljos_api_t *src) {
+    api_gate_t *g = (api_gate_t *)kmem_alloc(sizeof(api_gate_t), 16);
+    if (!g) return NULL;
+    g->used = 0;
+    g->api = *src;
+    GATE(g, g->api, puts);
+    GATE(g, g->api, putchar);
+    GATE(g, g->api, clear_screen);
+    GATE(g, g->api, read_line);
+    GATE(g, g->api, read_file);
+    GATE(g, g->api, write_file);
+    GATE(g, g->api, set_cursor);
+    GATE(g, g->api, putchar_at);
+    GATE(g, g->api, tui_cols);
+    GATE(g, g->api, tui_rows);
+    GATE(g, g->api, read_key);
+    GATE(g, g->api, list_dir);
+    GATE(g, g->api, get_cwd);
+    GATE(g, g->api, mkdir);
+    GATE(g, g->api, rm);
+    GATE(g, g->api, get_time);
+    GATE(g, g->api, get_date);
+    GATE(g, g->api, run_shell);
+    GATE(g, g->api, launch_app);
+    GATE(g, g->api, launch_app_args);
+    GATE(g, g->api, clipboard_set);
+    GATE(g, g->api, clipboard_get);
+    GATE(g, g->api, clipboard_has_text);
+    GATE(g, g->api, now_ns);
+    GATE(g, g->api, sleep_ms);
+    GATE(g, g->api, set_timer);
+    GATE(g, g->api, chan_create);
+    GATE(g, g->api, chan_send);
+    GATE(g, g->api, chan_recv);
+    GATE(g, g->api, chan_wait);
+    GATE(g, g->api, chan_close);
+    GATE(g, g->api, launch_app_chan);
+    GATE(g, g->api, shm_open);
+    GATE(g, g->api, shm_close);
+    if (src->ui) {
+        g->ui = *src->ui;
+        GATE(g, g->ui, screen_w);
+        GATE(g, g->ui, screen_h);
+        GATE(g, g->ui, fill_rect);
+        GATE(g, g->ui, draw_text);
+        GATE(g, g->ui, draw_text_scale);
+        GATE(g, g->ui, begin_app);
+        GATE(g, g->ui, end_app);
+        GATE(g, g->ui, poll_event);
+        GATE(g, g->ui, prompt_input);
+        g->api.ui = &g->ui;
+    }
+    return g;
+}
+
 static void task_trampoline(void) __attribute__((noreturn));
 static void task_trampoline(void) {
-    task_t *t = g_current;
+    task_t *t = task_current();
     if (t && t->entry) t->entry(t->arg);
     task_exit();
 }
 
 static void app_trampoline(void) __attribute__((noreturn));
 static void app_trampoline(void) {
-    task_t *t = g_current;
+    task_t *t = task_current();
     if (!t) task_exit();
+    // Still under the kernel lock the task was created with.
+    api_gate_t *g = api_gate_build(&t->api);
+    if (!g) task_exit();
+    t->api_gate = g;
     uint32_t off = mljos_app_entry_offset_from_image((const void *)(uintptr_t)MLJOS_APP_VADDR, 0);
     void (*app_entry)(mljos_api_t *) = (void (*)(mljos_api_t *))(uintptr_t)(MLJOS_APP_VADDR + (uint64_t)off);
-    app_entry(&t->api);
+    kernel_unlock();
+    app_entry(&g->api);
     task_exit();
 }
 
-static task_t *task_alloc_slot(void) {
-    for (int i = 0; i < MAX_TASKS; ++i) {
-        if (g_tasks[i].state == TASK_UNUSED) return &g_tasks[i];
+static uint32_t task_id_alloc(void) {
+    for (uint32_t n = 1; n < TASK_MAX_IDS; ++n) {
+        uint32_t id = g_task_id_hint;
+        g_task_id_hint = id + 1 < TASK_MAX_IDS ? id + 1 : 1;
+        if (g_task_ids[id >> 6] & (1ULL << (id & 63))) continue;
+        g_task_ids[id >> 6] |= 1ULL << (id & 63);
+        return id;
+    }
+    return 0;
+}
+
+static void task_id_free(uint32_t id) {
+    if (id == 0 || id >= TASK_MAX_IDS) return;
+    g_task_ids[id >> 6] &= ~(1ULL << (id & 63));
+}
+
+// Returns an UNUSED task with an id and shell state, or NULL.
+static task_t *task_alloc(void) {
+    uint32_t id = task_id_alloc();
+    if (!id) return NULL;
+    task_shell_t *shell = (task_shell_t *)kmem_alloc(sizeof(task_shell_t), 16);
+    task_t *t = g_task_free;
+    if (t) {
+        g_task_free = t->rq_next;
+    } else {
+        t = (task_t *)kmem_alloc(sizeof(task_t), 16);
+        if (t) {
+            kmem_memset(t, 0, sizeof(*t));
+            t->all_next = g_task_all;
+            g_task_all = t;
+        }
+    }
+    if (!t || !shell || !fpu_task_init(t)) {
+        if (t) {
+            t->rq_next = g_task_free;
+            g_task_free = t;
+        }
+        kmem_free(shell);
+        task_id_free(id);
+        return NULL;
     }
-    return NULL;
+    t->id = id;
+    t->seq = ++g_task_seq;
+    t->shell = shell;
+    return t;
 }
 
-static void clone_page_tables(uint64_t *out_cr3, uint64_t app_phys_2mib) {
+static inline void invlpg(uint64_t vaddr) {
+    __asm__ volatile ("invlpg (%0)" : : "r"(vaddr) : "memory");
+}
+
+static uint8_t *clone_page_tables(uint64_t *out_cr3) {
     // Kernel sets up 6 consecutive 4K pages: PML4, PDPT, PD0..PD3.
     uint64_t kernel_cr3 = g_kernel_cr3;
     uint8_t *src = (uint8_t *)(uintptr_t)kernel_cr3;
-    uint8_t *dst = (uint8_t *)kmem_alloc(6 * 4096, 4096);
+    uint8_t *dst = (uint8_t *)(uintptr_t)pmm_alloc_frames(6);
+    if (!dst) return NULL;
     kmem_memcpy(dst, src, 6 * 4096);
 
     // IMPORTANT: patch the copied pointers to point to the copied lower-level tables.
@@ -99,24 +327,96 @@ static void clone_page_tables(uint64_t *out_cr3, uint64_t app_phys_2mib) {
         pdpt[i] = ((uint64_t)(uintptr_t)pd) | 0x03ULL;
     }
 
-    // Map the app into one 2MiB page at MLJOS_APP_VADDR.
-    uint64_t pdpt_i = (MLJOS_APP_VADDR >> 30) & 0x1FFULL;
-    uint64_t pd_i = (MLJOS_APP_VADDR >> 21) & 0x1FFULL;
-    if (pdpt_i < 4) {
-        uint64_t *pd = (uint64_t *)(dst + (2 + pdpt_i) * 4096);
-        // 2MiB page entry: present|rw|ps
-        pd[pd_i] = (app_phys_2mib & 0x000FFFFFFFFFF000ULL) | 0x83ULL;
-    }
+    // The app window starts out unmapped; page tables and pages appear on first touch.
+    uint64_t *pd = (uint64_t *)(dst + (2 + APP_PDPT_INDEX) * 4096);
+    for (uint64_t i = 0; i < APP_PT_COUNT; ++i) pd[APP_PD_FIRST + i] = 0;
+    for (uint64_t i = 0; i < MLJOS_SHM_SLOTS; ++i) pd[SHM_PD_FIRST + i] = 0;
 
     *out_cr3 = (uint64_t)(uintptr_t)dst;
+    return dst;
+}
+
+static uint64_t *app_pd(void *page_tables) {
+    return (uint64_t *)((uint8_t *)page_tables + (2 + APP_PDPT_INDEX) * 4096);
+}
+
+static uint64_t alloc_zero_frame(void) {
+    uint64_t flags = spin_lock_irqsave(&g_zero_lock);
+    uint64_t f = g_zero_count > 0 ? g_zero_frames[--g_zero_count] : 0;
+    spin_unlock_irqrestore(&g_zero_lock, flags);
+    if (f) return f;
+    f = pmm_alloc_frames(1);
+    if (f) kmem_memset((void *)(uintptr_t)f, 0, PAGE_SIZE);
+    return f;
+}
+
+// Returns the PTE for `vaddr` inside the app window, allocating its page table if asked to.
+static uint64_t *app_pte(void *page_tables, uint64_t vaddr, int create) {
+    uint64_t off = vaddr - MLJOS_APP_VADDR;
+    uint64_t *pde = &app_pd(page_tables)[APP_PD_FIRST + (off >> 21)];
+    if (!(*pde & PTE_PRESENT)) {
+        if (!create) return NULL;
+        uint64_t pt = alloc_zero_frame();
+        if (!pt) return NULL;
+        *pde = pt | PTE_PRESENT | PTE_WRITE;
+    }
+    uint64_t *pt = (uint64_t *)(uintptr_t)(*pde & PTE_ADDR_MASK);
+    return &pt[(off >> 12) & 0x1FFULL];
+}
+
+static int app_map_page(task_t *t, uint64_t vaddr, uint64_t frame) {
+    uint64_t *pte = app_pte(t->page_tables, vaddr, 1);
+    if (!pte) return 0;
+    *pte = frame | PTE_PRESENT | PTE_WRITE;
+    t->app_pages++;
+    return 1;
+}
+
+// Frees one page of the app window; the caller flushes the TLB.
+static void app_unmap_page(task_t *t, uint64_t vaddr) {
+    uint64_t *pte = app_pte(t->page_tables, vaddr, 0);
+    if (!pte || !(*pte & PTE_PRESENT)) return;
+    pmm_free_frames(*pte & PTE_ADDR_MASK, 1);
+    *pte = 0;
+    t->app_pages--;
+}
+
+// Frees every page and page table of the app window.
+static void app_unmap_all(task_t *t) {
+    uint64_t *pd = app_pd(t->page_tables);
+    for (uint64_t i = 0; i < APP_PT_COUNT; ++i) {
+        uint64_t pde = pd[APP_PD_FIRST + i];
+        if (!(pde & PTE_PRESENT)) continue;
+        uint64_t *pt = (uint64_t *)(uintptr_t)(pde & PTE_ADDR_MASK);
+        for (int j = 0; j < 512; ++j) {
+            if (pt[j] & PTE_PRESENT) pmm_free_frames(pt[j] & PTE_ADDR_MASK, 1);
+        }
+        pmm_free_frames(pde & PTE_ADDR_MASK, 1);
+        pd[APP_PD_FIRST + i] = 0;
+    }
+    t->app_pages = 0;
 }
 
-static uint64_t alloc_app_region_2mib(void) {
-    void *p = kmem_alloc(APP_REGION_SIZE, APP_REGION_SIZE);
-    kmem_memset(p, 0, APP_REGION_SIZE);
-    return (uint64_t)(uintptr_t)p;
+// Copies the image into freshly mapped pages; the rest of the window is demand-zero.
+static int app_load_image(task_t *t, const uint8_t *image, uint32_t image_size) {
+    for (uint32_t off = 0; off < image_size; off += (uint32_t)PAGE_SIZE) {
+        uint64_t frame = pmm_alloc_frames(1);
+        if (!frame) return 0;
+        uint32_t n = image_size - off;
+        if (n > PAGE_SIZE) n = (uint32_t)PAGE_SIZE;
+        kmem_memcpy((void *)(uintptr_t)frame, image + off, n);
+        if (n < PAGE_SIZE) kmem_memset((uint8_t *)(uintptr_t)frame + n, 0, PAGE_SIZE - n);
+        if (!app_map_page(t, MLJOS_APP_VADDR + off, frame)) {
+            pmm_free_frames(frame, 1);
+            return 0;
+        }
+    }
+    return 1;
 }
 
+static void task_wait_timeout(void *arg);
+static void task_app_timer_fire(void *arg);
+
 static void init_task_common(task_t *t, const char *name) {
     t->state = TASK_RUNNABLE;
     t->name = name;
@@ -125,23 +425,40 @@ static void init_task_common(task_t *t, const char *name) {
     t->window = NULL;
     t->console = NULL;
     t->fs_cwd = NULL;
-    t->shell_active_storage = 0;
-    t->shell_location = 1;
-    t->shell_launch_flags = 0;
-    t->shell_open_path[0] = '\0';
-    kmem_memset(t->shell_jmp_env, 0, sizeof(t->shell_jmp_env));
-    t->shell_jmp_ready = 0;
-    kmem_memset(t->shell_history, 0, sizeof(t->shell_history));
-    t->shell_history_count = 0;
-    t->shell_history_pos = -1;
+    kmem_memset(t->shell, 0, sizeof(*t->shell));
+    t->shell->location = 1;
+    t->shell->history_pos = -1;
     t->killed = 0;
+    t->stack = NULL;
+    t->page_tables = NULL;
+    t->app_pages = 0;
+    t->slice_ticks = 0;
+    // Tasks start under the kernel lock so their creator can finish setting them up.
+    t->lock_depth = 1;
+    t->tlb_gen = 0;
+    t->api_gate = NULL;
+    t->cpu = 0;
+    t->rq_next = NULL;
+    t->parked = 0;
+    t->wait_on = NULL;
+    t->wait_next = NULL;
+    ktimer_setup(&t->wake_timer, task_wait_timeout, t);
+    ktimer_setup(&t->app_timer, task_app_timer_fire, t);
+    t->app_timer_fired = 0;
+    t->chan_held = 0;
+    kmem_memset(t->shm_slot, 0, sizeof(t->shm_slot));
+    t->run_tsc = 0;
+    t->stretch_tsc = 0;
+    t->max_stretch_tsc = 0;
+    t->last_out_tsc = cpu_rdtsc();
+    t->switches = 0;
+    t->preemptions = 0;
     kmem_memset(&t->ctx, 0, sizeof(t->ctx));
     kmem_memset(&t->api, 0, sizeof(t->api));
 }
 
 static void init_task_stack(task_t *t, void (*start_rip)(void)) {
-    uint8_t *stack = (uint8_t *)kmem_alloc(TASK_STACK_SIZE, 16);
-    uintptr_t top = (uintptr_t)stack + TASK_STACK_SIZE;
+    uintptr_t top = (uintptr_t)t->stack + TASK_STACK_SIZE;
     // Fake return address so that RSP%16==8 at function entry.
     top -= 8;
     *(uint64_t *)top = 0;
@@ -149,53 +466,289 @@ static void init_task_stack(task_t *t, void (*start_rip)(void)) {
     t->ctx.rip = (uint64_t)(uintptr_t)start_rip;
 }
 
+// PCID 0 belongs to the kernel address space; tasks use their id.
+static uint16_t task_pcid(const task_t *t) {
+    return (uint16_t)t->id;
+}
+
+// Called on the kernel CR3 right before `t` is switched in. Drops translations this CPU may
+// still hold for the task's PCID from an older generation. Without PCIDs every CR3 load
+// flushes, so there is nothing to do.
+static void task_tlb_sync(cpu_local_t *cpu, task_t *t) {
+    if (!cpu_pcid_enabled()) return;
+    uint32_t *seen = &g_pcid_gen[cpu->index][t->id];
+    if (*seen == t->tlb_gen) return;
+    if (cpu_has_invpcid()) cpu_invpcid_single(task_pcid(t));
+    else cpu_flush_tlb_all();
+    *seen = t->tlb_gen;
+}
+
+static void task_space_free(task_space_t *sp) {
+    kmem_free(sp->stack);
+    if (sp->page_tables) pmm_free_frames((uint64_t)(uintptr_t)sp->page_tables, 6);
+}
+
+static void wq_unlink(wait_queue_t *wq, task_t *t);
+
+static void task_release(task_t *t) {
+    task_space_t sp;
+    // A task that died inside a wait (an exception in kernel code) is still linked.
+    ktimer_cancel(&t->wake_timer);
+    ktimer_cancel(&t->app_timer);
+    chan_release_all(t);
+    shm_release_all(t);
+    if (t->wait_on) {
+        wait_queue_t *wq = t->wait_on;
+        uint64_t flags = spin_lock_irqsave(&wq->lock);
+        wq_unlink(wq, t);
+        spin_unlock_irqrestore(&wq->lock, flags);
+    }
+    // Stale translations are dropped lazily: the next task in this slot gets a new TLB
+    // generation, so every CPU flushes the PCID before running it.
+    if (t->page_tables) app_unmap_all(t);
+    sp.stack = t->stack;
+    sp.page_tables = t->page_tables;
+    if (sp.stack && sp.page_tables && g_task_pool_count < TASK_POOL_MAX) {
+        g_task_pool[g_task_pool_count++] = sp;
+    } else {
+        task_space_free(&sp);
+    }
+    kmem_free(t->console);
+    kmem_free(t->api_gate);
+    t->api_gate = NULL;
+    t->stack = NULL;
+    t->page_tables = NULL;
+    t->console = NULL;
+    t->window = NULL;
+    kmem_free(t->shell);
+    t->shell = NULL;
+    task_id_free(t->id);
+    t->id = 0;
+    t->state = TASK_UNUSED;
+    t->rq_next = g_task_free;
+    g_task_free = t;
+}
+
+// Sets up the address space shared by kernel and app tasks, reusing a pooled one when possible.
+// On failure the slot is handed back untouched.
+static int init_task_memory(task_t *t, void (*start_rip)(void), const void *image, uint32_t image_size) {
+    task_space_t sp;
+    if (g_task_pool_count > 0) {
+        sp = g_task_pool[--g_task_pool_count];
+    } else {
+        sp.page_tables = clone_page_tables(&t->ctx.cr3);
+        sp.stack = kmem_alloc(TASK_STACK_SIZE, 16);
+        if (!sp.page_tables || !sp.stack) {
+            task_space_free(&sp);
+            task_release(t);
+            return 0;
+        }
+    }
+    t->stack = sp.stack;
+    t->page_tables = sp.page_tables;
+    t->ctx.cr3 = (uint64_t)(uintptr_t)sp.page_tables;
+    if (cpu_pcid_enabled()) t->ctx.cr3 |= task_pcid(t);
+    t->tlb_gen = ++g_tlb_gen;
+
+    if (image && !app_load_image(t, (const uint8_t *)image, image_size)) {
+        task_release(t);
+        return 0;
+    }
+    init_task_stack(t, start_rip);
+    return 1;
+}
+
+void task_pool_scrub(void) {
+    for (int i = 0; i < ZERO_POOL_BATCH && g_zero_count < ZERO_POOL_MAX; ++i) {
+        uint64_t f = pmm_alloc_frames(1);
+        if (!f) return;
+        kmem_memset((void *)(uintptr_t)f, 0, PAGE_SIZE);
+        uint64_t flags = spin_lock_irqsave(&g_zero_lock);
+        int stored = g_zero_count < ZERO_POOL_MAX;
+        if (stored) g_zero_frames[g_zero_count++] = f;
+        spin_unlock_irqrestore(&g_zero_lock, flags);
+        if (!stored) {
+            pmm_free_frames(f, 1);
+            return;
+        }
+    }
+}
+
+int task_handle_page_fault(uint64_t addr, uint64_t error_code) {
+    task_t *t = task_current();
+    // Only not-present faults inside the current task's app window are demand faults.
+    if (!t || !t->page_tables || (error_code & 1)) return 0;
+    if (addr < MLJOS_APP_VADDR || addr >= MLJOS_APP_VADDR + MLJOS_APP_MAX_SIZE) return 0;
+
+    uint64_t page = addr & ~(PAGE_SIZE - 1);
+    uint64_t frame = alloc_zero_frame();
+    if (!frame) return 0;
+    if (!app_map_page(t, page, frame)) {
+        pmm_free_frames(frame, 1);
+        return 0;
+    }
+    invlpg(page);
+    return 1;
+}
+
+void task_shm_map(task_t *t, uint32_t slot, const uint64_t *pts, uint32_t count) {
+    uint64_t *pd = app_pd(t->page_tables);
+    // Not-present entries are never cached, so filling them in needs no flush.
+    for (uint32_t i = 0; i < count; ++i) pd[SHM_PD_FIRST + slot + i] = pts[i] | PTE_PRESENT | PTE_WRITE;
+}
+
+void task_shm_unmap(task_t *t, uint32_t slot, uint32_t count) {
+    uint64_t *pd = app_pd(t->page_tables);
+    for (uint32_t i = 0; i < count; ++i) pd[SHM_PD_FIRST + slot + i] = 0;
+    // Same as task_reset_app_space(): flush here, other CPUs catch up through the generation.
+    t->tlb_gen = ++g_tlb_gen;
+    if (t == task_current()) {
+        write_cr3(read_cr3());
+        g_pcid_gen[smp_this_cpu()->index][t->id] = t->tlb_gen;
+    }
+}
+
+int task_reset_app_space(void) {
+    task_t *t = task_current();
+    if (!t || !t->page_tables) return 0;
+    app_unmap_all(t);
+    // Unmapped entries may still be cached; reloading CR3 without the no-flush bit drops them
+    // (only for this task's PCID when PCIDs are on). CPUs the task ran on earlier catch up
+    // through the new generation.
+    write_cr3(read_cr3());
+    t->tlb_gen = ++g_tlb_gen;
+    g_pcid_gen[smp_this_cpu()->index][t->id] = t->tlb_gen;
+    return 1;
+}
+
 void task_init(void) {
     kmem_init();
     g_kernel_cr3 = read_cr3();
-    kmem_memset(&g_kernel_ctx, 0, sizeof(g_kernel_ctx));
-    for (int i = 0; i < MAX_TASKS; ++i) {
-        g_tasks[i].state = TASK_UNUSED;
-    }
-    g_current = NULL;
-    g_rr_pos = 0;
+    g_cr3_noflush = cpu_pcid_enabled() ? CR3_NOFLUSH : 0;
 }
 
 task_t *task_current(void) {
-    return g_current;
+    return smp_this_cpu()->current;
 }
 
 mljos_api_t *task_current_api(void) {
-    if (!g_current) return NULL;
-    return &g_current->api;
+    task_t *t = task_current();
+    if (!t) return NULL;
+    return &t->api;
+}
+
+void kernel_lock(void) {
+    task_t *t = task_current();
+    if (t && t->lock_depth++ > 0) return;
+    spin_lock(&g_kernel_lock);
+}
+
+void kernel_unlock(void) {
+    task_t *t = task_current();
+    if (t && --t->lock_depth > 0) return;
+    spin_unlock(&g_kernel_lock);
+}
+
+// Caller holds cpu->rq_lock.
+static void rq_append_locked(cpu_local_t *cpu, task_t *t) {
+    t->rq_next = NULL;
+    if (cpu->rq_tail) cpu->rq_tail->rq_next = t;
+    else cpu->rq_head = t;
+    cpu->rq_tail = t;
+    cpu->rq_count++;
+    t->cpu = cpu->index;
+    t->parked = 0;
+}
+
+static void rq_push(cpu_local_t *cpu, task_t *t) {
+    uint64_t flags = spin_lock_irqsave(&cpu->rq_lock);
+    rq_append_locked(cpu, t);
+    spin_unlock_irqrestore(&cpu->rq_lock, flags);
+}
+
+// Takes the oldest runnable task off the queue. Tasks paused while they were queued are
+// parked on the way, so each one costs a single pop.
+static task_t *rq_pop(cpu_local_t *cpu) {
+    task_t *t;
+    uint64_t flags = spin_lock_irqsave(&cpu->rq_lock);
+    while ((t = cpu->rq_head) != NULL) {
+        cpu->rq_head = t->rq_next;
+        if (!cpu->rq_head) cpu->rq_tail = NULL;
+        cpu->rq_count--;
+        t->rq_next = NULL;
+        if (t->state == TASK_RUNNABLE) break;
+        t->parked = 1;
+    }
+    spin_unlock_irqrestore(&cpu->rq_lock, flags);
+    return t;
+}
+
+// Work stealing: takes the oldest runnable task from the CPU with the longest queue.
+static task_t *rq_steal(cpu_local_t *self) {
+    cpu_local_t *victim = NULL;
+    for (uint32_t i = 0; i < SMP_MAX_CPUS; ++i) {
+        cpu_local_t *c = smp_cpu(i);
+        if (!c || c == self || c->rq_count == 0) continue;
+        if (!victim || c->rq_count > victim->rq_count) victim = c;
+    }
+    if (!victim) return NULL;
+    task_t *found = rq_pop(victim);
+    if (found) self->steals++;
+    return found;
+}
+
+// Puts a task that just switched out back on `cpu`'s queue, or parks it. Serialised with
+// task_make_runnable() by the queue lock, so a wake-up racing with the switch is not lost.
+static void rq_requeue(cpu_local_t *cpu, task_t *t) {
+    uint64_t flags = spin_lock_irqsave(&cpu->rq_lock);
+    if (t->state == TASK_RUNNABLE) rq_append_locked(cpu, t);
+    else t->parked = 1;
+    spin_unlock_irqrestore(&cpu->rq_lock, flags);
+}
+
+// `from` -> RUNNABLE; a parked task goes back on the queue of the CPU it last ran on.
+static int task_make_runnable(task_t *t, task_state_t from) {
+    cpu_local_t *cpu = smp_cpu(t->cpu);
+    if (!cpu) return 0;
+    uint64_t flags = spin_lock_irqsave(&cpu->rq_lock);
+    int ok = __atomic_compare_exchange_n(&t->state, &from, TASK_RUNNABLE, 0,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    if (ok && t->parked) rq_append_locked(cpu, t);
+    spin_unlock_irqrestore(&cpu->rq_lock, flags);
+    return ok;
+}
+
+// New tasks go to the online CPU with the shortest queue.
+static void task_enqueue_new(task_t *t) {
+    cpu_local_t *best = smp_this_cpu();
+    for (uint32_t i = 0; i < SMP_MAX_CPUS; ++i) {
+        cpu_local_t *c = smp_cpu(i);
+        if (c && c->rq_count < best->rq_count) best = c;
+    }
+    rq_push(best, t);
 }
 
 task_t *task_create_kernel(const char *name, task_entry_t entry, void *arg) {
-    task_t *t = task_alloc_slot();
+    task_t *t = task_alloc();
     if (!t) return NULL;
     init_task_common(t, name);
-
-    uint64_t region = alloc_app_region_2mib();
-    clone_page_tables(&t->ctx.cr3, region);
+    if (!init_task_memory(t, task_trampoline, NULL, 0)) return NULL;
 
     t->entry = entry;
     t->arg = arg;
-    init_task_stack(t, task_trampoline);
+    task_enqueue_new(t);
     return t;
 }
 
 task_t *task_create_app(const char *name, const void *image, uint32_t image_size) {
     if (!image || image_size == 0) return NULL;
-    if (image_size > (uint32_t)APP_REGION_SIZE) return NULL;
+    if (image_size > (uint32_t)MLJOS_APP_MAX_SIZE) return NULL;
 
-    task_t *t = task_alloc_slot();
+    task_t *t = task_alloc();
     if (!t) return NULL;
     init_task_common(t, name);
-
-    uint64_t region = alloc_app_region_2mib();
-    kmem_memcpy((void *)(uintptr_t)region, image, image_size);
-    clone_page_tables(&t->ctx.cr3, region);
-
-    init_task_stack(t, app_trampoline);
+    if (!init_task_memory(t, app_trampoline, image, image_size)) return NULL;
+    task_enqueue_new(t);
     return t;
 }
 
@@ -209,52 +762,342 @@ void task_attach_console(task_t *t, console_t *c) {
     t->console = c;
 }
 
+// BLOCKED -> RUNNABLE, then pokes the owning CPU out of HLT. Paused and dead tasks stay as
+// they are.
+static void task_wake(task_t *t) {
+    if (task_make_runnable(t, TASK_BLOCKED)) smp_kick(t->cpu);
+}
+
+// Timer wheel callbacks (timer IRQ).
+static void task_wait_timeout(void *arg) {
+    task_wake((task_t *)arg);
+}
+
+static void task_app_timer_fire(void *arg) {
+    task_t *t = (task_t *)arg;
+    __atomic_add_fetch(&t->app_timer_fired, 1, __ATOMIC_RELEASE);
+    task_wake(t);
+}
+
+static void wq_unlink(wait_queue_t *wq, task_t *t) {
+    task_t **pp = &wq->head;
+    while (*pp && *pp != t) pp = &(*pp)->wait_next;
+    if (*pp) *pp = t->wait_next;
+    t->wait_next = NULL;
+    t->wait_on = NULL;
+}
+
+void task_wait_prepare(wait_queue_t *wq, uint32_t timeout_ticks) {
+    task_t *t = task_current();
+    if (!t) return;
+    if (timeout_ticks) ktimer_arm(&t->wake_timer, timer_ticks() + timeout_ticks, 0);
+    else if (t->wake_timer.armed) ktimer_cancel(&t->wake_timer);
+    if (wq && t->wait_on != wq) {
+        uint64_t flags = spin_lock_irqsave(&wq->lock);
+        t->wait_next = wq->head;
+        wq->head = t;
+        t->wait_on = wq;
+        spin_unlock_irqrestore(&wq->lock, flags);
+    }
+    // A pause or kill that already happened wins over blocking.
+    task_state_t expected = TASK_RUNNABLE;
+    __atomic_compare_exchange_n(&t->state, &expected, TASK_BLOCKED, 0,
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+void task_wait_finish(wait_queue_t *wq) {
+    task_t *t = task_current();
+    if (!t) return;
+    task_state_t expected = TASK_BLOCKED;
+    __atomic_compare_exchange_n(&t->state, &expected, TASK_RUNNABLE, 0,
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    if (wq && t->wait_on == wq) {
+        uint64_t flags = spin_lock_irqsave(&wq->lock);
+        wq_unlink(wq, t);
+        spin_unlock_irqrestore(&wq->lock, flags);
+    }
+    if (t->wake_timer.armed) ktimer_cancel(&t->wake_timer);
+}
+
+void wait_queue_wake_all(wait_queue_t *wq) {
+    if (!wq) return;
+    uint64_t flags = spin_lock_irqsave(&wq->lock);
+    while (wq->head) {
+        task_t *t = wq->head;
+        wq->head = t->wait_next;
+        t->wait_next = NULL;
+        t->wait_on = NULL;
+        task_wake(t);
+    }
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+void task_sleep_ticks(uint32_t ticks) {
+    uint64_t end = timer_ticks() + ticks;
+    task_t *t = task_current();
+    while (timer_ticks() < end) {
+        if (!t) {
+            __asm__ volatile ("pause");
+            continue;
+        }
+        if (t->killed) return;
+        task_wait_prepare(NULL, (uint32_t)(end - timer_ticks()));
+        if (timer_ticks() < end) task_yield();
+        task_wait_finish(NULL);
+    }
+}
+
+void task_sleep_ms(uint32_t ms) {
+    task_sleep_ticks((uint32_t)(((uint64_t)ms * TIMER_HZ + 999) / 1000));
+}
+
+int task_set_timer(uint32_t interval_ms) {
+    task_t *t = task_current();
+    if (!t) return 0;
+    if (!interval_ms) {
+        ktimer_cancel(&t->app_timer);
+        t->app_timer_fired = 0;
+        return 1;
+    }
+    uint32_t ticks = (uint32_t)(((uint64_t)interval_ms * TIMER_HZ + 999) / 1000);
+    ktimer_arm(&t->app_timer, timer_ticks() + ticks, ticks);
+    return 1;
+}
+
+uint32_t task_take_timer_expirations(task_t *t) {
+    if (!t || !t->app_timer_fired) return 0;
+    return __atomic_exchange_n(&t->app_timer_fired, 0, __ATOMIC_ACQ_REL);
+}
+
 void task_set_paused(task_t *t, int paused) {
     if (!t) return;
-    if (t->state == TASK_DEAD || t->state == TASK_UNUSED) return;
-    t->state = paused ? TASK_PAUSED : TASK_RUNNABLE;
+    if (!paused) {
+        (void)task_make_runnable(t, TASK_PAUSED);
+        return;
+    }
+    // Running or queued tasks notice on their next switch / pop; blocked ones stay parked.
+    task_state_t s = t->state;
+    while (s == TASK_RUNNABLE || s == TASK_BLOCKED) {
+        if (__atomic_compare_exchange_n(&t->state, &s, TASK_PAUSED, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            break;
+        }
+    }
 }
 
 int task_is_alive(const task_t *t) {
     if (!t) return 0;
-    return t->state == TASK_RUNNABLE || t->state == TASK_PAUSED;
+    return t->state == TASK_RUNNABLE || t->state == TASK_PAUSED || t->state == TASK_BLOCKED;
+}
+
+void task_set_quantum_ms(uint32_t ms) {
+    uint32_t ticks = ms * TIMER_HZ / 1000;
+    g_quantum_ticks = ticks ? ticks : 1;
+}
+
+uint32_t task_get_quantum_ms(void) {
+    return g_quantum_ticks * 1000 / TIMER_HZ;
+}
+
+void task_timer_tick(interrupt_frame_t *frame) {
+    cpu_local_t *cpu = smp_this_cpu();
+    task_t *t = cpu->current;
+    if (!t || t->state != TASK_RUNNABLE) return;
+    int in_app = frame->rip >= MLJOS_APP_VADDR && frame->rip < MLJOS_APP_VADDR + MLJOS_APP_MAX_SIZE;
+    // An app that never yields would never notice task_kill(); end it from here instead.
+    if (t->killed && in_app) task_exit();
+    if (++t->slice_ticks < g_quantum_ticks || !in_app) return;
+    // The interrupt frame on this task's stack already holds every register the app was
+    // using; ctx_switch adds the callee-saved ones and the resume point inside this handler.
+    t->preemptions++;
+    ctx_switch(&t->ctx, &cpu->kernel_ctx, g_cr3_noflush);
 }
 
 void task_kill(task_t *t) {
     if (!t) return;
     t->killed = 1;
-    if (t->state == TASK_PAUSED) t->state = TASK_RUNNABLE;
+    (void)task_make_runnable(t, TASK_PAUSED);
+    // Blocked tasks notice the kill once they run again.
+    task_wake(t);
 }
 
 void task_yield(void) {
-    if (!g_current) return;
-    ctx_switch(&g_current->ctx, &g_kernel_ctx);
-    // On resume, continue.
+    cpu_local_t *cpu = smp_this_cpu();
+    if (!cpu->current) return;
+    ctx_switch(&cpu->current->ctx, &cpu->kernel_ctx, g_cr3_noflush);
+    // On resume (possibly on another CPU), continue.
 }
 
 __attribute__((noreturn)) void task_exit(void) {
-    if (g_current) {
-        g_current->state = TASK_DEAD;
-        wm_on_task_exit(g_current);
-    }
-    // Switch back to kernel.
-    if (g_current) {
-        ctx_switch(&g_current->ctx, &g_kernel_ctx);
+    cpu_local_t *cpu = smp_this_cpu();
+    task_t *t = cpu->current;
+    if (t) {
+        // Apps get here straight from app code (or the timer tick) without the kernel lock.
+        kernel_lock();
+        t->state = TASK_DEAD;
+        wm_on_task_exit(t);
+        // Switch back to kernel.
+        ctx_switch(&t->ctx, &cpu->kernel_ctx, g_cr3_noflush);
     }
     for (;;) { }
 }
 
-void task_schedule_once(void) {
-    // Round-robin runnable tasks.
-    for (int n = 0; n < MAX_TASKS; ++n) {
-        g_rr_pos = (g_rr_pos + 1) % MAX_TASKS;
-        task_t *t = &g_tasks[g_rr_pos];
-        if (t->state != TASK_RUNNABLE) continue;
-        g_current = t;
-        ctx_switch(&g_kernel_ctx, &t->ctx);
-        g_current = NULL;
-        // Restore kernel CR3 in case task switched away (ctx_switch restores it).
-        write_cr3(g_kernel_cr3);
-        return;
+int task_list(task_info_t *out, int max) {
+    int n = 0;
+    uint64_t now = cpu_rdtsc();
+    for (task_t *t = g_task_all; t && n < max; t = t->all_next) {
+        task_state_t state = t->state;
+        if (state == TASK_UNUSED) continue;
+        task_info_t *info = &out[n++];
+        info->id = t->id;
+        int i = 0;
+        while (t->name && t->name[i] && i < (int)sizeof(info->name) - 1) {
+            info->name[i] = t->name[i];
+            i++;
+        }
+        info->name[i] = '\0';
+        info->state = state;
+        info->cpu = t->cpu;
+        // Read once: the task may be switching on another CPU meanwhile.
+        uint64_t start = t->stretch_tsc;
+        info->running = start != 0;
+        info->run_tsc = t->run_tsc;
+        info->max_stretch_tsc = t->max_stretch_tsc;
+        info->stretch_tsc = now - (start ? start : t->last_out_tsc);
+        if (info->running) {
+            info->run_tsc += info->stretch_tsc;
+            if (info->stretch_tsc > info->max_stretch_tsc) info->max_stretch_tsc = info->stretch_tsc;
+        }
+        info->switches = t->switches;
+        info->preemptions = t->preemptions;
     }
+    return n;
+}
+
+uint64_t task_sched_overhead_tsc(void) {
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < SMP_MAX_CPUS; ++i) {
+        cpu_local_t *c = smp_cpu(i);
+        if (c) total += c->sched_tsc;
+    }
+    return total;
+}
+
+int task_any_runnable(void) {
+    for (uint32_t i = 0; i < SMP_MAX_CPUS; ++i) {
+        cpu_local_t *c = smp_cpu(i);
+        if (c && c->rq_count) return 1;
+    }
+    return 0;
+}
+
+int task_schedule_once(void) {
+    cpu_local_t *cpu = smp_this_cpu();
+    uint64_t enter = cpu_rdtsc();
+    task_t *t = rq_pop(cpu);
+    if (!t) t = rq_steal(cpu);
+    if (!t) {
+        cpu->sched_tsc += cpu_rdtsc() - enter;
+        return 0;
+    }
+
+    // A task that stopped inside kernel code (or has not started yet) resumes under the
+    // kernel lock; the lock is dropped on its behalf whenever it switches out.
+    if (t->lock_depth) spin_lock(&g_kernel_lock);
+    task_tlb_sync(cpu, t);
+    t->cpu = cpu->index;
+    cpu->current = t;
+    t->slice_ticks = 0;
+    t->switches++;
+    uint64_t start = cpu_rdtsc();
+    t->stretch_tsc = start;
+    fpu_switch_in(cpu, t);
+    ctx_switch(&cpu->kernel_ctx, &t->ctx, g_cr3_noflush);
+    fpu_switch_out(cpu, t);
+    uint64_t end = cpu_rdtsc();
+    uint64_t ran = end - start;
+    t->stretch_tsc = 0;
+    t->last_out_tsc = end;
+    t->run_tsc += ran;
+    if (ran > t->max_stretch_tsc) t->max_stretch_tsc = ran;
+    cpu->busy_tsc += ran;
+    cpu->switches++;
+    cpu->current = NULL;
+    if (t->lock_depth) spin_unlock(&g_kernel_lock);
+    // Preemption and faults switch back from interrupt context with IF clear.
+    cpu_sti();
+
+    // Back on the kernel stack and CR3, so a task that exited can be torn down.
+    if (t->state == TASK_DEAD) {
+        kernel_lock();
+        task_release(t);
+        kernel_unlock();
+    } else {
+        rq_requeue(cpu, t);
+    }
+    cpu->sched_tsc += cpu_rdtsc() - enter - ran;
+    return 1;
+}
+
+static task_context_t g_bench_home;
+static task_context_t g_bench_kernel;
+static uint64_t g_bench_cr3_bits;
+
+static void bench_partner(void) __attribute__((noreturn));
+static void bench_partner(void) {
+    for (;;) ctx_switch(&g_bench_kernel, &g_bench_home, g_bench_cr3_bits);
+}
+
+uint64_t task_bench_switch(uint32_t rounds, uint32_t touch_pages, int no_flush) {
+    task_t *t = task_current();
+    if (!t || !t->page_tables || rounds == 0) return 0;
+    if (touch_pages > BENCH_MAX_PAGES) touch_pages = BENCH_MAX_PAGES;
+    uint8_t *stack = (uint8_t *)kmem_alloc(BENCH_STACK_SIZE, 16);
+    if (!stack) return 0;
+
+    // Partner side runs on the kernel address space, like the scheduler loop does.
+    kmem_memset(&g_bench_kernel, 0, sizeof(g_bench_kernel));
+    g_bench_kernel.rsp = (uint64_t)(uintptr_t)(stack + BENCH_STACK_SIZE - 8);
+    g_bench_kernel.rip = (uint64_t)(uintptr_t)bench_partner;
+    g_bench_kernel.cr3 = g_kernel_cr3;
+
+    // Pages at the top of the app window stand in for the app's working set; each round
+    // reads them so a flushed TLB has to walk the page tables again. Pages the app has not
+    // touched are mapped for the run only; the app's own pages are read, never written.
+    uint64_t ws_base = MLJOS_APP_VADDR + MLJOS_APP_MAX_SIZE - BENCH_MAX_PAGES * PAGE_SIZE;
+    volatile uint8_t *ws = (volatile uint8_t *)(uintptr_t)ws_base;
+    uint64_t scratch = 0;
+    for (uint32_t p = 0; p < touch_pages; ++p) {
+        uint64_t *pte = app_pte(t->page_tables, ws_base + p * PAGE_SIZE, 0);
+        if (pte && (*pte & PTE_PRESENT)) continue;
+        uint64_t frame = alloc_zero_frame();
+        if (!frame || !app_map_page(t, ws_base + p * PAGE_SIZE, frame)) {
+            if (frame) pmm_free_frames(frame, 1);
+            touch_pages = p;
+            break;
+        }
+        scratch |= 1ULL << p;
+    }
+
+    uint64_t cr3_bits = (no_flush && cpu_pcid_enabled()) ? CR3_NOFLUSH : 0;
+    g_bench_cr3_bits = cr3_bits;
+    uint64_t start = cpu_rdtsc();
+    for (uint32_t r = 0; r < rounds; ++r) {
+        ctx_switch(&g_bench_home, &g_bench_kernel, cr3_bits);
+        for (uint32_t p = 0; p < touch_pages; ++p) (void)ws[p * PAGE_SIZE];
+    }
+    uint64_t cycles = cpu_rdtsc() - start;
+
+    if (scratch) {
+        for (uint32_t p = 0; p < BENCH_MAX_PAGES; ++p) {
+            if (scratch & (1ULL << p)) app_unmap_page(t, ws_base + p * PAGE_SIZE);
+        }
+        // Same flush as task_reset_app_space().
+        write_cr3(read_cr3());
+        t->tlb_gen = ++g_tlb_gen;
+        g_pcid_gen[smp_this_cpu()->index][t->id] = t->tlb_gen;
+    }
+
+    kmem_free(stack);
+    return cycles / rounds;
 }
@@ -0,0 +1,241 @@
+#include "taskmgr_app.h"
+
+#include "kmem.h"
+#include "kstring.h"
+#include "smp.h"
+#include "task.h"
+#include "timer.h"
+#include "ui.h"
+#include "wm.h"
+
+#define TASKMGR_W 600
+#define TASKMGR_H 380
+#define TASKMGR_ROW_PX 18
+#define TASKMGR_PAD 8
+#define TASKMGR_LINE_MAX 80
+#define TASKMGR_REFRESH_TICKS (TIMER_HZ / 2)
+
+#define COL_BG     0x1A1B1E
+#define COL_HEADER 0x2A2D33
+#define COL_TEXT   0xE6E6E6
+#define COL_DIM    0x9AA0A6
+#define COL_HOT    0xFFB454
+
+static task_t *g_taskmgr_task = NULL;
+static wm_window_t *g_taskmgr_window = NULL;
+
+typedef struct taskmgr_state {
+    task_info_t *tasks;
+    uint64_t *prev_run;       // run_tsc per task id at the previous sample
+    uint64_t prev_tsc;
+    uint64_t prev_sched;
+    int rows;                 // rows that fit the window
+    // What each row shows on screen right now; only rows whose text changes are repainted.
+    char (*drawn)[TASKMGR_LINE_MAX];
+    uint32_t *drawn_color;
+} taskmgr_state_t;
+
+static void line_puts(char *line, int *pos, const char *s) {
+    while (*s && *pos < TASKMGR_LINE_MAX - 1) line[(*pos)++] = *s++;
+    line[*pos] = '\0';
+}
+
+// Right-aligns `v` in `width` columns.
+static void line_uint(char *line, int *pos, uint32_t v, int width) {
+    char buf[11];
+    int n = 10;
+    buf[n] = '\0';
+    do {
+        buf[--n] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v && n > 0);
+    for (int i = 10 - n; i < width && *pos < TASKMGR_LINE_MAX - 1; ++i) line[(*pos)++] = ' ';
+    line_puts(line, pos, &buf[n]);
+}
+
+static uint32_t cycles_to_ms(uint64_t cycles) {
+    uint64_t per_ms = timer_tsc_per_ms();
+    return per_ms ? (uint32_t)(cycles / per_ms) : 0;
+}
+
+static const char *state_name(const task_info_t *info) {
+    if (info->running) return "running";
+    switch (info->state) {
+    case TASK_RUNNABLE: return "ready";
+    case TASK_PAUSED: return "paused";
+    case TASK_BLOCKED: return "blocked";
+    case TASK_DEAD: return "dead";
+    default: return "?";
+    }
+}
+
+static void draw_row(taskmgr_state_t *st, int row, const char *text, uint32_t color) {
+    if (row >= st->rows) return;
+    if (st->drawn_color[row] == color && strcmp(st->drawn[row], text) == 0) return;
+    mljos_ui_api_t *ui = ui_api();
+    int y = TASKMGR_PAD + row * TASKMGR_ROW_PX;
+    ui->fill_rect(0, y, (int)ui->screen_w(), TASKMGR_ROW_PX, row == 1 ? COL_HEADER : COL_BG);
+    ui->draw_text(text, TASKMGR_PAD, y + 1, color);
+    int i = 0;
+    while (text[i] && i < TASKMGR_LINE_MAX - 1) {
+        st->drawn[row][i] = text[i];
+        i++;
+    }
+    st->drawn[row][i] = '\0';
+    st->drawn_color[row] = color;
+}
+
+// Sizes the row buffers to the window height. The old buffers are kept if the new ones
+// cannot be allocated. Returns 0 only if there are none at all.
+static int fit_rows(taskmgr_state_t *st) {
+    int rows = ((int)ui_api()->screen_h() - TASKMGR_PAD * 2) / TASKMGR_ROW_PX;
+    if (rows < 2) rows = 2;
+    if (rows == st->rows && st->drawn) return 1;
+    char (*drawn)[TASKMGR_LINE_MAX] = (char (*)[TASKMGR_LINE_MAX])kmem_alloc((uint64_t)rows * TASKMGR_LINE_MAX, 16);
+    uint32_t *drawn_color = (uint32_t *)kmem_alloc(sizeof(uint32_t) * (uint64_t)rows, 16);
+    if (!drawn || !drawn_color) {
+        kmem_free(drawn);
+        kmem_free(drawn_color);
+        return st->drawn != NULL;
+    }
+    kmem_free(st->drawn);
+    kmem_free(st->drawn_color);
+    st->drawn = drawn;
+    st->drawn_color = drawn_color;
+    st->rows = rows;
+    return 1;
+}
+
+// Forgets what is on screen (after an expose) and clears the window.
+static void invalidate(taskmgr_state_t *st) {
+    mljos_ui_api_t *ui = ui_api();
+    ui->fill_rect(0, 0, (int)ui->screen_w(), (int)ui->screen_h(), COL_BG);
+    for (int i = 0; i < st->rows; ++i) {
+        st->drawn[i][0] = '\0';
+        st->drawn_color[i] = COL_BG;
+    }
+}
+
+static void refresh(taskmgr_state_t *st) {
+    int count = task_list(st->tasks, TASK_MAX_IDS);
+    uint64_t now = cpu_rdtsc();
+    uint64_t span = now - st->prev_tsc;
+    uint64_t sched = task_sched_overhead_tsc();
+    char line[TASKMGR_LINE_MAX];
+    int pos = 0;
+
+    line_uint(line, &pos, (uint32_t)count, 0);
+    line_puts(line, &pos, " tasks, ");
+    line_uint(line, &pos, smp_cpu_count(), 0);
+    line_puts(line, &pos, " CPUs, scheduler ");
+    uint32_t permille = span ? (uint32_t)((sched - st->prev_sched) * 1000 / span) : 0;
+    line_uint(line, &pos, permille / 10, 0);
+    line_puts(line, &pos, ".");
+    line_uint(line, &pos, permille % 10, 0);
+    line_puts(line, &pos, "% of a CPU");
+    draw_row(st, 0, line, COL_DIM);
+
+    pos = 0;
+    line_puts(line, &pos, "  ID CPU STATE    %CPU  TIME ms MAXRUN ms   SWITCH NAME");
+    draw_row(st, 1, line, COL_TEXT);
+
+    int row = 2;
+    for (int i = 0; i < count; ++i) {
+        const task_info_t *info = &st->tasks[i];
+        uint64_t before = st->prev_run[info->id];
+        uint64_t used = info->run_tsc >= before ? info->run_tsc - before : info->run_tsc;
+        st->prev_run[info->id] = info->run_tsc;
+        uint32_t load = span ? (uint32_t)(used * 100 / span) : 0;
+        if (row >= st->rows) continue;
+
+        const char *state = state_name(info);
+        pos = 0;
+        line_uint(line, &pos, info->id, 4);
+        line_uint(line, &pos, info->cpu, 4);
+        line_puts(line, &pos, " ");
+        line_puts(line, &pos, state);
+        for (int len = (int)strlen(state); len < 8; ++len) line_puts(line, &pos, " ");
+        line_uint(line, &pos, load, 5);
+        line_uint(line, &pos, cycles_to_ms(info->run_tsc), 9);
+        line_uint(line, &pos, cycles_to_ms(info->max_stretch_tsc), 10);
+        line_uint(line, &pos, info->switches, 9);
+        line_puts(line, &pos, " ");
+        line_puts(line, &pos, info->name);
+        // Highlight tasks that hold a CPU for long stretches without switching out.
+        uint32_t color = cycles_to_ms(info->max_stretch_tsc) >= 100 ? COL_HOT : COL_TEXT;
+        draw_row(st, row++, line, color);
+    }
+    for (; row < st->rows; ++row) draw_row(st, row, "", COL_BG);
+
+    st->prev_tsc = now;
+    st->prev_sched = sched;
+}
+
+static void taskmgr_main(void *arg) {
+    (void)arg;
+    task_t *self = task_current();
+    taskmgr_state_t st;
+    kmem_memset(&st, 0, sizeof(st));
+    st.tasks = (task_info_t *)kmem_alloc(sizeof(task_info_t) * TASK_MAX_IDS, 16);
+    st.prev_run = (uint64_t *)kmem_alloc(sizeof(uint64_t) * TASK_MAX_IDS, 16);
+    if (!fit_rows(&st) || !st.tasks || !st.prev_run) {
+        kmem_free(st.tasks);
+        kmem_free(st.prev_run);
+        kmem_free(st.drawn);
+        kmem_free(st.drawn_color);
+        task_exit();
+    }
+    kmem_memset(st.prev_run, 0, sizeof(uint64_t) * TASK_MAX_IDS);
+    st.prev_tsc = cpu_rdtsc();
+    st.prev_sched = task_sched_overhead_tsc();
+
+    invalidate(&st);
+    refresh(&st);
+    uint64_t next = timer_ticks() + TASKMGR_REFRESH_TICKS;
+    for (;;) {
+        // Closing the window kills the task: free the buffers before exiting.
+        if (self->killed) break;
+        mljos_ui_event_t ev;
+        while (wm_window_poll_event(self->window, &ev)) {
+            if (ev.type == MLJOS_UI_EVENT_EXPOSE) {
+                // Sent after a resize too: the window may fit a different number of rows.
+                (void)fit_rows(&st);
+                invalidate(&st);
+            }
+        }
+        uint64_t now = timer_ticks();
+        if (now >= next) {
+            refresh(&st);
+            next = now + TASKMGR_REFRESH_TICKS;
+            continue;
+        }
+        wm_window_wait_event(self->window, (uint32_t)(next - now));
+    }
+
+    kmem_free(st.tasks);
+    kmem_free(st.prev_run);
+    kmem_free(st.drawn);
+    kmem_free(st.drawn_color);
+    task_exit();
+}
+
+int taskmgr_spawn(void) {
+    if (task_is_alive(g_taskmgr_task) && g_taskmgr_task->window == g_taskmgr_window) {
+        wm_window_focus(g_taskmgr_window);
+        return 1;
+    }
+
+    wm_window_t *w = wm_window_create("Task Manager", TASKMGR_W, TASKMGR_H);
+    if (!w) return 0;
+    task_t *t = task_create_kernel("taskmgr", taskmgr_main, NULL);
+    if (!t) {
+        wm_window_destroy(w);
+        return 0;
+    }
+    task_attach_window(t, w);
+    wm_window_set_owner(w, t);
+    wm_window_focus(w);
+    g_taskmgr_task = t;
+    g_taskmgr_window = w;
+    return 1;
+}
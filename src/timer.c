@@ -0,0 +1,132 @@
+#include "timer.h"
+
+#include "cpu.h"
+#include "io.h"
+#include "kmem.h"
+#include "spinlock.h"
+#include "task.h"
+
+#define PIT_BASE_HZ 1193182U
+#define PIT_CH0     0x40
+#define PIT_CMD     0x43
+// TSC calibration window, in ticks: starts a little after boot so the first (partial) tick
+// periods do not count.
+#define TSC_CAL_FIRST 10
+#define TSC_CAL_TICKS 200
+// Timer wheel slots; must be a power of two. Timers further out than one turn stay in their
+// slot and are skipped until their turn comes.
+#define WHEEL_SLOTS 256
+
+static volatile uint64_t g_timer_ticks = 0;
+static uint64_t g_tsc_cal_start = 0;
+static volatile uint64_t g_tsc_per_ms = 0;
+// timer_now_ns() after calibration: g_ns_base at TSC g_tsc_base.
+static uint64_t g_tsc_base = 0;
+static uint64_t g_ns_base = 0;
+
+static ktimer_t *g_wheel[WHEEL_SLOTS];
+static uint64_t g_wheel_now = 0;      // last tick whose slot was run
+static spinlock_t g_wheel_lock = SPINLOCK_INIT;
+
+// Caller holds g_wheel_lock.
+static void wheel_link(ktimer_t *tm) {
+    ktimer_t **slot = &g_wheel[tm->expires & (WHEEL_SLOTS - 1)];
+    tm->prev = NULL;
+    tm->next = *slot;
+    if (*slot) (*slot)->prev = tm;
+    *slot = tm;
+    tm->armed = 1;
+}
+
+static void wheel_unlink(ktimer_t *tm) {
+    if (tm->prev) tm->prev->next = tm->next;
+    else g_wheel[tm->expires & (WHEEL_SLOTS - 1)] = tm->next;
+    if (tm->next) tm->next->prev = tm->prev;
+    tm->prev = NULL;
+    tm->next = NULL;
+    tm->armed = 0;
+}
+
+static void wheel_run(uint64_t now) {
+    spin_lock(&g_wheel_lock);
+    g_wheel_now = now;
+    ktimer_t *tm = g_wheel[now & (WHEEL_SLOTS - 1)];
+    while (tm) {
+        // Saved first: a periodic timer may be re-linked at the head of this very slot.
+        ktimer_t *next = tm->next;
+        if (tm->expires <= now) {
+            wheel_unlink(tm);
+            if (tm->period) {
+                tm->expires = now + tm->period;
+                wheel_link(tm);
+            }
+            tm->fn(tm->arg);
+        }
+        tm = next;
+    }
+    spin_unlock(&g_wheel_lock);
+}
+
+static void timer_irq(interrupt_frame_t *frame) {
+    g_timer_ticks++;
+    if (g_timer_ticks == TSC_CAL_FIRST) {
+        g_tsc_cal_start = cpu_rdtsc();
+    } else if (g_timer_ticks == TSC_CAL_FIRST + TSC_CAL_TICKS) {
+        uint64_t now = cpu_rdtsc();
+        uint64_t cycles = now - g_tsc_cal_start;
+        g_tsc_base = now;
+        g_ns_base = g_timer_ticks * (1000000ULL / TIMER_HZ);
+        __atomic_store_n(&g_tsc_per_ms, cycles * TIMER_HZ / (TSC_CAL_TICKS * 1000ULL), __ATOMIC_RELEASE);
+    }
+    // EOI first: the tick may switch away from this task and not come back for a while.
+    cpu_irq_eoi(0);
+    wheel_run(g_timer_ticks);
+    task_timer_tick(frame);
+}
+
+void timer_init(void) {
+    uint32_t div = PIT_BASE_HZ / TIMER_HZ;
+    outb(PIT_CMD, 0x34);   // channel 0, lobyte/hibyte, mode 2 (rate generator)
+    outb(PIT_CH0, (uint8_t)(div & 0xFF));
+    outb(PIT_CH0, (uint8_t)((div >> 8) & 0xFF));
+    cpu_set_isr_handler(CPU_IRQ_BASE + 0, timer_irq);
+    cpu_irq_unmask(0);
+}
+
+uint64_t timer_ticks(void) {
+    return g_timer_ticks;
+}
+
+uint64_t timer_tsc_per_ms(void) {
+    return g_tsc_per_ms;
+}
+
+uint64_t timer_now_ns(void) {
+    uint64_t per_ms = __atomic_load_n(&g_tsc_per_ms, __ATOMIC_ACQUIRE);
+    if (!per_ms) return g_timer_ticks * (1000000ULL / TIMER_HZ);
+    uint64_t d = cpu_rdtsc() - g_tsc_base;
+    // Split so that d * 10^6 cannot overflow.
+    return g_ns_base + (d / per_ms) * 1000000ULL + (d % per_ms) * 1000000ULL / per_ms;
+}
+
+void ktimer_setup(ktimer_t *tm, ktimer_fn_t fn, void *arg) {
+    kmem_memset(tm, 0, sizeof(*tm));
+    tm->fn = fn;
+    tm->arg = arg;
+}
+
+void ktimer_arm(ktimer_t *tm, uint64_t expires, uint32_t period) {
+    uint64_t flags = spin_lock_irqsave(&g_wheel_lock);
+    if (tm->armed) wheel_unlink(tm);
+    if (expires <= g_wheel_now) expires = g_wheel_now + 1;
+    tm->expires = expires;
+    tm->period = period;
+    wheel_link(tm);
+    spin_unlock_irqrestore(&g_wheel_lock, flags);
+}
+
+void ktimer_cancel(ktimer_t *tm) {
+    uint64_t flags = spin_lock_irqsave(&g_wheel_lock);
+    if (tm->armed) wheel_unlink(tm);
+    spin_unlock_irqrestore(&g_wheel_lock, flags);
+}
@@ -134,8 +134,17 @@ static int ui_poll_event_impl(mljos_ui_event_t *out_event) {
     if (t->killed) task_exit();
 
     if (wm_window_poll_event(t->window, out_event)) return 1;
-    // No events: yield to WM/kernel.
-    task_yield();
+    uint32_t fired = task_take_timer_expirations(t);
+    if (fired) {
+        out_event->type = MLJOS_UI_EVENT_TIMER;
+        out_event->x = 0;
+        out_event->y = 0;
+        out_event->key = (int32_t)fired;
+        return 1;
+    }
+    // No events: apps call this in a loop, so sleep until the next event or timer tick
+    // instead of spinning through the scheduler.
+    wm_window_wait_event(t->window, 1);
     return 0;
 }
 
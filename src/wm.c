@@ -4,6 +4,7 @@
 #include "bmp.h"
 #include "clipboard.h"
 #include "console.h"
+#include "cpu.h"
 #include "disk.h"
 #include "font.h"
 #include "fs.h"
@@ -13,6 +14,7 @@
 #include "rtc.h"
 #include "task.h"
 #include "terminal_app.h"
+#include "timer.h"
 #include "users.h"
 
 #define WM_MAX_WINDOWS 16
@@ -58,6 +60,7 @@ typedef struct wm_event_queue {
     mljos_ui_event_t ev[WM_MAX_EVENTS];
     uint8_t head;
     uint8_t tail;
+    wait_queue_t waiters;   // tasks blocked in wm_window_wait_event()
 } wm_event_queue_t;
 
 struct wm_window {
@@ -115,12 +118,44 @@ static int g_mouse_right_prev = 0;
 static uint8_t g_mouse_pkt[4];
 static int g_mouse_pkt_i = 0;
 static int g_mouse_pkt_bytes = 3;
+static uint64_t g_mouse_pkt_tick = 0;
 static int g_mouse_moved = 0;
 static int g_context_menu_open = 0;
 static int g_context_menu_x = 0;
 static int g_context_menu_y = 0;
 static wm_window_t *g_context_menu_window = NULL;
 
+// Raw input captured by the IRQ1/IRQ12 handlers: keyboard scancodes and complete mouse packets
+// (packed little-endian into one word). The PIC only delivers to the BSP, so each ring has a
+// single producer (the handler) and a single consumer (wm_pump_input()) and needs no lock.
+#define PS2_RING_SIZE 256
+
+typedef struct ps2_ring {
+    volatile uint32_t head;   // written by the IRQ handler
+    volatile uint32_t tail;   // written by the consumer
+    uint32_t data[PS2_RING_SIZE];
+} ps2_ring_t;
+
+static ps2_ring_t g_kbd_ring;
+static ps2_ring_t g_mouse_ring;
+static uint32_t g_ps2_dropped = 0;
+
+static int ps2_ring_push(ps2_ring_t *r, uint32_t v) {
+    uint32_t head = r->head;
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= PS2_RING_SIZE) return 0;
+    r->data[head % PS2_RING_SIZE] = v;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static int ps2_ring_pop(ps2_ring_t *r, uint32_t *out) {
+    uint32_t tail = r->tail;
+    if (tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) return 0;
+    *out = r->data[tail % PS2_RING_SIZE];
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
 static void ps2_wait_input_empty(void) {
     while (inb(0x64) & 2) { }
 }
@@ -249,6 +284,55 @@ static void ps2_mouse_init(void) {
     ps2_flush_output();
 }
 
+// Mouse bytes arrive one per IRQ12. A packet starts with bit 3 set; a partial packet older than
+// a few ticks is stale (the device sends all bytes of a packet back to back), so it is dropped
+// instead of being completed with bytes of the next one.
+#define PS2_MOUSE_PKT_TIMEOUT_TICKS 20
+
+static void ps2_mouse_byte_irq(uint8_t b) {
+    uint64_t now = timer_ticks();
+    if (g_mouse_pkt_i != 0 && now - g_mouse_pkt_tick > PS2_MOUSE_PKT_TIMEOUT_TICKS) g_mouse_pkt_i = 0;
+    if (g_mouse_pkt_i == 0) {
+        if ((b & 0x08) == 0) return;
+        g_mouse_pkt_tick = now;
+    }
+    g_mouse_pkt[g_mouse_pkt_i++] = b;
+    if (g_mouse_pkt_i < g_mouse_pkt_bytes) return;
+    g_mouse_pkt_i = 0;
+    // X/Y overflow: the deltas are garbage.
+    if (g_mouse_pkt[0] & 0xC0) return;
+
+    uint32_t pkt = (uint32_t)g_mouse_pkt[0] | ((uint32_t)g_mouse_pkt[1] << 8) | ((uint32_t)g_mouse_pkt[2] << 16);
+    if (g_mouse_pkt_bytes == 4) pkt |= (uint32_t)g_mouse_pkt[3] << 24;
+    if (!ps2_ring_push(&g_mouse_ring, pkt)) g_ps2_dropped++;
+}
+
+// Shared by IRQ1 and IRQ12: the controller has one output buffer, so whichever IRQ fires first
+// drains both devices and routes each byte by the status register's AUX bit.
+static void ps2_irq(interrupt_frame_t *frame) {
+    while (inb(0x64) & 1) {
+        uint8_t st = inb(0x64);
+        uint8_t data = inb(0x60);
+        if (st & 0x20) {
+            ps2_mouse_byte_irq(data);
+        } else if (!ps2_ring_push(&g_kbd_ring, data)) {
+            g_ps2_dropped++;
+        }
+    }
+    cpu_irq_eoi((int)(frame->int_no - CPU_IRQ_BASE));
+}
+
+// Switches input from polling to interrupts. Only after ps2_mouse_init(): its polled
+// command/ack exchanges would race the handlers for port 0x60.
+static void ps2_irq_init(void) {
+    g_kbd_ring.head = g_kbd_ring.tail = 0;
+    g_mouse_ring.head = g_mouse_ring.tail = 0;
+    cpu_set_isr_handler(CPU_IRQ_BASE + 1, ps2_irq);
+    cpu_set_isr_handler(CPU_IRQ_BASE + 12, ps2_irq);
+    cpu_irq_unmask(1);
+    cpu_irq_unmask(12);
+}
+
 typedef enum {
     DRAG_NONE = 0,
     DRAG_MOVE = 1,
@@ -407,7 +491,9 @@ static void win_ensure_backbuffer(wm_window_t *w) {
     uint32_t old_pitch = w->client_pitch;
 
     uint64_t bytes = (uint64_t)w->client_w * (uint64_t)w->client_h * 4ULL;
-    w->client_px = (uint32_t *)kmem_alloc(bytes, 16);
+    uint32_t *px = (uint32_t *)kmem_alloc(bytes, 16);
+    if (!px) return;
+    w->client_px = px;
     w->client_pitch = (uint32_t)(w->client_w * 4);
     kmem_memset(w->client_px, 0, bytes);
     w->bb_w = w->client_w;
@@ -423,6 +509,7 @@ static void win_ensure_backbuffer(wm_window_t *w) {
             for (int xx = 0; xx < copy_w; ++xx) dst_row[xx] = src_row[xx];
         }
     }
+    kmem_free(old_px);
 }
 
 static void console_rebind_if_needed(wm_window_t *w) {
@@ -474,6 +561,7 @@ static int q_push(wm_event_queue_t *q, const mljos_ui_event_t *ev) {
     if (next == q->head) return 0;
     q->ev[q->tail] = *ev;
     q->tail = next;
+    wait_queue_wake_all(&q->waiters);
     return 1;
 }
 
@@ -984,7 +1072,10 @@ static int load_file_anywhere(const char *path, void **out_buf, uint32_t *out_si
         if (!ok) ok = disk_read_file(path, buf, (int)maxlen, &size);
     }
 
-    if (!ok || size == 0) return 0;
+    if (!ok || size == 0) {
+        kmem_free(buf);
+        return 0;
+    }
     *out_buf = buf;
     *out_size = size;
     return 1;
@@ -1001,15 +1092,22 @@ static void wm_try_load_wallpaper(void) {
     uint32_t *px = NULL;
     int w = 0;
     int h = 0;
-    if (!bmp_decode_rgb32(file, file_size, &px, &w, &h)) return;
-    if (w <= 0 || h <= 0) return;
+    int decoded = bmp_decode_rgb32(file, file_size, &px, &w, &h);
+    kmem_free(file);
+    if (!decoded) return;
+    if (w <= 0 || h <= 0) {
+        kmem_free(px);
+        return;
+    }
 
     // Scale once to screen size (nearest neighbor).
     uint32_t *scaled = NULL;
     if (w == (int)screen_w() && h == (int)screen_h()) {
         scaled = px;
     } else {
-        if (!bmp_scale_nearest_rgb32(px, w, h, &scaled, (int)screen_w(), (int)screen_h())) return;
+        int ok = bmp_scale_nearest_rgb32(px, w, h, &scaled, (int)screen_w(), (int)screen_h());
+        kmem_free(px);
+        if (!ok) return;
     }
 
     g_wallpaper = scaled;
@@ -1076,7 +1174,10 @@ static int load_icon_file_exact(const char *path, void **out_buf, uint32_t *out_
         if (!ok) ok = disk_read_file(path, buf, (int)file_size, &got);
     }
 
-    if (!ok || got != file_size) return 0;
+    if (!ok || got != file_size) {
+        kmem_free(buf);
+        return 0;
+    }
     *out_buf = buf;
     *out_size = file_size;
     return 1;
@@ -1089,6 +1190,7 @@ static uint32_t *wm_get_app_icon_scaled(const char *app_name, int target_px) {
 
     // Mark as attempted for this size/mode to avoid reloading missing icons every frame.
     e->loaded = 1;
+    kmem_free(e->px_scaled);
     e->px_scaled = NULL;
     e->scaled_w = target_px;
     e->scaled_h = target_px;
@@ -1111,16 +1213,21 @@ static uint32_t *wm_get_app_icon_scaled(const char *app_name, int target_px) {
         uint32_t *px = NULL;
         int w = 0;
         int h = 0;
-        if (!bmp_decode_rgb32(file, file_size, &px, &w, &h)) continue;
+        int decoded = bmp_decode_rgb32(file, file_size, &px, &w, &h);
+        kmem_free(file);
+        if (!decoded) continue;
 
         uint32_t *scaled = NULL;
         if (w == target_px && h == target_px) scaled = px;
         else {
+            int ok;
             if (g_icon_scale_mode == WM_ICON_SCALE_BILINEAR) {
-                if (!bmp_scale_bilinear_rgb32(px, w, h, &scaled, target_px, target_px)) continue;
+                ok = bmp_scale_bilinear_rgb32(px, w, h, &scaled, target_px, target_px);
             } else {
-                if (!bmp_scale_nearest_rgb32(px, w, h, &scaled, target_px, target_px)) continue;
+                ok = bmp_scale_nearest_rgb32(px, w, h, &scaled, target_px, target_px);
             }
+            kmem_free(px);
+            if (!ok) continue;
         }
 
         e->px_scaled = scaled;
@@ -1148,6 +1255,7 @@ void wm_init(void) {
     z_rebuild();
 
     ps2_mouse_init();
+    ps2_irq_init();
     g_mouse_x = (int)(screen_w() / 2);
     g_mouse_y = (int)(screen_h() / 2);
 
@@ -1168,6 +1276,7 @@ void wm_on_resolution_change(void) {
     if (sw <= 0 || sh <= 0) return;
 
     // Reset wallpaper so it is reloaded and scaled to the new size.
+    kmem_free(g_wallpaper);
     g_wallpaper = NULL;
     g_wallpaper_w = 0;
     g_wallpaper_h = 0;
@@ -1175,8 +1284,9 @@ void wm_on_resolution_change(void) {
     // Ensure backbuffer is large enough for the new size.
     uint64_t bytes = (uint64_t)sw * (uint64_t)sh * 4ULL;
     if (!g_backbuf || bytes > g_backbuf_bytes) {
+        kmem_free(g_backbuf);
         g_backbuf = (uint32_t *)kmem_alloc(bytes, 16);
-        g_backbuf_bytes = bytes;
+        g_backbuf_bytes = g_backbuf ? bytes : 0;
     }
     g_back_pitch = (uint32_t)(sw * 4);
     if (g_backbuf) kmem_memset(g_backbuf, 0, bytes);
@@ -1230,6 +1340,7 @@ void wm_on_resolution_change(void) {
 
 void wm_set_icon_scale_mode(wm_icon_scale_mode_t mode) {
     g_icon_scale_mode = mode;
+    for (int i = 0; i < WM_ICON_CACHE_MAX; ++i) kmem_free(g_icon_cache[i].px_scaled);
     kmem_memset(g_icon_cache, 0, sizeof(g_icon_cache));
     wm_mark_dirty();
 }
@@ -1298,6 +1409,11 @@ void wm_window_destroy(wm_window_t *w) {
     if (g_terminal_window == w) g_terminal_window = NULL;
     if (g_context_menu_window == w) context_menu_close();
     w->used = 0;
+    wait_queue_wake_all(&w->q.waiters);
+    kmem_free(w->client_px);
+    w->client_px = NULL;
+    w->bb_w = 0;
+    w->bb_h = 0;
     if (g_focused == w) g_focused = NULL;
     z_rebuild();
     wm_mark_dirty();
@@ -1424,6 +1540,14 @@ int wm_window_poll_event(wm_window_t *w, mljos_ui_event_t *out) {
     return q_pop(&w->q, out);
 }
 
+void wm_window_wait_event(wm_window_t *w, uint32_t timeout_ticks) {
+    task_t *t = task_current();
+    if (!w || !t) return;
+    task_wait_prepare(&w->q.waiters, timeout_ticks);
+    if (w->used && w->q.head == w->q.tail && !w->close_requested && !t->killed) task_yield();
+    task_wait_finish(&w->q.waiters);
+}
+
 void wm_window_post_expose(wm_window_t *w) {
     win_post_expose(w);
 }
@@ -1461,7 +1585,7 @@ static void window_terminal_sync_active(wm_window_t *w) {
 }
 
 static int window_all_terminal_tabs_dead(wm_window_t *w) {
-    if (!w || w->terminal_tab_count == 0) return (!w->owner || w->owner->state == TASK_DEAD);
+    if (!w || w->terminal_tab_count == 0) return !task_is_alive(w ? w->owner : NULL);
     for (int i = 0; i < (int)w->terminal_tab_count; ++i) {
         if (task_is_alive(w->terminal_tabs[i])) return 0;
     }
@@ -1485,11 +1609,15 @@ int wm_prompt_input(const char *title, const char *prompt, char *out_buf, int ma
     out_buf[0] = '\0';
     int done = 0;
     int status = 0;
+    int redraw = 1;
+    int painted_w = 0;
+    int painted_h = 0;
     
     while (!done) {
         mljos_ui_event_t ev;
         while (wm_window_poll_event(w, &ev)) {
             if (ev.type == MLJOS_UI_EVENT_KEY_DOWN) {
+                redraw = 1;
                 if (ev.key == '\n' || ev.key == '\r') {
                     status = 1;
                     done = 1;
@@ -1523,8 +1651,14 @@ int wm_prompt_input(const char *title, const char *prompt, char *out_buf, int ma
             done = 1;
         }
         
-        // Render the dialog content into the client canvas
-        if (w->client_px) {
+        // Render the dialog content into the client canvas. The expose posted below lands in
+        // our own queue, so only repaint after input or it would never let the task sleep. A
+        // resize keeps the old pixels and leaves the new area black: repaint on that too.
+        if (w->client_w != painted_w || w->client_h != painted_h) redraw = 1;
+        if (redraw && w->client_px) {
+            redraw = 0;
+            painted_w = w->client_w;
+            painted_h = w->client_h;
             fill_rect(w->client_px, w->client_pitch, w->client_w, w->client_h, 0, 0, w->client_w, w->client_h, 0x1E1E1E);
             draw_text(w->client_px, w->client_pitch, w->client_w, w->client_h, prompt, 15, 20, 0xCCCCCC);
             
@@ -1539,7 +1673,7 @@ int wm_prompt_input(const char *title, const char *prompt, char *out_buf, int ma
             wm_mark_dirty();
         }
         
-        task_yield();
+        if (!done) wm_window_wait_event(w, 0);
     }
     
     wm_window_destroy(w);
@@ -1636,21 +1770,14 @@ static int kbd_scancode_to_key(uint8_t sc) {
 
 static void handle_mouse_wheel(int delta);
 
-static void mouse_push_byte(uint8_t b) {
-    // First byte must have bit3 set; helps resync on packet loss.
-    if (g_mouse_pkt_i == 0 && (b & 0x08) == 0) return;
-    g_mouse_pkt[g_mouse_pkt_i++] = b;
-    if (g_mouse_pkt_i < g_mouse_pkt_bytes) return;
-    g_mouse_pkt_i = 0;
-
-    uint8_t b0 = g_mouse_pkt[0];
-    int dx = (int)((signed char)g_mouse_pkt[1]);
-    int dy = (int)((signed char)g_mouse_pkt[2]);
-    int wheel = 0;
-    if (g_mouse_pkt_bytes == 4) wheel = (int)((signed char)g_mouse_pkt[3]);
+// Applies one packet assembled by ps2_mouse_byte_irq().
+static void mouse_apply_packet(uint32_t pkt) {
+    uint8_t b0 = (uint8_t)pkt;
+    int dx = (int)((signed char)(pkt >> 8));
+    int dy = (int)((signed char)(pkt >> 16));
+    int wheel = (int)((signed char)(pkt >> 24));
 
     // Standard PS/2: dy is negative when moving up.
-    (void)b0;
     g_mouse_x += dx;
     g_mouse_y -= dy;
     if (dx != 0 || dy != 0) g_mouse_moved = 1;
@@ -1726,6 +1853,7 @@ static void win_minimize(wm_window_t *w) {
 static void win_request_close(wm_window_t *w, int hide_immediately) {
     if (!w) return;
     w->close_requested = 1;
+    wait_queue_wake_all(&w->q.waiters);
     if (w->terminal_tab_count > 0) {
         for (int i = 0; i < (int)w->terminal_tab_count; ++i) {
             if (w->terminal_tabs[i]) task_kill(w->terminal_tabs[i]);
@@ -2086,42 +2214,43 @@ static void handle_mouse_wheel(int delta) {
 }
 
 void wm_pump_input(void) {
-    // Drain available bytes from controller.
-    while (inb(0x64) & 1) {
-        uint8_t st = inb(0x64);
-        uint8_t data = inb(0x60);
-        if (st & 0x20) {
-            mouse_push_byte(data);
-        } else {
-            int key = kbd_scancode_to_key(data);
-            if (g_kbd_alt && (data & 0x7F) == 0x0F && !(data & 0x80)) { // Alt+Tab
-                if (g_zcount > 1) {
-                    int next_idx = -1;
-                    for (int i = g_zcount - 2; i >= 0; --i) {
-                        if (g_windows[g_zorder[i]].used && !g_windows[g_zorder[i]].minimized) {
-                            next_idx = g_zorder[i];
-                            break;
-                        }
-                    }
-                    if (next_idx >= 0) {
-                        z_focus_index(next_idx);
-                        g_focused = &g_windows[next_idx];
-                        wm_mark_dirty();
+    uint32_t v;
+    // Mouse packets first, one at a time: button transitions between two packets must each be
+    // seen by the handlers below.
+    while (ps2_ring_pop(&g_mouse_ring, &v)) {
+        mouse_apply_packet(v);
+        if (g_mouse_left != g_mouse_left_prev || g_mouse_right != g_mouse_right_prev) break;
+    }
+    while (ps2_ring_pop(&g_kbd_ring, &v)) {
+        uint8_t data = (uint8_t)v;
+        int key = kbd_scancode_to_key(data);
+        if (g_kbd_alt && (data & 0x7F) == 0x0F && !(data & 0x80)) { // Alt+Tab
+            if (g_zcount > 1) {
+                int next_idx = -1;
+                for (int i = g_zcount - 2; i >= 0; --i) {
+                    if (g_windows[g_zorder[i]].used && !g_windows[g_zorder[i]].minimized) {
+                        next_idx = g_zorder[i];
+                        break;
                     }
                 }
-            } else if (g_kbd_alt && (data & 0x7F) == 0x3E && !(data & 0x80)) { // Alt+F4
-                if (g_focused) {
-                    win_request_close(g_focused, 1);
-                }
-            } else if (key == 3 && g_focused && window_terminal_has_selection(g_focused)) {
-                (void)window_terminal_copy_selection(g_focused);
-            } else if (key && g_focused) {
-                if (key >= 32 || key == '\b' || key == '\n' || key == '\r' || key == 22) {
-                    if (window_terminal_has_selection(g_focused)) window_terminal_clear_selection(g_focused);
+                if (next_idx >= 0) {
+                    z_focus_index(next_idx);
+                    g_focused = &g_windows[next_idx];
+                    wm_mark_dirty();
                 }
-                if (g_context_menu_open) context_menu_close();
-                win_post_key(g_focused, key);
             }
+        } else if (g_kbd_alt && (data & 0x7F) == 0x3E && !(data & 0x80)) { // Alt+F4
+            if (g_focused) {
+                win_request_close(g_focused, 1);
+            }
+        } else if (key == 3 && g_focused && window_terminal_has_selection(g_focused)) {
+            (void)window_terminal_copy_selection(g_focused);
+        } else if (key && g_focused) {
+            if (key >= 32 || key == '\b' || key == '\n' || key == '\r' || key == 22) {
+                if (window_terminal_has_selection(g_focused)) window_terminal_clear_selection(g_focused);
+            }
+            if (g_context_menu_open) context_menu_close();
+            win_post_key(g_focused, key);
         }
     }
 
@@ -2207,6 +2336,8 @@ void wm_on_task_exit(task_t *t) {
         if (!w->used) continue;
         if (w->owner == t) {
             w->close_requested = 1;
+            // The task slot is reaped right after it switches out; drop the reference.
+            w->owner = NULL;
         }
         // Also check terminal tabs
         for (int j = 0; j < (int)w->terminal_tab_count; ++j) {
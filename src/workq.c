@@ -0,0 +1,91 @@
+#include "workq.h"
+
+#include "kmem.h"
+
+static work_t *g_workq_head = NULL;
+static work_t *g_workq_tail = NULL;
+static uint32_t g_workq_pending = 0;
+static wait_queue_t g_workq_idle;     // workers waiting for an item
+static int g_workq_workers = 0;
+
+static work_t *workq_pop(void) {
+    work_t *w = g_workq_head;
+    if (!w) return NULL;
+    g_workq_head = w->next;
+    if (!g_workq_head) g_workq_tail = NULL;
+    w->next = NULL;
+    return w;
+}
+
+static void workq_run(work_t *w) {
+    task_t *me = task_current();
+    console_t *saved = me ? me->console : NULL;
+    if (me) me->console = w->console;
+    int result = w->fn(w->arg);
+    if (me) me->console = saved;
+    g_workq_pending--;
+    // Waiters hold the kernel lock too, so none of them sees `done` before the wake-up.
+    w->result = result;
+    w->done = 1;
+    wait_queue_wake_all(&w->done_wq);
+    if (w->complete) w->complete(w);
+}
+
+static void workq_worker(void *arg) {
+    (void)arg;
+    for (;;) {
+        work_t *w = workq_pop();
+        if (w) {
+            workq_run(w);
+            continue;
+        }
+        task_wait_prepare(&g_workq_idle, 0);
+        if (!g_workq_head) task_yield();
+        task_wait_finish(&g_workq_idle);
+    }
+}
+
+void workq_init(void) {
+    for (int i = 0; i < WORKQ_WORKERS; ++i) {
+        if (task_create_kernel("kworker", workq_worker, NULL)) g_workq_workers++;
+    }
+}
+
+int workq_submit(work_t *w, work_fn_t fn, void *arg) {
+    if (!w || !fn || !g_workq_workers) return 0;
+    w->fn = fn;
+    w->arg = arg;
+    w->done = 0;
+    w->result = 0;
+    kmem_memset(&w->done_wq, 0, sizeof(w->done_wq));
+    w->next = NULL;
+    if (g_workq_tail) g_workq_tail->next = w;
+    else g_workq_head = w;
+    g_workq_tail = w;
+    g_workq_pending++;
+    wait_queue_wake_all(&g_workq_idle);
+    return 1;
+}
+
+int workq_wait(work_t *w) {
+    if (!w) return 0;
+    // Outside any task (kernel main loop) there is nothing to block: drain the queue inline.
+    if (!task_current()) {
+        while (!w->done) {
+            work_t *next = workq_pop();
+            if (!next) break;
+            workq_run(next);
+        }
+        return w->result;
+    }
+    while (!w->done) {
+        task_wait_prepare(&w->done_wq, 0);
+        if (!w->done) task_yield();
+        task_wait_finish(&w->done_wq);
+    }
+    return w->result;
+}
+
+uint32_t workq_pending(void) {
+    return g_workq_pending;
+}